@@ -0,0 +1,495 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <alsa/asoundlib.h>
+
+#include "../kernels.h"
+#include "../mod-alsactl.h"
+#include "../mod-cvport.h"
+#include "bench.h"
+#include "iio-tree.h"
+#include "jack-stub.h"
+
+#define BENCH_SAMPLE_RATE  48000
+#define BENCH_BATCH_CYCLES 64
+
+#define BENCH_ALSA_STARTUPS 20
+
+static const jack_nframes_t kBufferSizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+
+// every switch watched by either client
+static const char* const kAlsaSwitches[] = { "CV/Exp.Pedal Mode", "Exp.Pedal Mode", "Headphone/CV Mode" };
+#define BENCH_ALSA_SWITCHES (sizeof(kAlsaSwitches)/sizeof(kAlsaSwitches[0]))
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// clients print status messages to stdout, keep it clean for results
+static int quiet_begin(void)
+{
+    fflush(stdout);
+    const int saved = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    return saved;
+}
+
+static void quiet_end(const int saved)
+{
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+static void fill_port(jack_client_t* const client, const char* const name, const unsigned seed)
+{
+    float* const buffer = jack_stub_get_port_buffer(jack_stub_get_port(client, name));
+    uint32_t state = seed;
+
+    for (jack_nframes_t i = 0; i < JACK_STUB_MAX_BUFFER_SIZE; ++i)
+    {
+        state = state * 1664525u + 1013904223u;
+        buffer[i] = (float)(state >> 8) / (float)(1u << 24) * 10.0f;
+    }
+}
+
+static void fill_control_rate_port(jack_client_t* const client, const char* const name, const float value)
+{
+    mod_cv_port_buffer_t* const buffer = (mod_cv_port_buffer_t*)jack_stub_get_port_buffer(jack_stub_get_port(client, name));
+    mod_cv_port_writer_t writer = { 0.0f, 0 };
+
+    mod_cv_port_write(buffer, &writer, value, 0);
+}
+
+// runs cycles in batches until reaching the requested time, then prints one result line
+static void run_cycles(jack_client_t* const client, const char* const name, const char* const mode,
+                       const jack_nframes_t bufsize, const double seconds)
+{
+    jack_stub_set_buffer_size(client, bufsize);
+
+    // warm up
+    for (int i = 0; i < 100; ++i)
+        jack_stub_run_cycle(client);
+
+    const uint64_t limit = (uint64_t)(seconds * 1000000000.0);
+    const uint64_t start = now_ns();
+    uint64_t cycles = 0, elapsed;
+
+    do {
+        for (int i = 0; i < BENCH_BATCH_CYCLES; ++i)
+            jack_stub_run_cycle(client);
+
+        cycles += BENCH_BATCH_CYCLES;
+        elapsed = now_ns() - start;
+    } while (elapsed < limit);
+
+    const double ns_per_cycle = (double)elapsed / (double)cycles;
+
+    printf("%s,%s,%u,%llu,%.1f,%.3f\n",
+           name, mode, bufsize, (unsigned long long)cycles, ns_per_cycle, ns_per_cycle / (double)bufsize);
+    fflush(stdout);
+}
+
+// only the control-rate ports stay connected, as with consumers that do not need audio-rate CV
+static void disconnect_audio_rate_ports(jack_client_t* const client, const char* const names[], const size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        jack_stub_set_port_connected(jack_stub_get_port(client, names[i]), false);
+}
+
+static bool bench_spi2jack(const char* const device, const double seconds)
+{
+    // timing mode, whether to use the control-rate ports and mode names for cv and pedal
+    static const struct { const char* timing; bool control_rate; const char* names[2]; } kModes[] = {
+        { "ramp",     false, { "cv", "pedal" } },
+        { "placed",   false, { "cv-placed", "pedal-placed" } },
+        { "predict",  false, { "cv-predict", "pedal-predict" } },
+        { "resample", false, { "cv-resample", "pedal-resample" } },
+        { "ramp",     true,  { "cv-control", "pedal-control" } }
+    };
+    static const char* const kAudioRatePorts[] = { "capture_1", "capture_2", "exp_pedal" };
+
+    for (size_t m = 0; m < sizeof(kModes)/sizeof(kModes[0]); ++m)
+    {
+        setenv("MOD_SPI2JACK_TIMING", kModes[m].timing, 1);
+        setenv("MOD_SPI2JACK_CONTROL_RATE_PORTS", kModes[m].control_rate ? "1" : "0", 1);
+
+        jack_client_t* const client = jack_stub_client_new(128, BENCH_SAMPLE_RATE);
+
+        const int saved = quiet_begin();
+        void* const handle = bench_spi2jack_start(client, device);
+        quiet_end(saved);
+
+        if (handle == NULL)
+        {
+            fprintf(stderr, "Failed to start spi2jack\n");
+            jack_stub_client_free(client);
+            return false;
+        }
+
+        if (kModes[m].control_rate)
+            disconnect_audio_rate_ports(client, kAudioRatePorts, sizeof(kAudioRatePorts)/sizeof(kAudioRatePorts[0]));
+
+        for (int pedal = 0; pedal < 2; ++pedal)
+        {
+            bench_spi2jack_set_pedal_mode(handle, pedal != 0);
+
+            for (size_t i = 0; i < sizeof(kBufferSizes)/sizeof(kBufferSizes[0]); ++i)
+                run_cycles(client, "spi2jack", kModes[m].names[pedal], kBufferSizes[i], seconds);
+        }
+
+        bench_spi2jack_stop(handle);
+        jack_stub_client_free(client);
+    }
+
+    return true;
+}
+
+static bool bench_jack2spi(const char* const device, const double seconds)
+{
+    // mode name, reduction and whether to write from the process thread. control uses the control-rate ports
+    static const struct { const char* name; const char* reduce; bool thread; } kModes[] = {
+        { "median",        "median", false },
+        { "median-thread", "median", true  },
+        { "last",          "last",   false },
+        { "mean",          "mean",   false },
+        { "min",           "min",    false },
+        { "max",           "max",    false },
+        { "peak",          "peak",   false },
+        { "rms",           "rms",    false },
+        { "control",       "median", false }
+    };
+    static const char* const kAudioRatePorts[] = { "playback_1", "playback_2" };
+
+    for (size_t m = 0; m < sizeof(kModes)/sizeof(kModes[0]); ++m)
+    {
+        setenv("MOD_JACK2SPI_PROCESS_THREAD", kModes[m].thread ? "1" : "0", 1);
+        setenv("MOD_JACK2SPI_REDUCE", kModes[m].reduce, 1);
+        setenv("MOD_JACK2SPI_CONTROL_RATE_PORTS", strcmp(kModes[m].name, "control") == 0 ? "1" : "0", 1);
+
+        jack_client_t* const client = jack_stub_client_new(128, BENCH_SAMPLE_RATE);
+
+        const int saved = quiet_begin();
+        void* const handle = bench_jack2spi_start(client, device);
+        quiet_end(saved);
+
+        if (handle == NULL)
+        {
+            fprintf(stderr, "Failed to start jack2spi\n");
+            jack_stub_client_free(client);
+            return false;
+        }
+
+        bench_jack2spi_set_enabled(handle, true);
+        fill_port(client, "playback_1", 1);
+        fill_port(client, "playback_2", 2);
+
+        if (strcmp(kModes[m].name, "control") == 0)
+        {
+            fill_control_rate_port(client, "playback_1_control", 2.5f);
+            fill_control_rate_port(client, "playback_2_control", 7.5f);
+            disconnect_audio_rate_ports(client, kAudioRatePorts, sizeof(kAudioRatePorts)/sizeof(kAudioRatePorts[0]));
+        }
+
+        for (size_t i = 0; i < sizeof(kBufferSizes)/sizeof(kBufferSizes[0]); ++i)
+            run_cycles(client, "jack2spi", kModes[m].name, kBufferSizes[i], seconds);
+
+        bench_jack2spi_stop(handle);
+        jack_stub_client_free(client);
+    }
+
+    return true;
+}
+
+// compares the SIMD reductions against the scalar reference, for every mode and a range of block sizes.
+// blocks are aligned as JACK buffers are, odd sizes cover the scalar tails of the vector loops
+static bool check_reduce_kernels(void)
+{
+    static const char* const kReduceNames[mod_reduce_count] = { "median", "last", "mean", "min", "max", "peak", "rms" };
+    static const uint32_t kOddSizes[] = { 1, 2, 3, 5, 7, 15, 17, 31, 33, 100, 127, 129, 1000, 2047 };
+
+    float* buffer;
+    bool ok = true;
+
+    if (posix_memalign((void**)&buffer, 64, sizeof(float) * JACK_STUB_MAX_BUFFER_SIZE) != 0)
+        return false;
+
+    for (int mode = mod_reduce_last; mode < mod_reduce_count; ++mode)
+    {
+        const mod_reduce_kernel_t kernel = mod_kernels_get_reduce((mod_reduce_mode_t)mode);
+        const mod_reduce_kernel_t reference = mod_kernels_get_reduce_reference((mod_reduce_mode_t)mode);
+        // sums are accumulated in a different order, everything else must match exactly
+        const bool summed = mode == mod_reduce_mean || mode == mod_reduce_rms;
+
+        if (fabsf(kernel(buffer, 0)) > 0.0f || fabsf(reference(buffer, 0)) > 0.0f)
+        {
+            fprintf(stderr, "Reduction '%s' does not return 0 for empty blocks\n", kReduceNames[mode]);
+            ok = false;
+        }
+
+        for (size_t i = 0; i < sizeof(kBufferSizes)/sizeof(kBufferSizes[0]) + sizeof(kOddSizes)/sizeof(kOddSizes[0]); ++i)
+        {
+            const uint32_t nframes = i < sizeof(kBufferSizes)/sizeof(kBufferSizes[0])
+                                   ? kBufferSizes[i]
+                                   : kOddSizes[i - sizeof(kBufferSizes)/sizeof(kBufferSizes[0])];
+            uint32_t state = nframes * 2654435761u + (uint32_t)mode;
+
+            // -10V..10V, so that min, max and peak differ
+            for (uint32_t f = 0; f < nframes; ++f)
+            {
+                state = state * 1664525u + 1013904223u;
+                buffer[f] = (float)(state >> 8) / (float)(1u << 24) * 20.0f - 10.0f;
+            }
+
+            const float value = kernel(buffer, nframes);
+            const float expected = reference(buffer, nframes);
+            const float tolerance = summed ? 1e-5f * (1.0f + fabsf(expected)) : 0.0f;
+
+            if (fabsf(value - expected) > tolerance)
+            {
+                fprintf(stderr, "Reduction '%s' mismatch for %u frames: %.9g, reference %.9g\n",
+                        kReduceNames[mode], nframes, value, expected);
+                ok = false;
+            }
+        }
+    }
+
+    free(buffer);
+    return ok;
+}
+
+// the previous client setup, loading the whole card through the simple mixer
+static bool alsa_mixer_open(snd_mixer_t** const mixer, snd_mixer_elem_t* elems[BENCH_ALSA_SWITCHES], const char* const card)
+{
+    char soundcard[32];
+    snprintf(soundcard, sizeof(soundcard), "hw:%s", card);
+
+    snd_mixer_selem_id_t* sid;
+
+    if (snd_mixer_open(mixer, SND_MIXER_ELEM_SIMPLE) != 0)
+        return false;
+
+    if (snd_mixer_attach(*mixer, soundcard) != 0 ||
+        snd_mixer_selem_register(*mixer, NULL, NULL) != 0 ||
+        snd_mixer_load(*mixer) != 0 ||
+        snd_mixer_selem_id_malloc(&sid) != 0)
+    {
+        snd_mixer_close(*mixer);
+        return false;
+    }
+
+    bool ok = true;
+
+    for (size_t i = 0; i < BENCH_ALSA_SWITCHES; ++i)
+    {
+        snd_mixer_selem_id_set_index(sid, 0);
+        snd_mixer_selem_id_set_name(sid, kAlsaSwitches[i]);
+        elems[i] = snd_mixer_find_selem(*mixer, sid);
+        ok = ok && elems[i] != NULL;
+    }
+
+    snd_mixer_selem_id_free(sid);
+
+    if (! ok)
+        snd_mixer_close(*mixer);
+
+    return ok;
+}
+
+static bool alsa_ctl_open(mod_alsactl_t* const alsactl, const char* const card)
+{
+    if (! mod_alsactl_open(alsactl, card))
+        return false;
+
+    for (size_t i = 0; i < BENCH_ALSA_SWITCHES; ++i)
+    {
+        if (mod_alsactl_add_switch(alsactl, kAlsaSwitches[i]) < 0)
+        {
+            mod_alsactl_close(alsactl);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void print_alsa_result(const char* const path, const char* const name,
+                              const uint64_t iterations, const uint64_t elapsed)
+{
+    printf("%s,%s,%llu,%.1f\n",
+           path, name, (unsigned long long)iterations, (double)elapsed / (double)iterations);
+    fflush(stdout);
+}
+
+// compares simple mixer and direct ctl access to the mode switches of a real card:
+// setup and teardown time, and the cost of checking for changes on each loop of the client threads
+static bool bench_alsa(const char* const card, const double seconds)
+{
+    snd_mixer_t* mixer;
+    snd_mixer_elem_t* elems[BENCH_ALSA_SWITCHES];
+    mod_alsactl_t alsactl;
+    uint64_t start, elapsed, iterations;
+
+    printf("path,case,iterations,ns_per_iteration\n");
+
+    start = now_ns();
+    for (int i = 0; i < BENCH_ALSA_STARTUPS; ++i)
+    {
+        if (! alsa_mixer_open(&mixer, elems, card))
+        {
+            fprintf(stderr, "Cannot find the mode switches on card '%s' through the simple mixer\n", card);
+            return false;
+        }
+        snd_mixer_close(mixer);
+    }
+    print_alsa_result("mixer", "startup", BENCH_ALSA_STARTUPS, now_ns() - start);
+
+    start = now_ns();
+    for (int i = 0; i < BENCH_ALSA_STARTUPS; ++i)
+    {
+        if (! alsa_ctl_open(&alsactl, card))
+        {
+            fprintf(stderr, "Cannot find the mode switches on card '%s' through the ctl interface\n", card);
+            return false;
+        }
+        mod_alsactl_close(&alsactl);
+    }
+    print_alsa_result("ctl", "startup", BENCH_ALSA_STARTUPS, now_ns() - start);
+
+    const uint64_t limit = (uint64_t)(seconds * 1000000000.0);
+    volatile int sink = 0;
+    int value;
+
+    alsa_mixer_open(&mixer, elems, card);
+    iterations = 0;
+    start = now_ns();
+    do {
+        for (int i = 0; i < BENCH_BATCH_CYCLES; ++i)
+        {
+            snd_mixer_handle_events(mixer);
+
+            for (size_t e = 0; e < BENCH_ALSA_SWITCHES; ++e)
+            {
+                snd_mixer_selem_get_playback_switch(elems[e], SND_MIXER_SCHN_MONO, &value);
+                sink += value;
+            }
+        }
+
+        iterations += BENCH_BATCH_CYCLES;
+        elapsed = now_ns() - start;
+    } while (elapsed < limit);
+    print_alsa_result("mixer", "idle-check", iterations, elapsed);
+    snd_mixer_close(mixer);
+
+    alsa_ctl_open(&alsactl, card);
+    iterations = 0;
+    start = now_ns();
+    do {
+        for (int i = 0; i < BENCH_BATCH_CYCLES; ++i)
+        {
+            if (mod_alsactl_handle_events(&alsactl))
+                for (size_t e = 0; e < BENCH_ALSA_SWITCHES; ++e)
+                    sink += mod_alsactl_get_switch(&alsactl, (int)e) ? 1 : 0;
+        }
+
+        iterations += BENCH_BATCH_CYCLES;
+        elapsed = now_ns() - start;
+    } while (elapsed < limit);
+    print_alsa_result("ctl", "idle-check", iterations, elapsed);
+    mod_alsactl_close(&alsactl);
+
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = 1.0;
+    bool run_spi2jack = true, run_jack2spi = true;
+    const char* alsa_card = NULL;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            seconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+        {
+            alsa_card = argv[++i];
+        }
+        else if (strcmp(argv[i], "spi2jack") == 0)
+        {
+            run_jack2spi = false;
+        }
+        else if (strcmp(argv[i], "jack2spi") == 0)
+        {
+            run_spi2jack = false;
+        }
+        else
+        {
+            fprintf(stdout, "Usage: %s [-t <seconds per case>] [spi2jack|jack2spi]\n", argv[0]);
+            fprintf(stdout, "\tRuns process callbacks against a JACK stub, printing CSV results\n");
+            fprintf(stdout, "   or: %s [-t <seconds per case>] -a <card id>\n", argv[0]);
+            fprintf(stdout, "\tCompares alsa mixer and ctl access to the mode switches of a real card\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (alsa_card != NULL)
+        return bench_alsa(alsa_card, seconds) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    // timing kernels that give wrong results would be pointless
+    if (! check_reduce_kernels())
+        return EXIT_FAILURE;
+
+    // make sure the alsa mixer is never found
+    setenv("MOD_SOUNDCARD", "mod-cv-bench-none", 1);
+
+    char device[128];
+    if (! iio_tree_create(device, sizeof(device), "mod-cv-bench"))
+    {
+        fprintf(stderr, "Cannot create iio tree\n");
+        return EXIT_FAILURE;
+    }
+
+    iio_tree_set_raw(device, "in_voltage0_raw", 1024);
+    iio_tree_set_raw(device, "in_voltage1_raw", 3072);
+
+    printf("client,mode,nframes,cycles,ns_per_cycle,ns_per_sample\n");
+
+    bool ok = true;
+
+    if (run_spi2jack)
+        ok = bench_spi2jack(device, seconds) && ok;
+    if (run_jack2spi)
+        ok = bench_jack2spi(device, seconds) && ok;
+
+    iio_tree_destroy(device);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
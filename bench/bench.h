@@ -0,0 +1,42 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BENCH_H_INCLUDED
+#define BENCH_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <jack/jack.h>
+
+// each client source is built into its own translation unit, these give access to its internals.
+// start functions return the client private data, or NULL on failure.
+
+void* bench_spi2jack_start(jack_client_t* client, const char* device);
+void bench_spi2jack_set_pedal_mode(void* handle, bool pedal);
+void bench_spi2jack_stop(void* handle);
+
+void* bench_jack2spi_start(jack_client_t* client, const char* device);
+void bench_jack2spi_set_enabled(void* handle, bool enabled);
+void bench_jack2spi_stop(void* handle);
+
+// delay added to every file read and write of the clients, 0 for none
+void bench_set_io_delay(unsigned usecs);
+size_t bench_fread(void* ptr, size_t size, size_t nmemb, FILE* f);
+size_t bench_fwrite(const void* ptr, size_t size, size_t nmemb, FILE* f);
+
+#endif // BENCH_H_INCLUDED
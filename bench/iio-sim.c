@@ -0,0 +1,450 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// for ppoll
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/inotify.h>
+
+#include "iio-tree.h"
+
+/*
+ * Stand-in for the Duo X converters, using a fake iio device tree made of regular files on tmpfs.
+ *
+ * Inputs play scripted waveforms, every output write is recorded with a timestamp.
+ * In loopback mode outputs are wired back to the inputs, simulating a cable from CV out to CV in.
+ *
+ * Regular files cannot block the clients, so access latency is simulated on this side:
+ * new input samples and looped-back outputs only become visible after the configured latency.
+ */
+
+#define SIM_MAX_RAW      4095
+#define SIM_MAX_PENDING  1024
+#define SIM_MAX_SCRIPT   4096
+
+typedef enum {
+    wave_const,
+    wave_sine,
+    wave_square,
+    wave_ramp,
+    wave_script
+} wave_type_t;
+
+typedef struct {
+    wave_type_t type;
+    double freq;
+    int min, max;
+    // script, as time in ms and raw value pairs
+    unsigned script_count;
+    uint32_t script_ms[SIM_MAX_SCRIPT];
+    int script_raw[SIM_MAX_SCRIPT];
+} wave_t;
+
+typedef struct {
+    uint64_t due_ns;
+    int channel;
+    int raw;
+} pending_t;
+
+typedef struct {
+    uint64_t writes;
+    int last_raw;
+} dac_stats_t;
+
+static volatile sig_atomic_t running = 1;
+
+static void signal_handler(int sig)
+{
+    running = 0;
+    return; (void)sig;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t delay_ns(const unsigned latency_us, const unsigned jitter_us)
+{
+    const unsigned jitter = jitter_us != 0 ? (unsigned)rand() % jitter_us : 0;
+    return (uint64_t)(latency_us + jitter) * 1000;
+}
+
+static int clamp_raw(const int raw)
+{
+    return raw < 0 ? 0 : raw > SIM_MAX_RAW ? SIM_MAX_RAW : raw;
+}
+
+static bool load_script(wave_t* const wave, const char* const filename)
+{
+    FILE* const f = fopen(filename, "r");
+    if (f == NULL)
+        return false;
+
+    char line[128];
+    unsigned ms;
+    int raw;
+
+    while (wave->script_count < SIM_MAX_SCRIPT && fgets(line, sizeof(line), f) != NULL)
+    {
+        if (line[0] == '#' || sscanf(line, "%u %d", &ms, &raw) != 2)
+            continue;
+
+        wave->script_ms[wave->script_count] = ms;
+        wave->script_raw[wave->script_count] = clamp_raw(raw);
+        ++wave->script_count;
+    }
+
+    fclose(f);
+    return wave->script_count != 0;
+}
+
+// type[:freq[:min:max]], const:<raw> or script:<file>
+static bool parse_wave(wave_t* const wave, const char* const spec)
+{
+    memset(wave, 0, sizeof(*wave));
+    wave->freq = 1.0;
+    wave->max = SIM_MAX_RAW;
+
+    if (strncmp(spec, "const:", 6) == 0)
+    {
+        wave->type = wave_const;
+        wave->min = wave->max = clamp_raw(atoi(spec + 6));
+        return true;
+    }
+
+    if (strncmp(spec, "script:", 7) == 0)
+    {
+        wave->type = wave_script;
+        return load_script(wave, spec + 7);
+    }
+
+    char type[16];
+    double freq;
+    int min, max;
+    const int count = sscanf(spec, "%15[a-z]:%lf:%d:%d", type, &freq, &min, &max);
+
+    if (count < 1)
+        return false;
+
+    if (strcmp(type, "sine") == 0)
+        wave->type = wave_sine;
+    else if (strcmp(type, "square") == 0)
+        wave->type = wave_square;
+    else if (strcmp(type, "ramp") == 0)
+        wave->type = wave_ramp;
+    else
+        return false;
+
+    if (count >= 2)
+        wave->freq = freq;
+
+    if (count >= 4)
+    {
+        wave->min = clamp_raw(min);
+        wave->max = clamp_raw(max);
+    }
+
+    return true;
+}
+
+static int wave_value(const wave_t* const wave, const double t)
+{
+    const double phase = t * wave->freq - floor(t * wave->freq);
+    const double range = (double)(wave->max - wave->min);
+
+    switch (wave->type)
+    {
+    case wave_const:
+        return wave->min;
+    case wave_sine:
+        return wave->min + (int)(range * (0.5 + 0.5 * sin(2.0 * M_PI * phase)) + 0.5);
+    case wave_square:
+        return phase < 0.5 ? wave->max : wave->min;
+    case wave_ramp:
+        return wave->min + (int)(range * phase + 0.5);
+    case wave_script: {
+        const uint32_t ms = (uint32_t)(t * 1000.0);
+        int raw = wave->script_raw[0];
+
+        for (unsigned i = 0; i < wave->script_count && wave->script_ms[i] <= ms; ++i)
+            raw = wave->script_raw[i];
+
+        return raw;
+    }
+    }
+
+    return 0;
+}
+
+static void usage(const char* const argv0)
+{
+    fprintf(stdout, "Usage: %s [options]\n", argv0);
+    fprintf(stdout, "\t-d <dir>        device directory to create, a temporary one on tmpfs by default\n");
+    fprintf(stdout, "\t-1 <wave>       waveform for input 1 (default const:0)\n");
+    fprintf(stdout, "\t-2 <wave>       waveform for input 2 (default const:0)\n");
+    fprintf(stdout, "\t-r <hz>         input sample rate (default 1000)\n");
+    fprintf(stdout, "\t-l <us>         simulated conversion latency (default 0)\n");
+    fprintf(stdout, "\t-j <us>         random jitter added to the latency (default 0)\n");
+    fprintf(stdout, "\t-o <file>       record output writes as CSV 'time_ns,channel,raw' (default stdout)\n");
+    fprintf(stdout, "\t-w              wire outputs back to inputs instead of playing waveforms\n");
+    fprintf(stdout, "\t-t <seconds>    stop after this time (default runs until interrupted)\n");
+    fprintf(stdout, "\n");
+    fprintf(stdout, "Waveforms are 'sine', 'square' or 'ramp', optionally followed by ':<hz>:<min raw>:<max raw>'.\n");
+    fprintf(stdout, "Also 'const:<raw>', or 'script:<file>' with '<time ms> <raw>' lines.\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* dirarg = NULL;
+    const char* outfile = NULL;
+    wave_t waves[IIO_TREE_CHANNELS];
+    double rate = 1000.0, duration = 0.0;
+    unsigned latency_us = 0, jitter_us = 0;
+    bool loopback = false;
+
+    parse_wave(&waves[0], "const:0");
+    parse_wave(&waves[1], "const:0");
+
+    for (int i = 1; i < argc; ++i)
+    {
+        const bool hasarg = i + 1 < argc;
+
+        if (strcmp(argv[i], "-d") == 0 && hasarg)
+            dirarg = argv[++i];
+        else if ((strcmp(argv[i], "-1") == 0 || strcmp(argv[i], "-2") == 0) && hasarg)
+        {
+            const int c = argv[i][1] - '1';
+
+            if (! parse_wave(&waves[c], argv[++i]))
+            {
+                fprintf(stderr, "Invalid waveform '%s'\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "-r") == 0 && hasarg)
+            rate = atof(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && hasarg)
+            latency_us = (unsigned)atoi(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && hasarg)
+            jitter_us = (unsigned)atoi(argv[++i]);
+        else if (strcmp(argv[i], "-o") == 0 && hasarg)
+            outfile = argv[++i];
+        else if (strcmp(argv[i], "-w") == 0)
+            loopback = true;
+        else if (strcmp(argv[i], "-t") == 0 && hasarg)
+            duration = atof(argv[++i]);
+        else
+        {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (rate <= 0.0)
+        rate = 1000.0;
+
+    // setup device tree
+    char dir[256];
+
+    if (dirarg != NULL)
+    {
+        snprintf(dir, sizeof(dir), "%s", dirarg);
+
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+        {
+            fprintf(stderr, "Cannot create '%s'\n", dir);
+            return EXIT_FAILURE;
+        }
+
+        if (! iio_tree_populate(dir, "mod-iio-sim"))
+        {
+            fprintf(stderr, "Cannot create device files in '%s'\n", dir);
+            return EXIT_FAILURE;
+        }
+    }
+    else if (! iio_tree_create(dir, sizeof(dir), "mod-iio-sim"))
+    {
+        fprintf(stderr, "Cannot create iio tree\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE* const out = outfile != NULL ? fopen(outfile, "w") : stdout;
+    if (out == NULL)
+    {
+        fprintf(stderr, "Cannot open '%s'\n", outfile);
+        return EXIT_FAILURE;
+    }
+
+    // watch outputs for writes
+    const int inotifyfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    int watches[IIO_TREE_CHANNELS];
+
+    for (int c = 0; c < IIO_TREE_CHANNELS; ++c)
+    {
+        char path[300];
+        snprintf(path, sizeof(path), "%s/out_voltage%d_raw", dir, c);
+        watches[c] = inotify_add_watch(inotifyfd, path, IN_MODIFY);
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    fprintf(stderr, "Simulating iio device at '%s'\n", dir);
+    fprintf(out, "time_ns,channel,raw\n");
+
+    static pending_t pending[SIM_MAX_PENDING];
+    unsigned pending_count = 0;
+
+    dac_stats_t dacstats[IIO_TREE_CHANNELS];
+    memset(dacstats, 0, sizeof(dacstats));
+
+    uint64_t adc_updates = 0;
+    const uint64_t start_ns = now_ns();
+    const uint64_t period_ns = (uint64_t)(1000000000.0 / rate);
+    uint64_t next_sample_ns = start_ns;
+    char evbuf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (running)
+    {
+        uint64_t now = now_ns();
+
+        if (duration > 0.0 && (double)(now - start_ns) >= duration * 1000000000.0)
+            break;
+
+        // generate input samples
+        if (! loopback && now >= next_sample_ns)
+        {
+            const double t = (double)(next_sample_ns - start_ns) / 1000000000.0;
+
+            for (int c = 0; c < IIO_TREE_CHANNELS && pending_count < SIM_MAX_PENDING; ++c)
+            {
+                pending[pending_count].due_ns  = next_sample_ns + delay_ns(latency_us, jitter_us);
+                pending[pending_count].channel = c;
+                pending[pending_count].raw     = wave_value(&waves[c], t);
+                ++pending_count;
+            }
+
+            next_sample_ns += period_ns;
+        }
+
+        // record output writes, a single write can trigger more than one event
+        const ssize_t len = read(inotifyfd, evbuf, sizeof(evbuf));
+        bool written[IIO_TREE_CHANNELS] = { false, false };
+        now = now_ns();
+
+        for (ssize_t off = 0; off < len;)
+        {
+            const struct inotify_event* const ev = (const struct inotify_event*)(evbuf + off);
+            off += (ssize_t)(sizeof(struct inotify_event) + ev->len);
+
+            for (int c = 0; c < IIO_TREE_CHANNELS; ++c)
+                if (ev->wd == watches[c])
+                    written[c] = true;
+        }
+
+        for (int c = 0; c < IIO_TREE_CHANNELS; ++c)
+        {
+            if (! written[c])
+                continue;
+
+            char file[32];
+            snprintf(file, sizeof(file), "out_voltage%d_raw", c);
+
+            const int raw = iio_tree_get_raw(dir, file);
+            if (raw < 0)
+                continue;
+
+            fprintf(out, "%llu,%d,%d\n", (unsigned long long)(now - start_ns), c + 1, raw);
+
+            ++dacstats[c].writes;
+            dacstats[c].last_raw = raw;
+
+            if (loopback && pending_count < SIM_MAX_PENDING)
+            {
+                pending[pending_count].due_ns  = now + delay_ns(latency_us, jitter_us);
+                pending[pending_count].channel = c;
+                pending[pending_count].raw     = raw;
+                ++pending_count;
+            }
+        }
+
+        // publish due input values, in order
+        for (unsigned i = 0; i < pending_count;)
+        {
+            if (pending[i].due_ns > now)
+            {
+                ++i;
+                continue;
+            }
+
+            char file[32];
+            snprintf(file, sizeof(file), "in_voltage%d_raw", pending[i].channel);
+            iio_tree_set_raw(dir, file, pending[i].raw);
+            ++adc_updates;
+
+            memmove(&pending[i], &pending[i+1], sizeof(pending_t) * (pending_count - i - 1));
+            --pending_count;
+        }
+
+        // sleep until the next input sample, or until an output is written
+        uint64_t wait_ns = loopback ? 1000000 : (next_sample_ns > now ? next_sample_ns - now : 0);
+
+        for (unsigned i = 0; i < pending_count; ++i)
+            if (pending[i].due_ns > now && pending[i].due_ns - now < wait_ns)
+                wait_ns = pending[i].due_ns - now;
+
+        struct pollfd pfd = { inotifyfd, POLLIN, 0 };
+        const struct timespec timeout = { (time_t)(wait_ns / 1000000000ULL), (long)(wait_ns % 1000000000ULL) };
+        ppoll(&pfd, 1, &timeout, NULL);
+    }
+
+    // summary
+    const double elapsed = (double)(now_ns() - start_ns) / 1000000000.0;
+    fprintf(stderr, "Ran for %.2fs, %llu input updates\n", elapsed, (unsigned long long)adc_updates);
+
+    for (int c = 0; c < IIO_TREE_CHANNELS; ++c)
+    {
+        fprintf(stderr, "Output %d: %llu writes, %.1f writes/s, last raw %d\n",
+                c + 1, (unsigned long long)dacstats[c].writes,
+                elapsed > 0.0 ? (double)dacstats[c].writes / elapsed : 0.0, dacstats[c].last_raw);
+    }
+
+    close(inotifyfd);
+
+    if (out != stdout)
+        fclose(out);
+
+    if (dirarg == NULL)
+        iio_tree_destroy(dir);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,150 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IIO_TREE_H_INCLUDED
+#define IIO_TREE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// fake iio device directory, with the same files the clients use from sysfs.
+// created on tmpfs when available, so that file access cost is close to sysfs.
+
+#define IIO_TREE_CHANNELS 2
+
+static inline
+bool iio_tree_write_file(const char* const dir, const char* const file, const char* const contents)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    FILE* const f = fopen(path, "w");
+    if (f == NULL)
+        return false;
+
+    fputs(contents, f);
+    fclose(f);
+    return true;
+}
+
+// overwrites the value in place, keeping the file open by clients valid.
+// values are padded to a fixed width so a concurrent reader never sees a partial number.
+static inline
+bool iio_tree_set_raw(const char* const dir, const char* const file, const int raw)
+{
+    char path[512], buf[16];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    const int fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return false;
+
+    const int len = snprintf(buf, sizeof(buf), "%-7d\n", raw);
+    const bool ok = pwrite(fd, buf, (size_t)len, 0) == len;
+
+    close(fd);
+    return ok;
+}
+
+static inline
+int iio_tree_get_raw(const char* const dir, const char* const file)
+{
+    char path[512], buf[16];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    memset(buf, 0, sizeof(buf));
+    const ssize_t len = pread(fd, buf, sizeof(buf)-1, 0);
+    close(fd);
+
+    return len > 0 ? atoi(buf) : -1;
+}
+
+// writes the device files into an existing directory
+static inline
+bool iio_tree_populate(const char* const dir, const char* const name)
+{
+    char file[32], contents[64];
+    snprintf(contents, sizeof(contents), "%s\n", name);
+
+    if (! iio_tree_write_file(dir, "name", contents))
+        return false;
+
+    for (int c = 0; c < IIO_TREE_CHANNELS; ++c)
+    {
+        snprintf(file, sizeof(file), "in_voltage%d_raw", c);
+        if (! iio_tree_write_file(dir, file, "0\n"))
+            return false;
+
+        snprintf(file, sizeof(file), "out_voltage%d_raw", c);
+        if (! iio_tree_write_file(dir, file, "0\n"))
+            return false;
+    }
+
+    return true;
+}
+
+// creates the device directory, dir must be able to hold at least 64 chars
+static inline
+bool iio_tree_create(char* const dir, const size_t dirsize, const char* const name)
+{
+    const char* tmpdir = "/dev/shm";
+
+    if (access(tmpdir, W_OK) != 0)
+    {
+        tmpdir = getenv("TMPDIR");
+        if (tmpdir == NULL || tmpdir[0] == '\0')
+            tmpdir = "/tmp";
+    }
+
+    snprintf(dir, dirsize, "%s/mod-iio-XXXXXX", tmpdir);
+
+    if (mkdtemp(dir) == NULL)
+        return false;
+
+    return iio_tree_populate(dir, name);
+}
+
+static inline
+void iio_tree_destroy(const char* const dir)
+{
+    char path[512];
+
+    snprintf(path, sizeof(path), "%s/name", dir);
+    unlink(path);
+
+    for (int c = 0; c < IIO_TREE_CHANNELS; ++c)
+    {
+        snprintf(path, sizeof(path), "%s/in_voltage%d_raw", dir, c);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s/out_voltage%d_raw", dir, c);
+        unlink(path);
+    }
+
+    rmdir(dir);
+}
+
+#endif // IIO_TREE_H_INCLUDED
@@ -0,0 +1,373 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "jack-stub.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <jack/metadata.h>
+#include <jack/midiport.h>
+#include <jack/uuid.h>
+
+#define JACK_STUB_MAX_PORTS 16
+
+struct _jack_port {
+    char name[64];
+    char type[64];
+    unsigned long flags;
+    volatile bool connected;
+    float* buffer;
+};
+
+struct _jack_client {
+    jack_nframes_t bufsize, srate;
+    jack_nframes_t frames;
+    jack_time_t cycle_usecs;
+    JackProcessCallback process;
+    void* process_arg;
+    JackBufferSizeCallback bufsize_cb;
+    void* bufsize_arg;
+    JackXRunCallback xrun_cb;
+    void* xrun_arg;
+    JackFreewheelCallback freewheel_cb;
+    void* freewheel_arg;
+    // process thread mode, cycles are handed over to the client thread
+    JackThreadCallback thread_cb;
+    pthread_t thread;
+    bool thread_running, thread_quit;
+    sem_t cycle_start, cycle_done;
+    struct _jack_port ports[JACK_STUB_MAX_PORTS];
+    unsigned port_count;
+};
+
+const char* JACK_METADATA_PRETTY_NAME = "http://jackaudio.org/metadata/pretty-name";
+const char* JACK_METADATA_SIGNAL_TYPE = "http://jackaudio.org/metadata/signal-type";
+const char* JACK_METADATA_ORDER       = "http://jackaudio.org/metadata/order";
+
+// -------------------------------------------------------------------------------------------------------------------
+// stub control
+
+jack_client_t* jack_stub_client_new(const jack_nframes_t bufsize, const jack_nframes_t srate)
+{
+    jack_client_t* const client = calloc(1, sizeof(jack_client_t));
+
+    if (client == NULL)
+        return NULL;
+
+    client->bufsize = bufsize;
+    client->srate = srate;
+    client->cycle_usecs = jack_get_time();
+    sem_init(&client->cycle_start, 0, 0);
+    sem_init(&client->cycle_done, 0, 0);
+    return client;
+}
+
+void jack_stub_client_free(jack_client_t* const client)
+{
+    for (unsigned i = 0; i < client->port_count; ++i)
+        free(client->ports[i].buffer);
+
+    sem_destroy(&client->cycle_start);
+    sem_destroy(&client->cycle_done);
+    free(client);
+}
+
+void* jack_stub_get_process_arg(jack_client_t* const client)
+{
+    return client->process_arg;
+}
+
+int jack_stub_run_cycle(jack_client_t* const client)
+{
+    client->cycle_usecs = jack_get_time();
+
+    int ret = 0;
+
+    if (client->thread_running)
+    {
+        // returns once the client signals the cycle, like the server does
+        sem_post(&client->cycle_start);
+        sem_wait(&client->cycle_done);
+    }
+    else if (client->process != NULL)
+    {
+        ret = client->process(client->bufsize, client->process_arg);
+    }
+
+    client->frames += client->bufsize;
+    return ret;
+}
+
+void jack_stub_set_buffer_size(jack_client_t* const client, const jack_nframes_t bufsize)
+{
+    client->bufsize = bufsize;
+
+    if (client->bufsize_cb != NULL)
+        client->bufsize_cb(bufsize, client->bufsize_arg);
+}
+
+void jack_stub_xrun(jack_client_t* const client)
+{
+    if (client->xrun_cb != NULL)
+        client->xrun_cb(client->xrun_arg);
+}
+
+void jack_stub_set_freewheel(jack_client_t* const client, const bool freewheel)
+{
+    if (client->freewheel_cb != NULL)
+        client->freewheel_cb(freewheel ? 1 : 0, client->freewheel_arg);
+}
+
+jack_port_t* jack_stub_get_port(jack_client_t* const client, const char* const name)
+{
+    for (unsigned i = 0; i < client->port_count; ++i)
+        if (strcmp(client->ports[i].name, name) == 0)
+            return &client->ports[i];
+
+    return NULL;
+}
+
+float* jack_stub_get_port_buffer(jack_port_t* const port)
+{
+    return port->buffer;
+}
+
+void jack_stub_set_port_connected(jack_port_t* const port, const bool connected)
+{
+    port->connected = connected;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// jack API
+
+jack_nframes_t jack_get_buffer_size(jack_client_t* const client)
+{
+    return client->bufsize;
+}
+
+jack_nframes_t jack_get_sample_rate(jack_client_t* const client)
+{
+    return client->srate;
+}
+
+jack_time_t jack_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (jack_time_t)ts.tv_sec * 1000000ULL + (jack_time_t)ts.tv_nsec / 1000ULL;
+}
+
+jack_nframes_t jack_frame_time(const jack_client_t* const client)
+{
+    return client->frames;
+}
+
+jack_nframes_t jack_last_frame_time(const jack_client_t* const client)
+{
+    return client->frames;
+}
+
+int jack_get_cycle_times(const jack_client_t* const client, jack_nframes_t* const current_frames,
+                         jack_time_t* const current_usecs, jack_time_t* const next_usecs, float* const period_usecs)
+{
+    const double period = (double)client->bufsize / (double)client->srate * 1000000.0;
+
+    *current_frames = client->frames;
+    *current_usecs  = client->cycle_usecs;
+    *next_usecs     = client->cycle_usecs + (jack_time_t)period;
+    *period_usecs   = (float)period;
+    return 0;
+}
+
+static void* jack_stub_thread(void* const arg)
+{
+    jack_client_t* const client = (jack_client_t*)arg;
+
+    return client->thread_cb(client->process_arg);
+}
+
+int jack_activate(jack_client_t* const client)
+{
+    if (client->thread_cb == NULL || client->thread_running)
+        return 0;
+
+    client->thread_quit = false;
+
+    if (pthread_create(&client->thread, NULL, jack_stub_thread, client) != 0)
+        return -1;
+
+    client->thread_running = true;
+    return 0;
+}
+
+int jack_deactivate(jack_client_t* const client)
+{
+    if (! client->thread_running)
+        return 0;
+
+    client->thread_quit = true;
+    sem_post(&client->cycle_start);
+    pthread_join(client->thread, NULL);
+    client->thread_running = false;
+    return 0;
+}
+
+int jack_set_process_thread(jack_client_t* const client, const JackThreadCallback callback, void* const arg)
+{
+    client->thread_cb = callback;
+    client->process_arg = arg;
+    return 0;
+}
+
+// like jack2, the client thread is terminated here once deactivated
+jack_nframes_t jack_cycle_wait(jack_client_t* const client)
+{
+    sem_wait(&client->cycle_start);
+
+    if (client->thread_quit)
+        pthread_exit(NULL);
+
+    return client->bufsize;
+}
+
+void jack_cycle_signal(jack_client_t* const client, const int status)
+{
+    sem_post(&client->cycle_done);
+    return; (void)status;
+}
+
+int jack_set_process_callback(jack_client_t* const client, const JackProcessCallback callback, void* const arg)
+{
+    client->process = callback;
+    client->process_arg = arg;
+    return 0;
+}
+
+int jack_set_buffer_size_callback(jack_client_t* const client, const JackBufferSizeCallback callback, void* const arg)
+{
+    client->bufsize_cb = callback;
+    client->bufsize_arg = arg;
+    return 0;
+}
+
+int jack_set_xrun_callback(jack_client_t* const client, const JackXRunCallback callback, void* const arg)
+{
+    client->xrun_cb = callback;
+    client->xrun_arg = arg;
+    return 0;
+}
+
+int jack_set_freewheel_callback(jack_client_t* const client, const JackFreewheelCallback callback, void* const arg)
+{
+    client->freewheel_cb = callback;
+    client->freewheel_arg = arg;
+    return 0;
+}
+
+jack_port_t* jack_port_register(jack_client_t* const client, const char* const port_name, const char* const port_type,
+                                unsigned long flags, unsigned long buffer_size)
+{
+    if (client->port_count == JACK_STUB_MAX_PORTS)
+        return NULL;
+
+    jack_port_t* const port = &client->ports[client->port_count];
+
+    // jack aligns port buffers, do the same so kernels can rely on it
+    if (posix_memalign((void**)&port->buffer, 64, sizeof(float)*JACK_STUB_MAX_BUFFER_SIZE) != 0)
+        return NULL;
+
+    memset(port->buffer, 0, sizeof(float)*JACK_STUB_MAX_BUFFER_SIZE);
+    snprintf(port->name, sizeof(port->name), "%s", port_name);
+    snprintf(port->type, sizeof(port->type), "%s", port_type);
+    port->flags = flags;
+    port->connected = true;
+
+    ++client->port_count;
+    return port;
+
+    (void)buffer_size;
+}
+
+int jack_port_unregister(jack_client_t* const client, jack_port_t* const port)
+{
+    port->connected = false;
+    return 0; (void)client;
+}
+
+void* jack_port_get_buffer(jack_port_t* const port, const jack_nframes_t nframes)
+{
+    return port->buffer; (void)nframes;
+}
+
+int jack_port_connected(const jack_port_t* const port)
+{
+    return port->connected ? 1 : 0;
+}
+
+int jack_port_set_alias(jack_port_t* const port, const char* const alias)
+{
+    return 0; (void)port; (void)alias;
+}
+
+jack_uuid_t jack_port_uuid(const jack_port_t* const port)
+{
+    return 0; (void)port;
+}
+
+int jack_uuid_empty(const jack_uuid_t uuid)
+{
+    return uuid == 0;
+}
+
+int jack_set_property(jack_client_t* const client, const jack_uuid_t subject,
+                      const char* const key, const char* const value, const char* const type)
+{
+    return 0; (void)client; (void)subject; (void)key; (void)value; (void)type;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// midi, events are packed as time, size and data after an event count, at the start of the port buffer
+
+void jack_midi_clear_buffer(void* const buffer)
+{
+    *(uint32_t*)buffer = 0;
+}
+
+int jack_midi_event_write(void* const buffer, const jack_nframes_t time, const jack_midi_data_t* const data,
+                          const size_t size)
+{
+    uint32_t* const count = (uint32_t*)buffer;
+    uint8_t* ptr = (uint8_t*)buffer + sizeof(uint32_t);
+
+    for (uint32_t i = 0; i < *count; ++i)
+        ptr += sizeof(uint32_t) * 2 + ((const uint32_t*)ptr)[1];
+
+    if (ptr + sizeof(uint32_t) * 2 + size > (uint8_t*)buffer + sizeof(float) * JACK_STUB_MAX_BUFFER_SIZE)
+        return -1;
+
+    ((uint32_t*)ptr)[0] = time;
+    ((uint32_t*)ptr)[1] = (uint32_t)size;
+    memcpy(ptr + sizeof(uint32_t) * 2, data, size);
+    ++*count;
+    return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JACK_STUB_H_INCLUDED
+#define JACK_STUB_H_INCLUDED
+
+#include <stdbool.h>
+
+#include <jack/jack.h>
+
+// minimal in-process replacement for the JACK API subset used by the clients.
+// there is no server, cycles run only when calling jack_stub_run_cycle.
+
+#define JACK_STUB_MAX_BUFFER_SIZE 8192
+
+jack_client_t* jack_stub_client_new(jack_nframes_t bufsize, jack_nframes_t srate);
+void jack_stub_client_free(jack_client_t* client);
+
+// argument given to the process callback, that is, the client private data
+void* jack_stub_get_process_arg(jack_client_t* client);
+
+// runs a single process cycle with the current buffer size, advancing frame time
+int jack_stub_run_cycle(jack_client_t* client);
+
+// changes buffer size and triggers the buffer size callback, must not be called during a cycle
+void jack_stub_set_buffer_size(jack_client_t* client, jack_nframes_t bufsize);
+
+jack_port_t* jack_stub_get_port(jack_client_t* client, const char* name);
+float* jack_stub_get_port_buffer(jack_port_t* port);
+void jack_stub_set_port_connected(jack_port_t* port, bool connected);
+
+// triggers the xrun and freewheel callbacks, must not be called during a cycle
+void jack_stub_xrun(jack_client_t* client);
+void jack_stub_set_freewheel(jack_client_t* client, bool freewheel);
+
+#endif // JACK_STUB_H_INCLUDED
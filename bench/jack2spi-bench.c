@@ -0,0 +1,54 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "bench.h"
+
+// file access of the client goes through the bench, for injecting slow I/O
+#define fread  bench_fread
+#define fwrite bench_fwrite
+
+#define main            jack2spi_main
+#define jack_initialize jack2spi_initialize
+#define jack_finish     jack2spi_finish
+#include "../jack2spi.c"
+#undef main
+#undef fread
+#undef fwrite
+
+#include "jack-stub.h"
+
+void* bench_jack2spi_start(jack_client_t* const client, const char* const device)
+{
+    if (jack2spi_initialize(client, device) != EXIT_SUCCESS)
+        return NULL;
+
+    return jack_stub_get_process_arg(client);
+}
+
+void bench_jack2spi_set_enabled(void* const handle, const bool enabled)
+{
+    jack2spi_t* const jack2spi = (jack2spi_t*)handle;
+
+    jack2spi->cvEnabled = enabled;
+}
+
+void bench_jack2spi_stop(void* const handle)
+{
+    jack2spi_finish(handle);
+}
@@ -0,0 +1,49 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+// client file access goes through here (see the client bench sources), so slow I/O can be injected at will
+static unsigned io_delay_us = 0;
+
+void bench_set_io_delay(const unsigned usecs)
+{
+    __atomic_store_n(&io_delay_us, usecs, __ATOMIC_RELAXED);
+}
+
+static void io_delay(void)
+{
+    const unsigned usecs = __atomic_load_n(&io_delay_us, __ATOMIC_RELAXED);
+
+    if (usecs != 0)
+        usleep(usecs);
+}
+
+size_t bench_fread(void* const ptr, const size_t size, const size_t nmemb, FILE* const f)
+{
+    io_delay();
+    return fread(ptr, size, nmemb, f);
+}
+
+size_t bench_fwrite(const void* const ptr, const size_t size, const size_t nmemb, FILE* const f)
+{
+    io_delay();
+    return fwrite(ptr, size, nmemb, f);
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+
+#include "bench.h"
+
+// file access of the client goes through the bench, for injecting slow I/O
+#define fread  bench_fread
+#define fwrite bench_fwrite
+
+#define main            spi2jack_main
+#define jack_initialize spi2jack_initialize
+#define jack_finish     spi2jack_finish
+#include "../spi2jack.c"
+#undef main
+#undef fread
+#undef fwrite
+
+#include "jack-stub.h"
+
+void* bench_spi2jack_start(jack_client_t* const client, const char* const device)
+{
+    if (spi2jack_initialize(client, device) != EXIT_SUCCESS)
+        return NULL;
+
+    spi2jack_t* const spi2jack = (spi2jack_t*)jack_stub_get_process_arg(client);
+
+    // wait for the reading thread to get the first values
+    for (int i = 0; i < 1000 && ! spi2jack->ready; ++i)
+        usleep(1000);
+
+    return spi2jack;
+}
+
+void bench_spi2jack_set_pedal_mode(void* const handle, const bool pedal)
+{
+    spi2jack_t* const spi2jack = (spi2jack_t*)handle;
+
+    spi2jack->exp_pedal_mode = pedal ? exp_pedal_mode_port1 : exp_pedal_mode_unused;
+}
+
+void bench_spi2jack_stop(void* const handle)
+{
+    spi2jack_finish(handle);
+}
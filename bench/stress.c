@@ -0,0 +1,783 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "../mod-calibration.h"
+#include "../mod-cvfeed.h"
+#include "../mod-latency.h"
+#include "bench.h"
+#include "iio-tree.h"
+#include "jack-stub.h"
+
+/*
+ * Randomized stress and soak test of both clients, against the JACK stub and a fake iio device.
+ *
+ * Cycles run at the pace of a real server (or as fast as possible while freewheeling), while the buffer size,
+ * mode switches and port connections change at random and slow I/O is injected into the client file access.
+ * Inputs and outputs are set to random values held for a while, checking that each one comes through:
+ *  - spi2jack: the last frame of a capture port must reach the calibrated input value
+ *  - jack2spi: the DAC file must reach the code of the playback port value
+ * Updates that never come through are lost, those taking longer than the update bound are late.
+ * Updates disturbed by a mode change, port disconnection or freewheeling are not checked.
+ * The spi2jack feed is read along, entries whose volts do not match their raw codes are torn snapshots.
+ *
+ * Checks expect default scaling and timing, so the environment variables changing those are cleared.
+ */
+
+#define STRESS_SAMPLE_RATE   48000
+#define STRESS_REPORT_SECS   10
+#define STRESS_HOLD_MIN_MS   300
+#define STRESS_HOLD_MAX_MS   1000
+#define STRESS_IO_DELAY_MAX  20000 // usecs
+#define STRESS_DISTURB_MIN   50    // ms, modes and connections go back to normal after a while
+#define STRESS_DISTURB_MAX   1000  // ms
+#define STRESS_VOLTS_EPSILON 0.001f
+#define STRESS_MAX_MESSAGES  10 // per kind of violation
+
+static const jack_nframes_t kBufferSizes[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+
+// environment variables that would change the values the checks expect
+static const char* const kClearedEnv[] = {
+    "MOD_SPI2JACK_CALIBRATION", "MOD_SPI2JACK_TIMING", "MOD_SPI2JACK_REPLAY",
+    "MOD_JACK2SPI_CALIBRATION", "MOD_JACK2SPI_REDUCE", "MOD_JACK2SPI_CHANNEL_RATE", "MOD_JACK2SPI_TOTAL_RATE",
+    "MOD_JACK2SPI_SLEW_RATE", "MOD_JACK2SPI_STATE_FILE",
+};
+
+typedef enum {
+    event_bufsize,
+    event_pedal_mode,
+    event_cv_mode,
+    event_port,
+    event_slow_io,
+    event_xrun,
+    event_freewheel,
+    event_count
+} stress_event_t;
+
+static const char* const kEventNames[event_count] = {
+    "bufsize", "pedal-mode", "cv-mode", "port", "slow-io", "xrun", "freewheel"
+};
+
+// average time between events, in ms
+static const unsigned kEventIntervals[event_count] = { 2000, 3000, 3000, 1000, 5000, 5000, 20000 };
+
+// one value sent through a client, from being set until seen on the other side
+typedef struct {
+    const char* name;
+    bool active, seen, voided;
+    uint64_t changed;
+    float expected, tolerance;
+    uint64_t checked, lost, late;
+    mod_latency_histogram_t latency;
+} tracker_t;
+
+typedef struct {
+    jack_client_t* client;
+    void* handle;
+    mod_latency_histogram_t process;
+    uint64_t over_bound;
+} stress_client_t;
+
+typedef struct {
+    const mod_cv_feed_t* feed;
+    const float* adc_table[2];
+    volatile bool run;
+    uint64_t entries, torn;
+} feed_checker_t;
+
+static volatile sig_atomic_t stop_requested = 0;
+static uint32_t rng_state = 1;
+static uint64_t update_bound_ns;
+static unsigned messages[4];
+
+enum {
+    violation_lost,
+    violation_late,
+    violation_torn,
+    violation_process
+};
+
+static void signal_handler(int sig)
+{
+    stop_requested = 1;
+    return; (void)sig;
+}
+
+static uint32_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint32_t rng_range(const uint32_t min, const uint32_t max)
+{
+    return min + rng_next() % (max - min + 1);
+}
+
+// somewhere between half and one and a half times the average
+static uint64_t rng_interval_ns(const unsigned average_ms)
+{
+    return (uint64_t)rng_range(average_ms / 2, average_ms * 3 / 2) * 1000000ULL;
+}
+
+static void report_violation(const unsigned kind, const char* const format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void report_violation(const unsigned kind, const char* const format, ...)
+{
+    if (messages[kind]++ >= STRESS_MAX_MESSAGES)
+        return;
+
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// update tracking
+
+static void tracker_init(tracker_t* const tracker, const char* const name, const float tolerance)
+{
+    memset(tracker, 0, sizeof(*tracker));
+    tracker->name = name;
+    tracker->tolerance = tolerance;
+    mod_latency_init(&tracker->latency, name);
+}
+
+static void tracker_finish(tracker_t* const tracker, const uint64_t now)
+{
+    if (! tracker->active || tracker->seen || tracker->voided)
+        return;
+
+    // too early to tell at the end of the run
+    if (now - tracker->changed < update_bound_ns)
+        return;
+
+    ++tracker->lost;
+    report_violation(violation_lost, "%s: update to %.4f lost\n", tracker->name, (double)tracker->expected);
+}
+
+static void tracker_begin(tracker_t* const tracker, const float expected, const bool valid, const uint64_t now)
+{
+    tracker_finish(tracker, now);
+
+    tracker->active = true;
+    tracker->seen = false;
+    tracker->voided = ! valid;
+    tracker->changed = now;
+    tracker->expected = expected;
+
+    if (valid)
+        ++tracker->checked;
+}
+
+static void tracker_void(tracker_t* const tracker)
+{
+    tracker->voided = true;
+}
+
+static void tracker_observe(tracker_t* const tracker, const float value, const uint64_t now)
+{
+    if (! tracker->active || tracker->seen || tracker->voided)
+        return;
+
+    const float diff = value - tracker->expected;
+    if (diff > tracker->tolerance || diff < -tracker->tolerance)
+        return;
+
+    const uint64_t latency = now - tracker->changed;
+
+    tracker->seen = true;
+    mod_latency_record(&tracker->latency, latency);
+
+    if (latency > update_bound_ns)
+    {
+        ++tracker->late;
+        report_violation(violation_late, "%s: update to %.4f took %.1f ms\n",
+                         tracker->name, (double)tracker->expected, (double)latency / 1000000.0);
+    }
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// feed checking, from a separate thread like any other feed reader
+
+// volts are exactly the calibrated raw codes, an entry mixing two readings does not match
+static bool feed_entry_valid(const feed_checker_t* const checker, const mod_cv_feed_entry_t* const entry,
+                             const uint64_t last_time)
+{
+    if (entry->mode > 2 || entry->time < last_time)
+        return false;
+
+    for (int c = 0; c < 2; ++c)
+    {
+        if (entry->raw[c] >= MOD_CALIBRATION_TABLE_SIZE)
+            return false;
+
+        const float expected = checker->adc_table[c][entry->raw[c]];
+
+        if (entry->value[c] < expected || entry->value[c] > expected)
+            return false;
+    }
+
+    return true;
+}
+
+static void* feed_checker_thread(void* const arg)
+{
+    feed_checker_t* const checker = (feed_checker_t*)arg;
+
+    mod_cv_feed_entry_t entry;
+    uint64_t next = 1, last_time = 0;
+
+    while (checker->run)
+    {
+        const uint64_t head = mod_cv_feed_head(checker->feed);
+
+        if (head >= next + MOD_CV_FEED_SIZE)
+            next = head - MOD_CV_FEED_SIZE + 1;
+
+        for (; next <= head; ++next)
+        {
+            if (! mod_cv_feed_read(checker->feed, next, &entry))
+                continue;
+
+            ++checker->entries;
+
+            if (! feed_entry_valid(checker, &entry, last_time))
+            {
+                ++checker->torn;
+                report_violation(violation_torn, "feed: torn entry %llu, raw %u %u volts %.4f %.4f mode %u\n",
+                                 (unsigned long long)next, entry.raw[0], entry.raw[1],
+                                 (double)entry.value[0], (double)entry.value[1], entry.mode);
+            }
+
+            last_time = entry.time;
+        }
+
+        usleep(1000);
+    }
+
+    return NULL;
+}
+
+// -------------------------------------------------------------------------------------------------------------------
+// cycles
+
+// clients print status messages to stdout, keep it clean for results
+static int quiet_begin(void)
+{
+    fflush(stdout);
+    const int saved = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    return saved;
+}
+
+static void quiet_end(const int saved)
+{
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+static void run_cycle(stress_client_t* const client, const char* const name, const uint64_t bound)
+{
+    const uint64_t start = mod_latency_now_ns();
+    jack_stub_run_cycle(client->client);
+    const uint64_t duration = mod_latency_now_ns() - start;
+
+    mod_latency_record(&client->process, duration);
+
+    if (duration > bound)
+    {
+        ++client->over_bound;
+        report_violation(violation_process, "%s: process took %.1f us, bound is %.1f us\n",
+                         name, (double)duration / 1000.0, (double)bound / 1000.0);
+    }
+}
+
+static void fill_port(jack_client_t* const client, const char* const name, const float value)
+{
+    float* const buffer = jack_stub_get_port_buffer(jack_stub_get_port(client, name));
+
+    for (jack_nframes_t i = 0; i < JACK_STUB_MAX_BUFFER_SIZE; ++i)
+        buffer[i] = value;
+}
+
+static void sleep_until(const uint64_t deadline)
+{
+    const struct timespec ts = { (time_t)(deadline / 1000000000ULL), (long)(deadline % 1000000000ULL) };
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+static void print_histogram(const mod_latency_histogram_t* const hist, const char* const unit, const double scale)
+{
+    const uint64_t count = hist->count;
+
+    if (count == 0)
+    {
+        printf("%s: no samples\n", hist->name);
+        return;
+    }
+
+    printf("%s: avg=%.1f p99=%.1f p99.9=%.1f max=%.1f %s\n", hist->name,
+           (double)hist->sum / (double)count / scale,
+           (double)mod_latency_percentile(hist, count, 99.0) / scale,
+           (double)mod_latency_percentile(hist, count, 99.9) / scale,
+           (double)hist->max / scale, unit);
+}
+
+static void print_tracker(const tracker_t* const tracker)
+{
+    printf("%s: %llu checked, %llu lost, %llu late\n", tracker->name, (unsigned long long)tracker->checked,
+           (unsigned long long)tracker->lost, (unsigned long long)tracker->late);
+    print_histogram(&tracker->latency, "ms", 1000000.0);
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = 60.0;
+    uint64_t process_bound_ns = 0;
+    unsigned update_bound_ms = 200;
+    uint32_t seed = (uint32_t)time(NULL);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            seconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+        {
+            process_bound_ns = strtoull(argv[++i], NULL, 10) * 1000ULL;
+        }
+        else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+        {
+            update_bound_ms = (unsigned)atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+        {
+            seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+        }
+        else
+        {
+            fprintf(stdout, "Usage: %s [-t <seconds>] [-l <process bound usecs>] [-u <update bound ms>] [-s <seed>]\n",
+                    argv[0]);
+            fprintf(stdout, "\tRuns both clients against a JACK stub under random buffer size, mode, connection\n");
+            fprintf(stdout, "\tand I/O disturbances, failing on late or lost updates and torn snapshots.\n");
+            fprintf(stdout, "\tThe process bound defaults to the period of the current buffer size.\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    update_bound_ns = (uint64_t)update_bound_ms * 1000000ULL;
+    rng_state = seed | 1; // xorshift state must not be 0
+
+    // make sure the alsa mixer is never found, modes are switched directly
+    setenv("MOD_SOUNDCARD", "mod-cv-stress-none", 1);
+    setenv("MOD_SPI2JACK_FEED", "1", 1);
+
+    for (size_t i = 0; i < sizeof(kClearedEnv)/sizeof(kClearedEnv[0]); ++i)
+        unsetenv(kClearedEnv[i]);
+
+    char device[128];
+    if (! iio_tree_create(device, sizeof(device), "mod-cv-stress"))
+    {
+        fprintf(stderr, "Cannot create iio tree\n");
+        return EXIT_FAILURE;
+    }
+
+    // expected values, same scaling as the clients without calibration files
+    static float adc_table[2][MOD_CALIBRATION_TABLE_SIZE];
+    static uint16_t dac_table[2][MOD_CALIBRATION_TABLE_SIZE];
+    {
+        mod_calibration_points_t points;
+        memset(&points, 0, sizeof(points));
+
+        for (int c = 0; c < 2; ++c)
+        {
+            mod_calibration_build_adc_table(&points, adc_table[c]);
+            mod_calibration_build_dac_table(&points, dac_table[c]);
+        }
+    }
+
+    int inputs[2] = { 1024, 3072 };
+    iio_tree_set_raw(device, "in_voltage0_raw", inputs[0]);
+    iio_tree_set_raw(device, "in_voltage1_raw", inputs[1]);
+
+    jack_nframes_t bufsize = 128;
+    stress_client_t spi2jack, jack2spi;
+    memset(&spi2jack, 0, sizeof(spi2jack));
+    memset(&jack2spi, 0, sizeof(jack2spi));
+    mod_latency_init(&spi2jack.process, "spi2jack process");
+    mod_latency_init(&jack2spi.process, "jack2spi process");
+
+    spi2jack.client = jack_stub_client_new(bufsize, STRESS_SAMPLE_RATE);
+    jack2spi.client = jack_stub_client_new(bufsize, STRESS_SAMPLE_RATE);
+
+    const int saved = quiet_begin();
+    spi2jack.handle = bench_spi2jack_start(spi2jack.client, device);
+    jack2spi.handle = bench_jack2spi_start(jack2spi.client, device);
+    quiet_end(saved);
+
+    if (spi2jack.handle == NULL || jack2spi.handle == NULL)
+    {
+        fprintf(stderr, "Failed to start the clients\n");
+        return EXIT_FAILURE;
+    }
+
+    bool pedal_mode = false, cv_mode = true;
+    bench_jack2spi_set_enabled(jack2spi.handle, true);
+
+    feed_checker_t checker;
+    memset(&checker, 0, sizeof(checker));
+    checker.feed = mod_cv_feed_open(MOD_CV_FEED_SPI2JACK);
+    checker.adc_table[0] = adc_table[0];
+    checker.adc_table[1] = adc_table[1];
+    checker.run = true;
+
+    pthread_t checker_thread;
+    const bool checking_feed = checker.feed != NULL &&
+                               pthread_create(&checker_thread, NULL, feed_checker_thread, &checker) == 0;
+
+    if (! checking_feed)
+        fprintf(stderr, "Cannot read the spi2jack feed, torn snapshots are not checked\n");
+
+    // ports that get connected and disconnected, trackers of the values going through them
+    static const char* const kPorts[] = { "capture_1", "capture_2", "exp_pedal", "playback_1", "playback_2" };
+    jack_port_t* ports[5];
+    bool connected[5];
+    uint64_t reconnect[5];
+    ports[0] = jack_stub_get_port(spi2jack.client, kPorts[0]);
+    ports[1] = jack_stub_get_port(spi2jack.client, kPorts[1]);
+    ports[2] = jack_stub_get_port(spi2jack.client, kPorts[2]);
+    ports[3] = jack_stub_get_port(jack2spi.client, kPorts[3]);
+    ports[4] = jack_stub_get_port(jack2spi.client, kPorts[4]);
+
+    for (int p = 0; p < 5; ++p)
+    {
+        connected[p] = true;
+        jack_stub_set_port_connected(ports[p], true);
+    }
+
+    tracker_t inputs_tracker[2], outputs_tracker[2];
+    tracker_init(&inputs_tracker[0], "spi2jack input 1", STRESS_VOLTS_EPSILON);
+    tracker_init(&inputs_tracker[1], "spi2jack input 2", STRESS_VOLTS_EPSILON);
+    tracker_init(&outputs_tracker[0], "jack2spi output 1", 0.5f);
+    tracker_init(&outputs_tracker[1], "jack2spi output 2", 0.5f);
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    // cycles run where a server would run them, otherwise the process bound is mostly about preemption
+    {
+        struct sched_param rt_param;
+        memset(&rt_param, 0, sizeof(rt_param));
+        rt_param.sched_priority = 70;
+
+        if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &rt_param) != 0)
+            fprintf(stderr, "Cannot use realtime scheduling, process times include preemption\n");
+    }
+
+    const uint64_t start = mod_latency_now_ns();
+    const uint64_t end = start + (uint64_t)(seconds * 1000000000.0);
+    uint64_t now = start, deadline = start, next_report = start + STRESS_REPORT_SECS * 1000000000ULL;
+    uint64_t next_input = start, next_output = start;
+    uint64_t next_event[event_count], event_counts[event_count];
+    uint64_t pedal_mode_end = 0, cv_mode_end = 0, slow_io_end = 0, freewheel_end = 0, cycles = 0;
+    bool slow_io = false, freewheeling = false;
+
+    for (int e = 0; e < event_count; ++e)
+    {
+        next_event[e] = start + rng_interval_ns(kEventIntervals[e]);
+        event_counts[e] = 0;
+    }
+
+    printf("Stress testing for %.0f seconds, seed %u\n", seconds, seed);
+    fflush(stdout);
+
+    while (now < end && stop_requested == 0)
+    {
+        // disturbances
+        for (int e = 0; e < event_count; ++e)
+        {
+            if (now < next_event[e])
+                continue;
+
+            next_event[e] = now + rng_interval_ns(kEventIntervals[e]);
+            ++event_counts[e];
+
+            switch ((stress_event_t)e)
+            {
+            case event_bufsize:
+                bufsize = kBufferSizes[rng_range(0, sizeof(kBufferSizes)/sizeof(kBufferSizes[0]) - 1)];
+                jack_stub_set_buffer_size(spi2jack.client, bufsize);
+                jack_stub_set_buffer_size(jack2spi.client, bufsize);
+                break;
+
+            case event_pedal_mode:
+                pedal_mode = true;
+                pedal_mode_end = now + rng_range(STRESS_DISTURB_MIN, STRESS_DISTURB_MAX) * 1000000ULL;
+                bench_spi2jack_set_pedal_mode(spi2jack.handle, true);
+                tracker_void(&inputs_tracker[0]);
+                tracker_void(&inputs_tracker[1]);
+                break;
+
+            case event_cv_mode:
+                cv_mode = false;
+                cv_mode_end = now + rng_range(STRESS_DISTURB_MIN, STRESS_DISTURB_MAX) * 1000000ULL;
+                bench_jack2spi_set_enabled(jack2spi.handle, false);
+                tracker_void(&outputs_tracker[0]);
+                tracker_void(&outputs_tracker[1]);
+                break;
+
+            case event_port:
+            {
+                const uint32_t p = rng_range(0, 4);
+                connected[p] = false;
+                reconnect[p] = now + rng_range(STRESS_DISTURB_MIN, STRESS_DISTURB_MAX) * 1000000ULL;
+                jack_stub_set_port_connected(ports[p], false);
+
+                if (p < 2)
+                    tracker_void(&inputs_tracker[p]);
+                else if (p > 2)
+                    tracker_void(&outputs_tracker[p - 3]);
+                break;
+            }
+
+            case event_slow_io:
+                slow_io = true;
+                slow_io_end = now + rng_range(100, 1000) * 1000000ULL;
+                bench_set_io_delay(rng_range(1000, STRESS_IO_DELAY_MAX));
+                break;
+
+            case event_xrun:
+                jack_stub_xrun(spi2jack.client);
+                jack_stub_xrun(jack2spi.client);
+                break;
+
+            case event_freewheel:
+                // spi2jack holds its values while freewheeling
+                freewheeling = true;
+                freewheel_end = now + rng_range(50, 300) * 1000000ULL;
+                jack_stub_set_freewheel(spi2jack.client, true);
+                jack_stub_set_freewheel(jack2spi.client, true);
+                break;
+
+            case event_count:
+                break;
+            }
+        }
+
+        if (pedal_mode && now >= pedal_mode_end)
+        {
+            pedal_mode = false;
+            bench_spi2jack_set_pedal_mode(spi2jack.handle, false);
+        }
+
+        if (! cv_mode && now >= cv_mode_end)
+        {
+            cv_mode = true;
+            bench_jack2spi_set_enabled(jack2spi.handle, true);
+        }
+
+        for (int p = 0; p < 5; ++p)
+        {
+            if (! connected[p] && now >= reconnect[p])
+            {
+                connected[p] = true;
+                jack_stub_set_port_connected(ports[p], true);
+            }
+        }
+
+        if (slow_io && now >= slow_io_end)
+        {
+            slow_io = false;
+            bench_set_io_delay(0);
+        }
+
+        if (freewheeling)
+        {
+            tracker_void(&inputs_tracker[0]);
+            tracker_void(&inputs_tracker[1]);
+
+            if (now >= freewheel_end)
+            {
+                freewheeling = false;
+                jack_stub_set_freewheel(spi2jack.client, false);
+                jack_stub_set_freewheel(jack2spi.client, false);
+                deadline = now;
+            }
+        }
+
+        // new values, one channel at a time or both
+        if (now >= next_input)
+        {
+            next_input = now + rng_range(STRESS_HOLD_MIN_MS, STRESS_HOLD_MAX_MS) * 1000000ULL;
+
+            const uint32_t which = rng_range(1, 3);
+
+            for (int c = 0; c < 2; ++c)
+            {
+                if ((which & (1u << c)) == 0)
+                    continue;
+
+                // far enough from the previous value to get past the polling deadband
+                int raw;
+                do {
+                    raw = (int)rng_range(0, MOD_CALIBRATION_TABLE_SIZE - 1);
+                } while (abs(raw - inputs[c]) < 16);
+
+                inputs[c] = raw;
+                iio_tree_set_raw(device, c == 0 ? "in_voltage0_raw" : "in_voltage1_raw", raw);
+                tracker_begin(&inputs_tracker[c], adc_table[c][raw], ! pedal_mode && connected[c] && ! freewheeling,
+                              now);
+            }
+        }
+
+        if (now >= next_output)
+        {
+            next_output = now + rng_range(STRESS_HOLD_MIN_MS, STRESS_HOLD_MAX_MS) * 1000000ULL;
+
+            for (int c = 0; c < 2; ++c)
+            {
+                // volts to raw the same way as jack2spi, for a code different from the current one
+                float value;
+                uint16_t code;
+                do {
+                    value = (float)rng_range(0, 10000) / 1000.0f;
+                    code = dac_table[c][(int)(value / 10.0f * 4095.0f + 0.5f)];
+                } while (outputs_tracker[c].active && code == (uint16_t)outputs_tracker[c].expected);
+
+                fill_port(jack2spi.client, c == 0 ? "playback_1" : "playback_2", value);
+                tracker_begin(&outputs_tracker[c], (float)code, cv_mode && connected[3 + c], now);
+            }
+        }
+
+        // one period, the process bound is the period unless given
+        const uint64_t period_ns = (uint64_t)bufsize * 1000000000ULL / STRESS_SAMPLE_RATE;
+        const uint64_t bound = process_bound_ns != 0 ? process_bound_ns : period_ns;
+
+        run_cycle(&spi2jack, "spi2jack", bound);
+        run_cycle(&jack2spi, "jack2spi", bound);
+        ++cycles;
+
+        now = mod_latency_now_ns();
+
+        for (int c = 0; c < 2; ++c)
+        {
+            const float* const buffer = jack_stub_get_port_buffer(ports[c]);
+            tracker_observe(&inputs_tracker[c], buffer[bufsize - 1], now);
+
+            const int code = iio_tree_get_raw(device, c == 0 ? "out_voltage0_raw" : "out_voltage1_raw");
+            tracker_observe(&outputs_tracker[c], (float)code, now);
+        }
+
+        if (now >= next_report)
+        {
+            next_report += STRESS_REPORT_SECS * 1000000000ULL;
+            printf("%.0fs: %llu cycles, worst process spi2jack %.1f us jack2spi %.1f us (%llu over bound), "
+                   "updates lost %llu late %llu, torn %llu\n",
+                   (double)(now - start) / 1000000000.0, (unsigned long long)cycles,
+                   (double)spi2jack.process.max / 1000.0, (double)jack2spi.process.max / 1000.0,
+                   (unsigned long long)(spi2jack.over_bound + jack2spi.over_bound),
+                   (unsigned long long)(inputs_tracker[0].lost + inputs_tracker[1].lost +
+                                        outputs_tracker[0].lost + outputs_tracker[1].lost),
+                   (unsigned long long)(inputs_tracker[0].late + inputs_tracker[1].late +
+                                        outputs_tracker[0].late + outputs_tracker[1].late),
+                   (unsigned long long)checker.torn);
+            fflush(stdout);
+        }
+
+        // pace cycles like a server would, catching up after stalls instead of bursting
+        if (! freewheeling)
+        {
+            deadline += period_ns;
+
+            if (deadline > now)
+                sleep_until(deadline);
+            else
+                deadline = now;
+
+            now = mod_latency_now_ns();
+        }
+    }
+
+    for (int c = 0; c < 2; ++c)
+    {
+        tracker_finish(&inputs_tracker[c], now);
+        tracker_finish(&outputs_tracker[c], now);
+    }
+
+    bench_set_io_delay(0);
+
+    if (checking_feed)
+    {
+        checker.run = false;
+        pthread_join(checker_thread, NULL);
+    }
+    if (checker.feed != NULL)
+        mod_cv_feed_close(checker.feed);
+
+    const int saved2 = quiet_begin();
+    bench_spi2jack_stop(spi2jack.handle);
+    bench_jack2spi_stop(jack2spi.handle);
+    quiet_end(saved2);
+    jack_stub_client_free(spi2jack.client);
+    jack_stub_client_free(jack2spi.client);
+    iio_tree_destroy(device);
+
+    // summary
+    printf("\n%llu cycles in %.0f seconds, events:", (unsigned long long)cycles, (double)(now - start) / 1000000000.0);
+    for (int e = 0; e < event_count; ++e)
+        printf(" %s=%llu", kEventNames[e], (unsigned long long)event_counts[e]);
+    printf("\n");
+
+    print_histogram(&spi2jack.process, "us", 1000.0);
+    print_histogram(&jack2spi.process, "us", 1000.0);
+    printf("spi2jack process over bound: %llu, jack2spi process over bound: %llu\n",
+           (unsigned long long)spi2jack.over_bound, (unsigned long long)jack2spi.over_bound);
+
+    for (int c = 0; c < 2; ++c)
+        print_tracker(&inputs_tracker[c]);
+    for (int c = 0; c < 2; ++c)
+        print_tracker(&outputs_tracker[c]);
+
+    printf("feed: %llu entries checked, %llu torn\n", (unsigned long long)checker.entries,
+           (unsigned long long)checker.torn);
+
+    uint64_t failures = spi2jack.over_bound + jack2spi.over_bound + checker.torn;
+    for (int c = 0; c < 2; ++c)
+        failures += inputs_tracker[c].lost + inputs_tracker[c].late + outputs_tracker[c].lost + outputs_tracker[c].late;
+
+    printf("%s\n", failures == 0 ? "PASSED" : "FAILED");
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
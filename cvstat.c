@@ -0,0 +1,241 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <poll.h>
+
+#include "mod-control.h"
+#include "mod-cvfeed.h"
+#include "mod-telemetry.h"
+#include "mod-trace.h"
+
+// prints stats as "client.key=value" lines, easy to scrape
+static bool print_stats(const char* const client, const char* const name)
+{
+    const mod_cv_stats_t* const stats = mod_cv_stats_open(name);
+
+    if (stats == NULL)
+        return false;
+
+    printf("%s.pid=%u\n", client, stats->pid);
+    printf("%s.version=%u\n", client, stats->version);
+    printf("%s.mode=%u\n", client, __atomic_load_n(&stats->mode, __ATOMIC_RELAXED));
+    printf("%s.bufsize=%u\n", client, __atomic_load_n(&stats->bufsize, __ATOMIC_RELAXED));
+    printf("%s.cycles=%llu\n", client, (unsigned long long)__atomic_load_n(&stats->cycles, __ATOMIC_RELAXED));
+    printf("%s.reads=%llu\n", client, (unsigned long long)__atomic_load_n(&stats->reads, __ATOMIC_RELAXED));
+    printf("%s.writes=%llu\n", client, (unsigned long long)__atomic_load_n(&stats->writes, __ATOMIC_RELAXED));
+    printf("%s.skipped_writes=%llu\n", client,
+           (unsigned long long)__atomic_load_n(&stats->skipped_writes, __ATOMIC_RELAXED));
+    printf("%s.deferred_writes=%llu\n", client,
+           (unsigned long long)__atomic_load_n(&stats->deferred_writes, __ATOMIC_RELAXED));
+    printf("%s.coalesced_writes=%llu\n", client,
+           (unsigned long long)__atomic_load_n(&stats->coalesced_writes, __ATOMIC_RELAXED));
+    printf("%s.parse_failures=%llu\n", client,
+           (unsigned long long)__atomic_load_n(&stats->parse_failures, __ATOMIC_RELAXED));
+    printf("%s.sem_timeouts=%llu\n", client,
+           (unsigned long long)__atomic_load_n(&stats->sem_timeouts, __ATOMIC_RELAXED));
+    printf("%s.wakeups_per_sec=%u\n", client, __atomic_load_n(&stats->wakeups_per_sec, __ATOMIC_RELAXED));
+    printf("%s.xruns=%llu\n", client, (unsigned long long)__atomic_load_n(&stats->xruns, __ATOMIC_RELAXED));
+    printf("%s.freewheels=%llu\n", client, (unsigned long long)__atomic_load_n(&stats->freewheels, __ATOMIC_RELAXED));
+    printf("%s.freewheeling=%u\n", client, __atomic_load_n(&stats->freewheeling, __ATOMIC_RELAXED));
+
+    for (unsigned i = 0; i < MOD_CV_STATS_BUFSIZES; ++i)
+    {
+        const mod_cv_stats_dsp_t* const dsp = &stats->dsp[i];
+        const uint64_t cycles = __atomic_load_n(&dsp->cycles, __ATOMIC_RELAXED);
+
+        if (cycles == 0)
+            continue;
+
+        const unsigned bufsize = 16u << i;
+        const uint64_t total_ns = __atomic_load_n(&dsp->total_ns, __ATOMIC_RELAXED);
+
+        printf("%s.dsp.%u.cycles=%llu\n", client, bufsize, (unsigned long long)cycles);
+        printf("%s.dsp.%u.min_ns=%llu\n", client, bufsize,
+               (unsigned long long)__atomic_load_n(&dsp->min_ns, __ATOMIC_RELAXED));
+        printf("%s.dsp.%u.avg_ns=%llu\n", client, bufsize, (unsigned long long)(total_ns / cycles));
+        printf("%s.dsp.%u.max_ns=%llu\n", client, bufsize,
+               (unsigned long long)__atomic_load_n(&dsp->max_ns, __ATOMIC_RELAXED));
+    }
+
+    mod_cv_stats_close(stats);
+    return true;
+}
+
+// prints every value feed entry as it arrives, waiting for change notifications if available
+static int follow_feed(void)
+{
+    const mod_cv_feed_t* const feed = mod_cv_feed_open(MOD_CV_FEED_SPI2JACK);
+
+    if (feed == NULL)
+    {
+        fprintf(stderr, "No value feed found, mod-spi2jack must run with MOD_SPI2JACK_FEED=1\n");
+        return EXIT_FAILURE;
+    }
+
+    int sock = -1;
+    const int efd = mod_cv_feed_subscribe(MOD_CV_FEED_SPI2JACK_SOCKET, &sock);
+
+    if (efd < 0)
+        fprintf(stderr, "Cannot subscribe to value feed changes, polling instead\n");
+
+    mod_cv_feed_entry_t entry;
+    uint64_t seq = mod_cv_feed_head(feed);
+
+    if (seq != 0)
+        --seq;
+
+    for (;;)
+    {
+        const uint64_t head = mod_cv_feed_head(feed);
+
+        // entries older than the ring size are gone
+        if (head - seq > MOD_CV_FEED_SIZE)
+            seq = head - MOD_CV_FEED_SIZE;
+
+        for (; seq < head; ++seq)
+        {
+            if (! mod_cv_feed_read(feed, seq + 1, &entry))
+                continue;
+
+            printf("spi2jack.feed seq=%llu time=%llu value1=%.4f value2=%.4f raw1=%u raw2=%u mode=%u\n",
+                   (unsigned long long)entry.seq, (unsigned long long)entry.time,
+                   (double)entry.value[0], (double)entry.value[1], entry.raw[0], entry.raw[1], entry.mode);
+        }
+
+        fflush(stdout);
+
+        if (efd >= 0)
+        {
+            struct pollfd pfd = { efd, POLLIN, 0 };
+            uint64_t count;
+
+            if (poll(&pfd, 1, 1000) > 0 && read(efd, &count, sizeof(count)) != sizeof(count))
+                break;
+        }
+        else
+        {
+            usleep(10000);
+        }
+    }
+
+    close(efd);
+    close(sock);
+    mod_cv_feed_close(feed);
+    return EXIT_FAILURE;
+}
+
+// prints a recorded trace as CSV, oldest entry first
+static int print_trace(const char* const filename)
+{
+    mod_trace_t trace;
+
+    if (! mod_trace_open(&trace, filename))
+    {
+        fprintf(stderr, "Cannot open trace file '%s'\n", filename);
+        return EXIT_FAILURE;
+    }
+
+    const uint64_t count = mod_trace_count(&trace);
+
+    printf("# %s, %llu entries, %llu dropped\n", trace.header->client,
+           (unsigned long long)count, (unsigned long long)trace.header->dropped);
+    printf("time_us,cycle,channel,raw\n");
+
+    for (uint64_t i = 0; i < count; ++i)
+    {
+        const mod_trace_entry_t* const entry = mod_trace_at(&trace, i);
+        printf("%llu,%u,%u,%u\n", (unsigned long long)entry->time, entry->cycle, entry->channel, entry->raw);
+    }
+
+    mod_trace_close(&trace);
+    return EXIT_SUCCESS;
+}
+
+// sends a command to a client control socket, printing the reply
+static int send_control(const char* const path, const int argc, char* argv[])
+{
+    char request[MOD_CONTROL_LINE_SIZE];
+    char reply[MOD_CONTROL_LINE_SIZE * 2];
+    size_t len = 0;
+
+    request[0] = '\0';
+
+    for (int i = 0; i < argc && len < sizeof(request); ++i)
+        len += (size_t)snprintf(request + len, sizeof(request) - len, i == 0 ? "%s" : " %s", argv[i]);
+
+    if (! mod_control_request(path, request, reply, sizeof(reply)))
+    {
+        fprintf(stderr, "Cannot talk to control socket '%s'\n", path);
+        return EXIT_FAILURE;
+    }
+
+    printf("%s\n", reply);
+    return strncmp(reply, "ok", 2) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[])
+{
+    int interval = 0;
+
+    if (argc > 2 && strcmp(argv[1], "-w") == 0)
+    {
+        interval = atoi(argv[2]);
+    }
+    else if (argc == 2 && strcmp(argv[1], "-f") == 0)
+    {
+        return follow_feed();
+    }
+    else if (argc == 3 && strcmp(argv[1], "-t") == 0)
+    {
+        return print_trace(argv[2]);
+    }
+    else if (argc > 3 && strcmp(argv[1], "-c") == 0)
+    {
+        return send_control(argv[2], argc - 3, argv + 3);
+    }
+    else if (argc > 1)
+    {
+        fprintf(stdout, "Usage: %s [-w <seconds>] [-f] [-t <trace file>] [-c <control socket> <command...>]\n", argv[0]);
+        fprintf(stdout, "\tPrints mod-spi2jack and mod-jack2spi stats, optionally repeating every few seconds\n");
+        fprintf(stdout, "\tWith -f follows the mod-spi2jack value feed instead, printing every change\n");
+        fprintf(stdout, "\tWith -t prints a raw I/O trace recorded by either client as CSV\n");
+        fprintf(stdout, "\tWith -c sends a command (list, get, set or stats) to a client control socket\n");
+        return EXIT_FAILURE;
+    }
+
+    for (;;)
+    {
+        const bool spi2jack = print_stats("spi2jack", MOD_CV_STATS_SPI2JACK);
+        const bool jack2spi = print_stats("jack2spi", MOD_CV_STATS_JACK2SPI);
+
+        if (!spi2jack && !jack2spi)
+            fprintf(stderr, "No running clients found\n");
+
+        if (interval <= 0)
+            return (spi2jack || jack2spi) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+        printf("\n");
+        fflush(stdout);
+        sleep((unsigned)interval);
+    }
+}
@@ -34,9 +34,21 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "kernels.h"
+#include "mod-alsactl.h"
+#include "mod-calibration.h"
+#include "mod-control.h"
+#include "mod-cvport.h"
+#include "mod-dacsched.h"
+#include "mod-latency.h"
+#include "mod-telemetry.h"
+#include "mod-trace.h"
+
 #ifdef USE_SEMAPHORE
 #include "mod-semaphore.h"
 #else
@@ -53,13 +65,107 @@
 #define MAX_RAW_IIO_VALUE   4095
 #define MAX_RAW_IIO_VALUE_f 4095.0f
 
+// raw output traces
+#define TRACE_SIZE_DEFAULT 262144 // entries
+
+// cycles run faster than real time while freewheeling, the DAC is written at most this often then
+#define FREEWHEEL_WRITE_INTERVAL_US 10000
+
+// largest median window, in frames
+#define MEDIAN_WINDOW_MAX 8192
+
+// peak reduction holds the highest value for this long before following lower peaks
+#define PEAK_HOLD_MS 200
+
+// indexed by mod_reduce_mode_t
+static const char* const reduce_mode_names[] = { "median", "last", "mean", "min", "max", "peak", "rms" };
+
+// DAC write budget limits, in writes per second, and slew rate in volts per second
+#define WRITE_RATE_MAX 100000
+#define SLEW_RATE_MAX  100000
+
+// last committed DAC codes are checked this often, and saved at most every STATE_SAVE_INTERVAL_MS while changing
+#define STATE_CHECK_INTERVAL_MS 250
+#define STATE_SAVE_INTERVAL_MS  5000
+
+// live tunables, changed through the control socket. process and the writer work on their own copies
+typedef struct {
+  int write_suppression;
+  int median_window; // frames at the end of each period to reduce, 0 for all of them
+  int channel_rate;  // max DAC writes per second for each output, 0 for unlimited
+  int total_rate;    // max DAC writes per second for all outputs together, 0 for unlimited
+  int slew_rate;     // max output change in volts per second for rate capped writes, 0 for none
+} jack2spi_params_t;
+
+static const mod_control_param_t jack2spi_params_table[] = {
+  { "write_suppression", offsetof(jack2spi_params_t, write_suppression), 0, 1,                 NULL },
+  { "median_window",     offsetof(jack2spi_params_t, median_window),     0, MEDIAN_WINDOW_MAX, NULL },
+  { "channel_rate",      offsetof(jack2spi_params_t, channel_rate),      0, WRITE_RATE_MAX,    NULL },
+  { "total_rate",        offsetof(jack2spi_params_t, total_rate),        0, WRITE_RATE_MAX,    NULL },
+  { "slew_rate",         offsetof(jack2spi_params_t, slew_rate),         0, SLEW_RATE_MAX,     NULL },
+};
+
+enum {
+  latency_post_to_wake,
+  latency_wake_to_write,
+  latency_post_to_write,
+  latency_count
+};
+
 typedef struct {
   jack_client_t* client;
   jack_port_t* port1;
   jack_port_t* port2;
+  // optional control-rate companions of playback_1 and playback_2, NULL if disabled
+  jack_port_t* portControlRate[2];
   float value1, value2;
   FILE *out1f, *out2f;
   float* tmpSortArray;
+  // reduction kernel for the current buffer size, swapped atomically on buffer size changes
+  mod_median_kernel_t median_kernel;
+  // per output reduction chosen at startup, single pass kernels need no size specialization. NULL for the median
+  mod_reduce_mode_t reduce_mode[2];
+  mod_reduce_kernel_t reduce_kernel[2];
+  // peak hold, only used by process
+  float peak_held[2];
+  uint32_t peak_age[2], peak_hold_frames;
+  // volts -> raw, per output
+  uint16_t dac_table[2][MOD_CALIBRATION_TABLE_SIZE];
+  // latency instrumentation, enabled if latency_file is set
+  const char* latency_file;
+  unsigned latency_interval;
+  jack_time_t post_time;
+  mod_latency_histogram_t latency[latency_count];
+  // tunables as last published by the control thread, and the copies used by process and the writer
+  jack2spi_params_t params;
+  mod_control_t control;
+  jack2spi_params_t process_params, writer_params;
+  uint32_t process_params_seq, writer_params_seq;
+  // DAC write budget, only used by the writer
+  mod_dacsched_t sched;
+  int lastrvalue[2];
+  // last codes written to the DAC and their values, kept across resyncs. -1 if nothing was written yet
+  int committed[2];
+  float committed_value[2];
+  // committed codes are kept in this file if set, saved from a non realtime thread
+  const char* state_file;
+  int state_saved[2];
+  pthread_t state_thread;
+  bool state_thread_running;
+  // restored outputs keep their value until their port is first connected, only used by process
+  bool hold[2];
+  float hold_value[2];
+  // write from the jack process thread right after signalling the graph, instead of a separate thread
+  bool use_process_thread;
+  // set on xruns and freewheel changes, the next write then goes to the DAC regardless of suppression
+  volatile bool resync;
+  volatile bool freewheeling;
+  jack_time_t last_write_time;
+  // telemetry, points to local_stats if shared memory is not available
+  mod_cv_stats_t* stats;
+  mod_cv_stats_t local_stats;
+  // raw output recording, enabled if the trace header is set
+  mod_trace_t trace;
   volatile bool run;
   volatile bool cvEnabled;
   bool wasEnabled;
@@ -69,41 +175,323 @@ typedef struct {
 #else
   atomic_bool has_data;
 #endif
-  // for knowing wherever the cv/hp mode is enabled or not
-  snd_mixer_t* mixer;
-  snd_mixer_elem_t* mixerElem;
+  // for knowing wherever the cv/hp mode is enabled or not, ctl is NULL if the switch is not available
+  mod_alsactl_t alsactl;
+  int switchHpCvMode;
 } jack2spi_t;
 
-static bool _get_alsa_switch_value(snd_mixer_elem_t* const elem)
+// set from SIGUSR1, only installed when running standalone
+static volatile sig_atomic_t latency_dump_requested = 0;
+
+static void latency_signal_handler(int sig)
 {
-    int val = 0;
-    snd_mixer_selem_get_playback_switch(elem, SND_MIXER_SCHN_MONO, &val);
-    return (val != 0);
+    latency_dump_requested = 1;
+    return; (void)sig;
 }
 
-static void* write_spi_thread(void* ptr)
+static int _get_env_int(const char* const name, const int fallback, const int min, const int max)
 {
-    jack2spi_t* const jack2spi = (jack2spi_t*)ptr;
+    const char* const value = getenv(name);
 
-    FILE* const out1f = jack2spi->out1f;
-    FILE* const out2f = jack2spi->out2f;
+    if (value == NULL || value[0] == '\0')
+        return fallback;
 
+    const int ivalue = atoi(value);
+
+    if (ivalue < min)
+        return min;
+    if (ivalue > max)
+        return max;
+
+    return ivalue;
+}
+
+static inline uint16_t get_raw_spi_value(const uint16_t* const table, const float value)
+{
+    if (value <= 0.0f)
+        return table[0];
+    if (value >= 10.0f)
+        return table[MAX_RAW_IIO_VALUE];
+    return table[(int)(value / 10.0f * MAX_RAW_IIO_VALUE_f + 0.5f)];
+}
+
+static inline void write_raw_spi_value(FILE* const f, const uint16_t rvalue)
+{
     char buf[12];
+
+    if (snprintf(buf, sizeof(buf), "%u\n", rvalue) >= (int)sizeof(buf)-1)
+    {
+        buf[sizeof(buf)-2] = '\n';
+        buf[sizeof(buf)-1] = '\0';
+    }
+    else
+    {
+        buf[sizeof(buf)-1] = '\0';
+    }
+
+    rewind(f);
+    fwrite(buf, strlen(buf)+1, 1, f);
+    // push the value now, otherwise it only reaches the device on the next rewind
+    fflush(f);
+}
+
+static void dump_latency_if_requested(jack2spi_t* const jack2spi, time_t* const last_dump)
+{
+    if (jack2spi->latency_file == NULL)
+        return;
+
+    const time_t now = time(NULL);
+
+    if (latency_dump_requested ||
+        (jack2spi->latency_interval != 0 && now - *last_dump >= jack2spi->latency_interval))
+    {
+        latency_dump_requested = 0;
+        *last_dump = now;
+        mod_latency_dump_all(jack2spi->latency_file, "jack2spi", jack2spi->latency, latency_count);
+    }
+}
+
+static void handle_mixer_events(jack2spi_t* const jack2spi)
+{
+    if (! mod_alsactl_handle_events(&jack2spi->alsactl))
+        return;
+
+    jack2spi->cvEnabled = mod_alsactl_get_switch(&jack2spi->alsactl, jack2spi->switchHpCvMode);
+    mod_cv_stats_set(&jack2spi->stats->mode, jack2spi->cvEnabled ? 1 : 0);
+}
+
+static void configure_scheduler(jack2spi_t* const jack2spi)
+{
+    const jack2spi_params_t* const params = &jack2spi->writer_params;
+
+    mod_dacsched_configure(&jack2spi->sched, (unsigned)params->channel_rate, (unsigned)params->total_rate,
+                           (float)params->slew_rate, jack_get_time());
+}
+
+static void write_dac_channel(jack2spi_t* const jack2spi, const unsigned c, const uint16_t rvalue, const float value)
+{
+    mod_cv_stats_t* const stats = jack2spi->stats;
+
+    write_raw_spi_value(c == 0 ? jack2spi->out1f : jack2spi->out2f, rvalue);
+    mod_cv_stats_increment(&stats->writes);
+    jack2spi->lastrvalue[c] = rvalue;
+    jack2spi->committed_value[c] = value;
+    __atomic_store_n(&jack2spi->committed[c], rvalue, __ATOMIC_RELEASE);
+
+    if (jack2spi->trace.header != NULL)
+        mod_trace_append(&jack2spi->trace, jack_get_time(),
+                         (uint32_t)__atomic_load_n(&stats->cycles, __ATOMIC_RELAXED), (uint8_t)c, rvalue);
+}
+
+static void write_dac_values(jack2spi_t* const jack2spi, const float value1, const float value2)
+{
+    mod_cv_stats_t* const stats = jack2spi->stats;
+
+    if (mod_control_load(&jack2spi->control, &jack2spi->writer_params_seq, &jack2spi->writer_params))
+        configure_scheduler(jack2spi);
+
+    const bool write_suppression = jack2spi->writer_params.write_suppression != 0;
+
+    // posts coalesce in the semaphore, so a burst of cycles after an xrun results in a single write
+    // with the latest values. make sure it reaches the DAC even if suppression thinks otherwise.
+    if (__atomic_exchange_n(&jack2spi->resync, false, __ATOMIC_ACQ_REL))
+    {
+        jack2spi->lastrvalue[0] = jack2spi->lastrvalue[1] = -1;
+        mod_dacsched_invalidate(&jack2spi->sched);
+    }
+
+    if (jack2spi->freewheeling)
+    {
+        const jack_time_t now = jack_get_time();
+
+        if (now - jack2spi->last_write_time < FREEWHEEL_WRITE_INTERVAL_US)
+        {
+            // skipped writes are counted per output
+            mod_cv_stats_add(&stats->skipped_writes, 2);
+            return;
+        }
+
+        jack2spi->last_write_time = now;
+    }
+
+    const float values[2] = { value1, value2 };
+
+    // skip DAC writes that would not change the output, queue the others
+    for (unsigned c = 0; c < 2; ++c)
+    {
+        if (write_suppression && get_raw_spi_value(jack2spi->dac_table[c], values[c]) == jack2spi->lastrvalue[c])
+        {
+            mod_cv_stats_increment(&stats->skipped_writes);
+            mod_dacsched_cancel(&jack2spi->sched, c);
+        }
+        else if (mod_dacsched_post(&jack2spi->sched, c, values[c]))
+        {
+            mod_cv_stats_increment(&stats->coalesced_writes);
+        }
+    }
+
+    // without limits every posted channel is written right away, in order of distance to its target otherwise
+    const jack_time_t now = jack_get_time();
+    unsigned order[MOD_DACSCHED_MAX_CHANNELS], deferred;
+    const unsigned count = mod_dacsched_select(&jack2spi->sched, now, order, &deferred);
+
+    for (unsigned i = 0; i < count; ++i)
+    {
+        const unsigned c = order[i];
+        const float value = mod_dacsched_take(&jack2spi->sched, c, now);
+        const uint16_t rvalue = get_raw_spi_value(jack2spi->dac_table[c], value);
+
+        // slewing by less than one DAC step
+        if (write_suppression && rvalue == jack2spi->lastrvalue[c])
+            mod_cv_stats_increment(&stats->skipped_writes);
+        else
+            write_dac_channel(jack2spi, c, rvalue, value);
+    }
+
+    if (deferred != 0)
+        mod_cv_stats_add(&stats->deferred_writes, deferred);
+}
+
+static bool load_dac_state(const char* const filename, int codes[2], float values[2])
+{
+    FILE* const f = fopen(filename, "r");
+    if (f == NULL)
+        return false;
+
+    char line[256];
+    int index, code;
+    float value;
+
+    codes[0] = codes[1] = -1;
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "out%d %d %f", &index, &code, &value) != 3)
+            continue;
+        if (index < 1 || index > 2 || code < 0 || code > MAX_RAW_IIO_VALUE)
+            continue;
+
+        codes[index - 1] = code;
+        values[index - 1] = value;
+    }
+
+    fclose(f);
+    return codes[0] >= 0 || codes[1] >= 0;
+}
+
+// written to a temporary file first, so a crash never leaves a truncated one behind
+static bool save_dac_state(const char* const filename, const int codes[2], const float values[2])
+{
+    char tmpname[512];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+    FILE* const f = fopen(tmpname, "w");
+    if (f == NULL)
+        return false;
+
+    fputs("# out<output> <dac code> <volts>\n", f);
+
+    for (int c = 0; c < 2; ++c)
+        if (codes[c] >= 0)
+            fprintf(f, "out%d %d %.4f\n", c + 1, codes[c], (double)values[c]);
+
+    if (fclose(f) != 0)
+    {
+        remove(tmpname);
+        return false;
+    }
+
+    return rename(tmpname, filename) == 0;
+}
+
+// saves the committed codes if they differ from the saved ones, returns true if saved
+static bool save_dac_state_if_changed(jack2spi_t* const jack2spi)
+{
+    int* const saved = jack2spi->state_saved;
+    int codes[2];
+    float values[2];
+
+    for (int c = 0; c < 2; ++c)
+    {
+        codes[c] = __atomic_load_n(&jack2spi->committed[c], __ATOMIC_ACQUIRE);
+        values[c] = jack2spi->committed_value[c];
+    }
+
+    if (codes[0] == saved[0] && codes[1] == saved[1])
+        return false;
+
+    if (! save_dac_state(jack2spi->state_file, codes, values))
+    {
+        fprintf(stderr, "Cannot save DAC state to '%s'\n", jack2spi->state_file);
+        return false;
+    }
+
+    saved[0] = codes[0];
+    saved[1] = codes[1];
+    return true;
+}
+
+// file writes never happen on the realtime threads, and standalone clients are usually stopped without cleanup.
+// latency histograms are dumped from here too
+static void* state_thread(void* ptr)
+{
+    jack2spi_t* const jack2spi = (jack2spi_t*)ptr;
+
+    unsigned elapsed_ms = STATE_SAVE_INTERVAL_MS;
+    time_t latency_last_dump = time(NULL);
+
+    while (jack2spi->run)
+    {
+        usleep(STATE_CHECK_INTERVAL_MS * 1000);
+
+        dump_latency_if_requested(jack2spi, &latency_last_dump);
+
+        if (jack2spi->state_file == NULL)
+            continue;
+
+        if ((elapsed_ms += STATE_CHECK_INTERVAL_MS) < STATE_SAVE_INTERVAL_MS)
+            continue;
+
+        if (save_dac_state_if_changed(jack2spi))
+            elapsed_ms = 0;
+    }
+
+    return NULL;
+}
+
+static void record_write_latency(jack2spi_t* const jack2spi, const jack_time_t post_time,
+                                 const jack_time_t wake_time, const jack_time_t write_time)
+{
+    if (post_time != 0 && wake_time >= post_time)
+    {
+        mod_latency_record(&jack2spi->latency[latency_post_to_wake], (wake_time - post_time) * 1000);
+        mod_latency_record(&jack2spi->latency[latency_post_to_write], (write_time - post_time) * 1000);
+    }
+
+    mod_latency_record(&jack2spi->latency[latency_wake_to_write], (write_time - wake_time) * 1000);
+}
+
+static void* write_spi_thread(void* ptr)
+{
+    jack2spi_t* const jack2spi = (jack2spi_t*)ptr;
+
     float value1, value2;
-    uint16_t rvalue1, rvalue2;
+
+    jack_time_t wake_time;
+
+    mod_cv_stats_t* const stats = jack2spi->stats;
 
     while (jack2spi->run)
     {
         // handle mixer changes
-        if (jack2spi->mixer != NULL)
-        {
-            snd_mixer_handle_events(jack2spi->mixer);
-            jack2spi->cvEnabled = _get_alsa_switch_value(jack2spi->mixerElem);
-        }
+        handle_mixer_events(jack2spi);
 
 #ifdef USE_SEMAPHORE
         if (sem_timedwait_secs(&jack2spi->sem, 1) != 0)
+        {
+            mod_cv_stats_increment(&stats->sem_timeouts);
             continue;
+        }
 #else
         if (! atomic_load(&jack2spi->has_data))
         {
@@ -112,6 +500,8 @@ static void* write_spi_thread(void* ptr)
         }
 #endif
 
+        wake_time = jack_get_time();
+
         // read the values as soon as we get unlocked
         value1 = jack2spi->value1;
         value2 = jack2spi->value2;
@@ -119,72 +509,36 @@ static void* write_spi_thread(void* ptr)
         atomic_store(&jack2spi->has_data, false);
 #endif
 
-        // out1
-        if (value1 <= 0.0f)
-            rvalue1 = 0;
-        else if (value1 >= 10.0f)
-            rvalue1 = MAX_RAW_IIO_VALUE;
-        else
-            rvalue1 = (uint16_t)(int)(value1 / 10.0f * MAX_RAW_IIO_VALUE_f + 0.5f);
+        write_dac_values(jack2spi, value1, value2);
 
-        // out2
-        if (value2 <= 0.0f)
-            rvalue2 = 0;
-        else if (value2 >= 10.0f)
-            rvalue2 = MAX_RAW_IIO_VALUE;
-        else
-            rvalue2 = (uint16_t)(int)(value2 / 10.0f * MAX_RAW_IIO_VALUE_f + 0.5f);
-
-        if (snprintf(buf, sizeof(buf), "%u\n", rvalue1) >= (int)sizeof(buf)-1)
-        {
-            buf[sizeof(buf)-2] = '\n';
-            buf[sizeof(buf)-1] = '\0';
-        }
-        else
-        {
-            buf[sizeof(buf)-1] = '\0';
-        }
-
-        rewind(out1f);
-        fwrite(buf, strlen(buf)+1, 1, out1f);
-
-        if (snprintf(buf, sizeof(buf), "%u\n", rvalue2) >= (int)sizeof(buf)-1)
-        {
-            buf[sizeof(buf)-2] = '\n';
-            buf[sizeof(buf)-1] = '\0';
-        }
-        else
-        {
-            buf[sizeof(buf)-1] = '\0';
-        }
-
-        rewind(out2f);
-        fwrite(buf, strlen(buf)+1, 1, out2f);
+        if (jack2spi->latency_file != NULL)
+            record_write_latency(jack2spi, __atomic_load_n(&jack2spi->post_time, __ATOMIC_ACQUIRE),
+                                 wake_time, jack_get_time());
     }
 
     return NULL;
 }
 
-static inline float get_median_value(float* tmparray, const float* source, jack_nframes_t nframes)
+static int xrun_callback(void* arg)
 {
-    float temp;
+    jack2spi_t* const jack2spi = (jack2spi_t*)arg;
 
-    memcpy(tmparray, source, sizeof(float)*nframes);
+    __atomic_store_n(&jack2spi->resync, true, __ATOMIC_RELEASE);
+    mod_cv_stats_increment(&jack2spi->stats->xruns);
+    return 0;
+}
 
-    for (jack_nframes_t i=0; i < nframes ; i++)
-    {
-        for (jack_nframes_t j=0; j < nframes - 1; j++)
-        {
-            if (tmparray[j] > tmparray[j+1])
-            {
-                temp          = tmparray[j];
-                tmparray[j]   = tmparray[j+1];
-                tmparray[j+1] = temp;
-            }
-        }
-    }
+static void freewheel_callback(int starting, void* arg)
+{
+    jack2spi_t* const jack2spi = (jack2spi_t*)arg;
 
-    return (tmparray[nframes-1] + tmparray[nframes/2])/2.0f;
+    jack2spi->freewheeling = starting != 0;
+    mod_cv_stats_set(&jack2spi->stats->freewheeling, starting ? 1 : 0);
+
+    if (starting)
+        mod_cv_stats_increment(&jack2spi->stats->freewheels);
+    else
+        __atomic_store_n(&jack2spi->resync, true, __ATOMIC_RELEASE);
 }
 
 static int bufsize_callback(jack_nframes_t nframes, void* arg)
@@ -193,63 +547,228 @@ static int bufsize_callback(jack_nframes_t nframes, void* arg)
 
     free(jack2spi->tmpSortArray);
     jack2spi->tmpSortArray = malloc(sizeof(float)*nframes);
+    __atomic_store_n(&jack2spi->median_kernel, mod_kernels_get_median(nframes), __ATOMIC_RELEASE);
 
     return 0;
 }
 
-static int process_callback(jack_nframes_t nframes, void* arg)
+static float reduce_port(jack2spi_t* const jack2spi, const unsigned c, const mod_median_kernel_t median_kernel,
+                         const float* const buf, const jack_nframes_t count, const jack_nframes_t nframes)
 {
-    jack2spi_t* const jack2spi = (jack2spi_t*)arg;
+    const mod_reduce_kernel_t kernel = jack2spi->reduce_kernel[c];
+
+    if (kernel == NULL)
+        return median_kernel(jack2spi->tmpSortArray, buf, count);
+
+    const float value = kernel(buf, count);
+
+    if (jack2spi->reduce_mode[c] != mod_reduce_peak)
+        return value;
+
+    if (value >= jack2spi->peak_held[c] || jack2spi->peak_age[c] >= jack2spi->peak_hold_frames)
+    {
+        jack2spi->peak_held[c] = value;
+        jack2spi->peak_age[c] = 0;
+    }
+    else
+    {
+        jack2spi->peak_age[c] += nframes;
+    }
+
+    return jack2spi->peak_held[c];
+}
+
+// connected control-rate ports already carry one value per period, there is nothing to reduce
+static bool read_control_rate_port(jack_port_t* const port, const jack_nframes_t nframes, float* const value)
+{
+    return port != NULL && jack_port_connected(port) > 0 &&
+           mod_cv_port_read(jack_port_get_buffer(port, nframes), value);
+}
 
+// reduces the port buffers to a single value each, returns false if there is nothing to write.
+// control-rate ports take precedence over audio-rate ones when both are connected
+static bool reduce_port_values(jack2spi_t* const jack2spi, const jack_nframes_t nframes)
+{
     if (jack2spi->cvEnabled)
     {
-        if (jack_port_connected(jack2spi->port1) > 0)
+        mod_control_load(&jack2spi->control, &jack2spi->process_params_seq, &jack2spi->process_params);
+
+        const uint32_t window = (uint32_t)jack2spi->process_params.median_window;
+        mod_median_kernel_t median_kernel = __atomic_load_n(&jack2spi->median_kernel, __ATOMIC_ACQUIRE);
+        jack_nframes_t count = nframes, offset = 0;
+
+        // only the end of the period (for every reduction but the last frame), rounded down to a power of 2 so kernels stay specialized and aligned
+        if (window != 0 && window < nframes)
+        {
+            count = 1u << (31 - __builtin_clz(window > 16 ? window : 16));
+
+            if (count < nframes)
+            {
+                offset = nframes - count;
+                median_kernel = mod_kernels_get_median(count);
+            }
+            else
+            {
+                count = nframes;
+            }
+        }
+
+        if (read_control_rate_port(jack2spi->portControlRate[0], nframes, &jack2spi->value1))
+        {
+            jack2spi->hold[0] = false;
+        }
+        else if (jack_port_connected(jack2spi->port1) > 0)
         {
             const float* const port1buf = jack_port_get_buffer(jack2spi->port1, nframes);
-            jack2spi->value1 = get_median_value(jack2spi->tmpSortArray, port1buf, nframes);
+            jack2spi->value1 = reduce_port(jack2spi, 0, median_kernel, port1buf + offset, count, nframes);
+            jack2spi->hold[0] = false;
         }
         else
         {
-            jack2spi->value1 = 0.0f;
+            jack2spi->value1 = jack2spi->hold[0] ? jack2spi->hold_value[0] : 0.0f;
         }
 
-        if (jack_port_connected(jack2spi->port2) > 0)
+        if (read_control_rate_port(jack2spi->portControlRate[1], nframes, &jack2spi->value2))
+        {
+            jack2spi->hold[1] = false;
+        }
+        else if (jack_port_connected(jack2spi->port2) > 0)
         {
             const float* const port2buf = jack_port_get_buffer(jack2spi->port2, nframes);
-            jack2spi->value2 = get_median_value(jack2spi->tmpSortArray, port2buf, nframes);
+            jack2spi->value2 = reduce_port(jack2spi, 1, median_kernel, port2buf + offset, count, nframes);
+            jack2spi->hold[1] = false;
         }
         else
         {
-            jack2spi->value2 = 0.0f;
+            jack2spi->value2 = jack2spi->hold[1] ? jack2spi->hold_value[1] : 0.0f;
         }
 
         jack2spi->wasEnabled = true;
+        return true;
     }
-    else if (jack2spi->wasEnabled)
+
+    if (jack2spi->wasEnabled)
     {
         jack2spi->value1 = jack2spi->value2 = 0.0f;
         jack2spi->wasEnabled = false;
+        return true;
     }
-    else
+
+    return false;
+}
+
+static int process_callback(jack_nframes_t nframes, void* arg)
+{
+    jack2spi_t* const jack2spi = (jack2spi_t*)arg;
+
+    const uint64_t start_ns = mod_latency_now_ns();
+
+    if (! reduce_port_values(jack2spi, nframes))
     {
+        mod_cv_stats_record_dsp(jack2spi->stats, nframes, mod_latency_now_ns() - start_ns);
         return 0;
     }
 
+    if (jack2spi->latency_file != NULL)
+        __atomic_store_n(&jack2spi->post_time, jack_get_time(), __ATOMIC_RELEASE);
+
 #ifdef USE_SEMAPHORE
     sem_post(&jack2spi->sem);
 #else
     atomic_store(&jack2spi->has_data, true);
 #endif
 
+    mod_cv_stats_record_dsp(jack2spi->stats, nframes, mod_latency_now_ns() - start_ns);
     return 0;
 }
 
+// process thread mode, the graph is signalled as soon as the values are reduced.
+// the DAC write and mixer polling then happen on this same thread, without delaying other clients.
+static void* process_thread(void* arg)
+{
+    jack2spi_t* const jack2spi = (jack2spi_t*)arg;
+
+    jack_time_t signal_time, write_start;
+
+    for (;;)
+    {
+        const jack_nframes_t nframes = jack_cycle_wait(jack2spi->client);
+        const uint64_t start_ns = mod_latency_now_ns();
+
+        const bool has_values = reduce_port_values(jack2spi, nframes);
+
+        mod_cv_stats_record_dsp(jack2spi->stats, nframes, mod_latency_now_ns() - start_ns);
+
+        signal_time = jack2spi->latency_file != NULL ? jack_get_time() : 0;
+        jack_cycle_signal(jack2spi->client, 0);
+
+        if (has_values)
+        {
+            write_start = jack2spi->latency_file != NULL ? jack_get_time() : 0;
+            write_dac_values(jack2spi, jack2spi->value1, jack2spi->value2);
+
+            if (jack2spi->latency_file != NULL)
+                record_write_latency(jack2spi, signal_time, write_start, jack_get_time());
+        }
+
+        handle_mixer_events(jack2spi);
+    }
+
+    return NULL;
+}
+
+// commands besides the tunables
+static void control_handler(void* arg, int argc, char* argv[], char* reply, size_t size)
+{
+    jack2spi_t* const jack2spi = (jack2spi_t*)arg;
+    const mod_cv_stats_t* const stats = jack2spi->stats;
+
+    if (strcmp(argv[0], "stats") == 0)
+    {
+        // latency histograms are dumped by the state thread, same as on SIGUSR1
+        if (jack2spi->latency_file != NULL)
+            latency_dump_requested = 1;
+
+        snprintf(reply, size, "ok cycles=%llu writes=%llu skipped_writes=%llu deferred_writes=%llu "
+                              "coalesced_writes=%llu sem_timeouts=%llu xruns=%llu",
+                 (unsigned long long)__atomic_load_n(&stats->cycles, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&stats->writes, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&stats->skipped_writes, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&stats->deferred_writes, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&stats->coalesced_writes, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&stats->sem_timeouts, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&stats->xruns, __ATOMIC_RELAXED));
+        return;
+    }
+
+    snprintf(reply, size, "error unknown command, use list, get, set or stats");
+    return; (void)argc;
+}
+
 JACK_LIB_EXPORT
 int jack_initialize(jack_client_t* client, const char* load_init);
 
 JACK_LIB_EXPORT
 void jack_finish(void* arg);
 
+// everything besides ports and threads, shared by jack_finish and failed startups
+static void close_resources(jack2spi_t* const jack2spi)
+{
+    fclose(jack2spi->out1f);
+    fclose(jack2spi->out2f);
+
+    mod_alsactl_close(&jack2spi->alsactl);
+
+#ifdef USE_SEMAPHORE
+    sem_destroy(&jack2spi->sem);
+#endif
+
+    if (jack2spi->stats != &jack2spi->local_stats)
+        mod_cv_stats_destroy(jack2spi->stats, MOD_CV_STATS_JACK2SPI);
+
+    mod_trace_close(&jack2spi->trace);
+}
+
 JACK_LIB_EXPORT
 int jack_initialize(jack_client_t* client, const char* load_init)
 {
@@ -302,7 +821,7 @@ int jack_initialize(jack_client_t* client, const char* load_init)
     if (!out2f)
     {
         fprintf(stderr, "Cannot get iio raw output 2 file\n");
-        fclose(out2f);
+        fclose(out1f);
         return EXIT_FAILURE;
     }
 
@@ -321,60 +840,141 @@ int jack_initialize(jack_client_t* client, const char* load_init)
     sem_init(&jack2spi->sem, 0, 0);
 #endif
 
-    // setup alsa-mixer listener
-    if (snd_mixer_open(&jack2spi->mixer, SND_MIXER_ELEM_SIMPLE) == 0)
+    jack2spi->params.write_suppression = _get_env_int("MOD_JACK2SPI_WRITE_SUPPRESSION", 1, 0, 1);
+    jack2spi->params.median_window = _get_env_int("MOD_JACK2SPI_MEDIAN_WINDOW", 0, 0, MEDIAN_WINDOW_MAX);
+    jack2spi->params.channel_rate = _get_env_int("MOD_JACK2SPI_CHANNEL_RATE", 0, 0, WRITE_RATE_MAX);
+    jack2spi->params.total_rate = _get_env_int("MOD_JACK2SPI_TOTAL_RATE", 0, 0, WRITE_RATE_MAX);
+    jack2spi->params.slew_rate = _get_env_int("MOD_JACK2SPI_SLEW_RATE", 0, 0, SLEW_RATE_MAX);
+    mod_control_init(&jack2spi->control, jack2spi_params_table,
+                     sizeof(jack2spi_params_table) / sizeof(jack2spi_params_table[0]),
+                     &jack2spi->params, sizeof(jack2spi->params));
+    jack2spi->process_params_seq = jack2spi->writer_params_seq = MOD_CONTROL_SEQ_NONE;
+    mod_control_load(&jack2spi->control, &jack2spi->process_params_seq, &jack2spi->process_params);
+    mod_control_load(&jack2spi->control, &jack2spi->writer_params_seq, &jack2spi->writer_params);
+    jack2spi->use_process_thread = _get_env_int("MOD_JACK2SPI_PROCESS_THREAD", 0, 0, 1) != 0;
+    const bool control_rate_ports = _get_env_int("MOD_JACK2SPI_CONTROL_RATE_PORTS", 0, 0, 1) != 0;
+    mod_dacsched_init(&jack2spi->sched, 2);
+    configure_scheduler(jack2spi);
+
+    jack2spi->peak_hold_frames = jack_get_sample_rate(client) * PEAK_HOLD_MS / 1000;
+
+    // block reduction, "mode" for both outputs or "mode1,mode2", median by default
     {
-        snd_mixer_selem_id_t* sid;
+        const char* reduce = getenv("MOD_JACK2SPI_REDUCE");
+
+        for (int c = 0; c < 2; ++c)
+        {
+            jack2spi->reduce_mode[c] = c == 0 ? mod_reduce_median : jack2spi->reduce_mode[0];
 
-        char soundcard[32] = "hw:";
+            if (reduce == NULL || reduce[0] == '\0')
+                continue;
 
-        const char* const cardname = getenv("MOD_SOUNDCARD");
-        if (cardname != NULL)
-            strncat(soundcard, cardname, 28);
-        else
-            strncat(soundcard, ALSA_SOUNDCARD_DEFAULT_ID, 28);
+            const char* const comma = strchr(reduce, ',');
+            const size_t len = comma != NULL ? (size_t)(comma - reduce) : strlen(reduce);
 
-        soundcard[31] = '\0';
+            int mode = mod_reduce_median;
+            for (; mode < mod_reduce_count && (strncmp(reduce, reduce_mode_names[mode], len) != 0 ||
+                                               reduce_mode_names[mode][len] != '\0'); ++mode) {}
 
-        if (snd_mixer_attach(jack2spi->mixer, soundcard) == 0 &&
-            snd_mixer_selem_register(jack2spi->mixer, NULL, NULL) == 0 &&
-            snd_mixer_load(jack2spi->mixer) == 0 &&
-            snd_mixer_selem_id_malloc(&sid) == 0)
+            if (mode < mod_reduce_count)
+                jack2spi->reduce_mode[c] = (mod_reduce_mode_t)mode;
+            else
+                fprintf(stderr, "Unknown reduction mode '%.*s' for output %d, using %s\n",
+                        (int)len, reduce, c + 1, reduce_mode_names[jack2spi->reduce_mode[c]]);
+
+            reduce = comma != NULL ? comma + 1 : NULL;
+        }
+
+        jack2spi->reduce_kernel[0] = mod_kernels_get_reduce(jack2spi->reduce_mode[0]);
+        jack2spi->reduce_kernel[1] = mod_kernels_get_reduce(jack2spi->reduce_mode[1]);
+    }
+    jack2spi->lastrvalue[0] = jack2spi->lastrvalue[1] = -1;
+    jack2spi->committed[0] = jack2spi->committed[1] = -1;
+
+    // setup telemetry
+    jack2spi->stats = mod_cv_stats_create(MOD_CV_STATS_JACK2SPI);
+
+    if (jack2spi->stats == NULL)
+    {
+        fprintf(stderr, "Cannot create telemetry shared memory, stats will not be published\n");
+        jack2spi->stats = &jack2spi->local_stats;
+        mod_cv_stats_init(jack2spi->stats);
+    }
+
+    // setup latency instrumentation
+    jack2spi->latency_file = getenv("MOD_JACK2SPI_LATENCY_FILE");
+
+    if (jack2spi->latency_file != NULL && jack2spi->latency_file[0] != '\0')
+    {
+        jack2spi->latency_interval = (unsigned)_get_env_int("MOD_JACK2SPI_LATENCY_INTERVAL", 0, 0, 86400);
+        if (jack2spi->use_process_thread)
         {
-            snd_mixer_selem_id_set_index(sid, 0);
-            snd_mixer_selem_id_set_name(sid, ALSA_CONTROL_HP_CV_MODE);
+            mod_latency_init(&jack2spi->latency[latency_post_to_wake], "cycle signal to write start");
+            mod_latency_init(&jack2spi->latency[latency_wake_to_write], "dac write");
+            mod_latency_init(&jack2spi->latency[latency_post_to_write], "cycle signal to dac write");
+        }
+        else
+        {
+            mod_latency_init(&jack2spi->latency[latency_post_to_wake], "sem post to writer wake");
+            mod_latency_init(&jack2spi->latency[latency_wake_to_write], "writer wake to dac write");
+            mod_latency_init(&jack2spi->latency[latency_post_to_write], "sem post to dac write");
+        }
+    }
+    else
+    {
+        jack2spi->latency_file = NULL;
+    }
 
-            jack2spi->mixerElem = snd_mixer_find_selem(jack2spi->mixer, sid);
+    // setup raw output recording
+    {
+        const char* const trace_file = getenv("MOD_JACK2SPI_TRACE");
 
-            if (jack2spi->mixerElem != NULL)
-                jack2spi->cvEnabled = _get_alsa_switch_value(jack2spi->mixerElem);
+        if (trace_file != NULL && trace_file[0] != '\0')
+        {
+            const int size = _get_env_int("MOD_JACK2SPI_TRACE_SIZE", TRACE_SIZE_DEFAULT, 1024, 1 << 26);
+            const bool wrap = _get_env_int("MOD_JACK2SPI_TRACE_WRAP", 0, 0, 1) != 0;
 
-            snd_mixer_selem_id_free(sid);
+            if (mod_trace_create(&jack2spi->trace, trace_file, "jack2spi", (uint64_t)size, wrap))
+                fprintf(stdout, "Recording raw outputs to '%s'\n", trace_file);
+            else
+                fprintf(stderr, "Cannot create trace file '%s', recording disabled\n", trace_file);
         }
+    }
+
+    // setup calibration, ideal linear scaling if missing
+    {
+        mod_calibration_points_t points[MOD_CALIBRATION_CHANNELS];
+        memset(points, 0, sizeof(points));
 
-        if (jack2spi->mixerElem == NULL)
+        const char* const calibration = getenv("MOD_JACK2SPI_CALIBRATION");
+        if (calibration != NULL && calibration[0] != '\0')
         {
-            snd_mixer_close(jack2spi->mixer);
-            jack2spi->mixer = NULL;
+            if (mod_calibration_load(calibration, "out", points))
+                fprintf(stdout, "Using calibration file '%s'\n", calibration);
+            else
+                fprintf(stderr, "Cannot open calibration file '%s', using default scaling\n", calibration);
         }
+
+        mod_calibration_build_dac_table(&points[0], jack2spi->dac_table[0]);
+        mod_calibration_build_dac_table(&points[1], jack2spi->dac_table[1]);
     }
 
-    // setup writing thread
-    pthread_attr_t attributes;
-    pthread_attr_init(&attributes);
-    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_JOINABLE);
-    pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
-    pthread_attr_setscope(&attributes, (client != NULL) ? PTHREAD_SCOPE_PROCESS : PTHREAD_SCOPE_SYSTEM);
-    pthread_attr_setschedpolicy(&attributes, SCHED_FIFO);
+    // setup alsa control listener
+    {
+        const char* const cardname = getenv("MOD_SOUNDCARD");
 
-    struct sched_param rt_param;
-    memset(&rt_param, 0, sizeof(rt_param));
-    rt_param.sched_priority = 78;
+        if (mod_alsactl_open(&jack2spi->alsactl, cardname != NULL ? cardname : ALSA_SOUNDCARD_DEFAULT_ID))
+        {
+            jack2spi->switchHpCvMode = mod_alsactl_add_switch(&jack2spi->alsactl, ALSA_CONTROL_HP_CV_MODE);
 
-    pthread_attr_setschedparam(&attributes, &rt_param);
+            if (jack2spi->switchHpCvMode < 0)
+                mod_alsactl_close(&jack2spi->alsactl);
+            else
+                jack2spi->cvEnabled = mod_alsactl_get_switch(&jack2spi->alsactl, jack2spi->switchHpCvMode);
+        }
 
-    pthread_create(&jack2spi->thread, &attributes, write_spi_thread, (void*)jack2spi);
-    pthread_attr_destroy(&attributes);
+        mod_cv_stats_set(&jack2spi->stats->mode, jack2spi->cvEnabled ? 1 : 0);
+    }
 
     jack2spi->client = client;
 
@@ -385,12 +985,85 @@ int jack_initialize(jack_client_t* client, const char* load_init)
 
     if (!jack2spi->port1 || !jack2spi->port2) {
         fprintf(stderr, "Can't register jack ports\n");
-        fclose(out1f);
-        fclose(out2f);
+
+        if (jack2spi->port1 != NULL)
+            jack_port_unregister(client, jack2spi->port1);
+        if (jack2spi->port2 != NULL)
+            jack_port_unregister(client, jack2spi->port2);
+
+        close_resources(jack2spi);
         free(jack2spi);
         return EXIT_FAILURE;
     }
 
+    // restore the last committed DAC codes once the ports are in place, outputs keep their voltage across restarts
+    jack2spi->state_file = getenv("MOD_JACK2SPI_STATE_FILE");
+    jack2spi->state_saved[0] = jack2spi->state_saved[1] = -1;
+
+    if (jack2spi->state_file != NULL && jack2spi->state_file[0] != '\0')
+    {
+        int codes[2];
+        float values[2];
+
+        if (jack2spi->cvEnabled && load_dac_state(jack2spi->state_file, codes, values))
+        {
+            for (unsigned c = 0; c < 2; ++c)
+            {
+                if (codes[c] < 0)
+                    continue;
+
+                write_dac_channel(jack2spi, c, (uint16_t)codes[c], values[c]);
+                jack2spi->state_saved[c] = codes[c];
+                mod_dacsched_restore(&jack2spi->sched, c, values[c], jack_get_time());
+                jack2spi->hold[c] = true;
+                jack2spi->hold_value[c] = values[c];
+            }
+
+            fprintf(stdout, "Restored DAC state from '%s'\n", jack2spi->state_file);
+        }
+    }
+    else
+    {
+        jack2spi->state_file = NULL;
+    }
+
+    // optional control-rate ports, the client keeps working without them. JACK2 does not support custom port types
+    if (control_rate_ports)
+    {
+        const long unsigned control_rate_flags = JackPortIsTerminal|JackPortIsPhysical|JackPortIsInput;
+        jack2spi->portControlRate[0] = mod_cv_port_register(client, "playback_1_control", control_rate_flags);
+        jack2spi->portControlRate[1] = mod_cv_port_register(client, "playback_2_control", control_rate_flags);
+
+        if (jack2spi->portControlRate[0] == NULL || jack2spi->portControlRate[1] == NULL)
+        {
+            fprintf(stderr, "Can't register jack control rate ports, control rate input disabled\n");
+
+            for (int c = 0; c < 2; ++c)
+            {
+                if (jack2spi->portControlRate[c] != NULL)
+                    jack_port_unregister(client, jack2spi->portControlRate[c]);
+                jack2spi->portControlRate[c] = NULL;
+            }
+        }
+        else
+        {
+            static const char* const aliases[2] = { "CV Playback 1 (control rate)", "CV Playback 2 (control rate)" };
+
+            for (int c = 0; c < 2; ++c)
+            {
+                jack_port_set_alias(jack2spi->portControlRate[c], aliases[c]);
+
+                const jack_uuid_t uuid = jack_port_uuid(jack2spi->portControlRate[c]);
+
+                if (!jack_uuid_empty(uuid))
+                {
+                    jack_set_property(client, uuid, JACK_METADATA_PRETTY_NAME, aliases[c], "text/plain");
+                    jack_set_property(client, uuid, JACK_METADATA_SIGNAL_TYPE, "CV", "text/plain");
+                }
+            }
+        }
+    }
+
     // Set port aliases and metadata
     jack_port_set_alias(jack2spi->port1, "CV Playback 1");
     jack_port_set_alias(jack2spi->port2, "CV Playback 2");
@@ -417,10 +1090,62 @@ int jack_initialize(jack_client_t* client, const char* load_init)
     }
 
     jack2spi->tmpSortArray = malloc(sizeof(float)*jack_get_buffer_size(client));
+    jack2spi->median_kernel = mod_kernels_get_median(jack_get_buffer_size(client));
 
     // Set callbacks
     jack_set_buffer_size_callback(client, bufsize_callback, jack2spi);
-    jack_set_process_callback(client, process_callback, jack2spi);
+    jack_set_xrun_callback(client, xrun_callback, jack2spi);
+    jack_set_freewheel_callback(client, freewheel_callback, jack2spi);
+
+    // setup writing thread, unless writing from the process thread
+    if (jack2spi->use_process_thread && jack_set_process_thread(client, process_thread, jack2spi) != 0)
+    {
+        fprintf(stderr, "Cannot use jack process thread, using separate writing thread\n");
+        jack2spi->use_process_thread = false;
+    }
+
+    if (! jack2spi->use_process_thread)
+    {
+        pthread_attr_t attributes;
+        pthread_attr_init(&attributes);
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_JOINABLE);
+        pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setscope(&attributes, (client != NULL) ? PTHREAD_SCOPE_PROCESS : PTHREAD_SCOPE_SYSTEM);
+        pthread_attr_setschedpolicy(&attributes, SCHED_FIFO);
+
+        struct sched_param rt_param;
+        memset(&rt_param, 0, sizeof(rt_param));
+        rt_param.sched_priority = 78;
+
+        pthread_attr_setschedparam(&attributes, &rt_param);
+
+        if (pthread_create(&jack2spi->thread, &attributes, write_spi_thread, (void*)jack2spi) != 0)
+        {
+            // no permission for realtime scheduling, run as regular thread instead
+            fprintf(stderr, "Cannot create realtime writing thread, using normal priority\n");
+            pthread_create(&jack2spi->thread, NULL, write_spi_thread, (void*)jack2spi);
+        }
+
+        pthread_attr_destroy(&attributes);
+
+        jack_set_process_callback(client, process_callback, jack2spi);
+    }
+
+    // setup control socket, last so that every tunable is in place
+    {
+        const char* const control = getenv("MOD_JACK2SPI_CONTROL");
+
+        if (control != NULL && control[0] != '\0')
+        {
+            if (mod_control_listen(&jack2spi->control, control, control_handler, jack2spi))
+                fprintf(stdout, "Listening for control commands on '%s'\n", control);
+            else
+                fprintf(stderr, "Cannot create control socket '%s', live tuning disabled\n", control);
+        }
+    }
+
+    if (jack2spi->state_file != NULL || jack2spi->latency_file != NULL)
+        jack2spi->state_thread_running = pthread_create(&jack2spi->state_thread, NULL, state_thread, jack2spi) == 0;
 
     // done
     jack_activate(client);
@@ -434,31 +1159,130 @@ void jack_finish(void* arg)
 {
     jack2spi_t* const jack2spi = (jack2spi_t*)arg;
 
+    mod_control_close(&jack2spi->control);
+
     jack2spi->run = false;
     jack_deactivate(jack2spi->client);
 
-    pthread_join(jack2spi->thread, NULL);
-    fclose(jack2spi->out1f);
-    fclose(jack2spi->out2f);
-    snd_mixer_close(jack2spi->mixer);
-#ifdef USE_SEMAPHORE
-    sem_destroy(&jack2spi->sem);
-#endif
+    if (! jack2spi->use_process_thread)
+        pthread_join(jack2spi->thread, NULL);
+
+    if (jack2spi->state_thread_running)
+    {
+        pthread_join(jack2spi->state_thread, NULL);
+
+        if (jack2spi->state_file != NULL)
+            save_dac_state_if_changed(jack2spi);
+    }
 
     jack_port_unregister(jack2spi->client, jack2spi->port1);
     jack_port_unregister(jack2spi->client, jack2spi->port2);
+
+    if (jack2spi->portControlRate[0] != NULL)
+    {
+        jack_port_unregister(jack2spi->client, jack2spi->portControlRate[0]);
+        jack_port_unregister(jack2spi->client, jack2spi->portControlRate[1]);
+    }
+
+    close_resources(jack2spi);
     free(jack2spi);
 }
 
+static int run_calibration(const char* const device, const char* const filename)
+{
+    char path[512];
+    FILE* outf[MOD_CALIBRATION_CHANNELS];
+
+    for (int c = 0; c < MOD_CALIBRATION_CHANNELS; ++c)
+    {
+        snprintf(path, sizeof(path), "%s/out_voltage%d_raw", device, c);
+        outf[c] = fopen(path, "wb");
+
+        if (outf[c] == NULL)
+        {
+            fprintf(stderr, "Cannot get iio raw output %d file\n", c + 1);
+
+            for (int o = 0; o < c; ++o)
+                fclose(outf[o]);
+
+            return EXIT_FAILURE;
+        }
+    }
+
+    mod_calibration_points_t points[MOD_CALIBRATION_CHANNELS];
+    memset(points, 0, sizeof(points));
+
+    fprintf(stdout, "Measure the outputs and type their voltages as '<out1> <out2>'.\n");
+    fprintf(stdout, "Use '-' to skip an output, an empty line skips the step.\n");
+
+    static const uint16_t steps[] = { 0, 256, 512, 1024, 1536, 2048, 2560, 3072, 3584, 3840, MAX_RAW_IIO_VALUE };
+
+    char line[64];
+    char values[MOD_CALIBRATION_CHANNELS][16];
+    float volts;
+
+    for (size_t i = 0; i < sizeof(steps)/sizeof(steps[0]); ++i)
+    {
+        for (int c = 0; c < MOD_CALIBRATION_CHANNELS; ++c)
+            write_raw_spi_value(outf[c], steps[i]);
+
+        fprintf(stdout, "raw %u> ", steps[i]);
+        fflush(stdout);
+
+        if (fgets(line, sizeof(line), stdin) == NULL)
+            break;
+
+        memset(values, 0, sizeof(values));
+
+        if (sscanf(line, "%15s %15s", values[0], values[1]) < 1)
+            continue;
+
+        for (int c = 0; c < MOD_CALIBRATION_CHANNELS; ++c)
+        {
+            if (values[c][0] == '\0' || values[c][0] == '-' || sscanf(values[c], "%f", &volts) != 1)
+                continue;
+
+            mod_calibration_add_point(&points[c], (float)steps[i], volts);
+        }
+    }
+
+    for (int c = 0; c < MOD_CALIBRATION_CHANNELS; ++c)
+    {
+        write_raw_spi_value(outf[c], 0);
+        fclose(outf[c]);
+    }
+
+    if (! mod_calibration_save(filename, "out", points))
+    {
+        fprintf(stderr, "Cannot write calibration file '%s'\n", filename);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stdout, "Calibration saved to '%s'\n", filename);
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char* argv[])
 {
+    if (argc > 3 && strcmp(argv[1], "--calibrate") == 0)
+        return run_calibration(argv[2], argv[3]);
+
     if (argc <= 1)
     {
         fprintf(stdout, "Usage: %s <bus-device>\n", argv[0]);
+        fprintf(stdout, "       %s --calibrate <bus-device> <calibration-file>\n", argv[0]);
         fprintf(stdout, "\tWhere bus-device is something like '/sys/bus/iio/devices/iio:device1'\n");
         return EXIT_FAILURE;
     }
 
+    // allow to request a latency dump at any time
+    struct sigaction sig;
+    memset(&sig, 0, sizeof(sig));
+    sig.sa_handler = latency_signal_handler;
+    sig.sa_flags = SA_RESTART;
+    sigemptyset(&sig.sa_mask);
+    sigaction(SIGUSR1, &sig, NULL);
+
     jack_client_t* const client = jack_client_open("mod-jack2spi", JackNoStartServer, NULL);
 
     if (!client)
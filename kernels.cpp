@@ -0,0 +1,336 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+# include <arm_neon.h>
+# define MOD_KERNELS_SIMD
+#elif defined(__SSE__)
+# include <xmmintrin.h>
+# define MOD_KERNELS_SIMD
+#endif
+
+namespace {
+
+// --------------------------------------------------------------------------------------------------------------------
+// log crossfade multipliers, log(i+1) / log(N) for each frame
+
+template <uint32_t N>
+struct RampTable {
+    static float multipliers[N] __attribute__((aligned(16)));
+
+    static void init()
+    {
+        const float bufsizelog = std::log(static_cast<float>(N));
+
+        for (uint32_t i = 0; i < N; ++i)
+            multipliers[i] = std::log(static_cast<float>(i + 1)) / bufsizelog;
+    }
+};
+
+template <uint32_t N>
+float RampTable<N>::multipliers[N];
+
+// filled on load, so the kernels never need to check
+struct RampTablesInit {
+    RampTablesInit()
+    {
+        RampTable<16>::init();
+        RampTable<32>::init();
+        RampTable<64>::init();
+        RampTable<128>::init();
+        RampTable<256>::init();
+        RampTable<512>::init();
+        RampTable<1024>::init();
+    }
+} sRampTablesInit;
+
+// --------------------------------------------------------------------------------------------------------------------
+// ramp
+
+void ramp_generic(float* const out, const uint32_t nframes, const float value, const float prevvalue, const float mult)
+{
+    const float bufsizelog = std::log(static_cast<float>(nframes));
+
+    for (uint32_t i = 0; i < nframes; ++i)
+    {
+        const float multiplier = std::log(static_cast<float>(i + 1)) / bufsizelog;
+        out[i] = (value * multiplier + prevvalue * (1.0f - multiplier)) * mult;
+    }
+}
+
+template <uint32_t N>
+void ramp(float* const out, const uint32_t nframes, const float value, const float prevvalue, const float mult)
+{
+    if (nframes != N)
+        return ramp_generic(out, nframes, value, prevvalue, mult);
+
+    float* const dst = static_cast<float*>(__builtin_assume_aligned(out, 16));
+    const float* const multipliers = RampTable<N>::multipliers;
+
+    // same as value * m + prevvalue * (1 - m), with the scaling folded in
+    const float start = prevvalue * mult;
+    const float delta = (value - prevvalue) * mult;
+
+#pragma GCC unroll 16
+    for (uint32_t i = 0; i < N; ++i)
+        dst[i] = start + delta * multipliers[i];
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+// median, partial sort instead of a full one, the max can only be in the upper half after it
+
+float median_generic(float* const tmp, const float* const in, const uint32_t nframes)
+{
+    if (nframes == 0)
+        return 0.0f;
+
+    std::memcpy(tmp, in, sizeof(float) * nframes);
+    std::nth_element(tmp, tmp + nframes / 2, tmp + nframes);
+
+    const float median = tmp[nframes / 2];
+    const float max = *std::max_element(tmp + nframes / 2, tmp + nframes);
+
+    return (max + median) / 2.0f;
+}
+
+template <uint32_t N>
+float median(float* const tmp, const float* const in, const uint32_t nframes)
+{
+    if (nframes != N)
+        return median_generic(tmp, in, nframes);
+
+    std::memcpy(tmp, __builtin_assume_aligned(in, 16), sizeof(float) * N);
+    std::nth_element(tmp, tmp + N / 2, tmp + N);
+
+    const float median = tmp[N / 2];
+    float max = median;
+
+#pragma GCC unroll 8
+    for (uint32_t i = N / 2 + 1; i < N; ++i)
+        max = std::max(max, tmp[i]);
+
+    return (max + median) / 2.0f;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+// 4 lane float vectors, only the few operations needed by the reductions
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+typedef float32x4_t vec4;
+
+inline vec4 vload(const float* const p)      { return vld1q_f32(p); }
+inline vec4 vadd(const vec4 a, const vec4 b) { return vaddq_f32(a, b); }
+inline vec4 vmul(const vec4 a, const vec4 b) { return vmulq_f32(a, b); }
+inline vec4 vmin(const vec4 a, const vec4 b) { return vminq_f32(a, b); }
+inline vec4 vmax(const vec4 a, const vec4 b) { return vmaxq_f32(a, b); }
+inline vec4 vabs(const vec4 a)               { return vabsq_f32(a); }
+inline void vstore(float* const p, const vec4 a) { vst1q_f32(p, a); }
+#elif defined(__SSE__)
+typedef __m128 vec4;
+
+inline vec4 vload(const float* const p)      { return _mm_loadu_ps(p); }
+inline vec4 vadd(const vec4 a, const vec4 b) { return _mm_add_ps(a, b); }
+inline vec4 vmul(const vec4 a, const vec4 b) { return _mm_mul_ps(a, b); }
+inline vec4 vmin(const vec4 a, const vec4 b) { return _mm_min_ps(a, b); }
+inline vec4 vmax(const vec4 a, const vec4 b) { return _mm_max_ps(a, b); }
+inline vec4 vabs(const vec4 a)               { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+inline void vstore(float* const p, const vec4 a) { _mm_storeu_ps(p, a); }
+#endif
+
+// --------------------------------------------------------------------------------------------------------------------
+// single pass reductions, each operation folds one frame (or one vector of 4) into the accumulator
+
+struct ReduceMean {
+    static float first(const float x) { return x; }
+    static float fold(const float acc, const float x) { return acc + x; }
+    static float merge(const float a, const float b) { return a + b; }
+    static float finish(const float acc, const uint32_t nframes) { return acc / static_cast<float>(nframes); }
+#ifdef MOD_KERNELS_SIMD
+    static vec4 vfirst(const vec4 x) { return x; }
+    static vec4 vfold(const vec4 acc, const vec4 x) { return vadd(acc, x); }
+#endif
+};
+
+struct ReduceMin {
+    static float first(const float x) { return x; }
+    static float fold(const float acc, const float x) { return std::min(acc, x); }
+    static float merge(const float a, const float b) { return std::min(a, b); }
+    static float finish(const float acc, uint32_t) { return acc; }
+#ifdef MOD_KERNELS_SIMD
+    static vec4 vfirst(const vec4 x) { return x; }
+    static vec4 vfold(const vec4 acc, const vec4 x) { return vmin(acc, x); }
+#endif
+};
+
+struct ReduceMax {
+    static float first(const float x) { return x; }
+    static float fold(const float acc, const float x) { return std::max(acc, x); }
+    static float merge(const float a, const float b) { return std::max(a, b); }
+    static float finish(const float acc, uint32_t) { return acc; }
+#ifdef MOD_KERNELS_SIMD
+    static vec4 vfirst(const vec4 x) { return x; }
+    static vec4 vfold(const vec4 acc, const vec4 x) { return vmax(acc, x); }
+#endif
+};
+
+struct ReducePeak {
+    static float first(const float x) { return std::fabs(x); }
+    static float fold(const float acc, const float x) { return std::max(acc, std::fabs(x)); }
+    static float merge(const float a, const float b) { return std::max(a, b); }
+    static float finish(const float acc, uint32_t) { return acc; }
+#ifdef MOD_KERNELS_SIMD
+    static vec4 vfirst(const vec4 x) { return vabs(x); }
+    static vec4 vfold(const vec4 acc, const vec4 x) { return vmax(acc, vabs(x)); }
+#endif
+};
+
+struct ReduceRms {
+    static float first(const float x) { return x * x; }
+    static float fold(const float acc, const float x) { return acc + x * x; }
+    static float merge(const float a, const float b) { return a + b; }
+    static float finish(const float acc, const uint32_t nframes) { return std::sqrt(acc / static_cast<float>(nframes)); }
+#ifdef MOD_KERNELS_SIMD
+    static vec4 vfirst(const vec4 x) { return vmul(x, x); }
+    static vec4 vfold(const vec4 acc, const vec4 x) { return vadd(acc, vmul(x, x)); }
+#endif
+};
+
+float reduce_last(const float* const in, const uint32_t nframes)
+{
+    return nframes != 0 ? in[nframes - 1] : 0.0f;
+}
+
+template <class Op>
+float reduce_reference(const float* const in, const uint32_t nframes)
+{
+    if (nframes == 0)
+        return 0.0f;
+
+    float acc = Op::first(in[0]);
+
+    for (uint32_t i = 1; i < nframes; ++i)
+        acc = Op::fold(acc, in[i]);
+
+    return Op::finish(acc, nframes);
+}
+
+#ifdef MOD_KERNELS_SIMD
+// unaligned loads, the median window can start anywhere in the buffer
+template <class Op>
+float reduce(const float* const in, const uint32_t nframes)
+{
+    if (nframes < 8)
+        return reduce_reference<Op>(in, nframes);
+
+    // two accumulators to hide the latency of each operation
+    vec4 acc1 = Op::vfirst(vload(in));
+    vec4 acc2 = Op::vfirst(vload(in + 4));
+    uint32_t i = 8;
+
+    for (; i + 8 <= nframes; i += 8)
+    {
+        acc1 = Op::vfold(acc1, vload(in + i));
+        acc2 = Op::vfold(acc2, vload(in + i + 4));
+    }
+
+    float lanes1[4], lanes2[4];
+    vstore(lanes1, acc1);
+    vstore(lanes2, acc2);
+
+    float acc = Op::merge(Op::merge(lanes1[0], lanes2[0]), Op::merge(lanes1[1], lanes2[1]));
+    acc = Op::merge(acc, Op::merge(Op::merge(lanes1[2], lanes2[2]), Op::merge(lanes1[3], lanes2[3])));
+
+    for (; i < nframes; ++i)
+        acc = Op::fold(acc, in[i]);
+
+    return Op::finish(acc, nframes);
+}
+#else
+template <class Op>
+float reduce(const float* const in, const uint32_t nframes)
+{
+    return reduce_reference<Op>(in, nframes);
+}
+#endif
+
+} // namespace
+
+// --------------------------------------------------------------------------------------------------------------------
+
+mod_ramp_kernel_t mod_kernels_get_ramp(const uint32_t nframes)
+{
+    switch (nframes)
+    {
+    case 16:   return ramp<16>;
+    case 32:   return ramp<32>;
+    case 64:   return ramp<64>;
+    case 128:  return ramp<128>;
+    case 256:  return ramp<256>;
+    case 512:  return ramp<512>;
+    case 1024: return ramp<1024>;
+    default:   return ramp_generic;
+    }
+}
+
+mod_median_kernel_t mod_kernels_get_median(const uint32_t nframes)
+{
+    switch (nframes)
+    {
+    case 16:   return median<16>;
+    case 32:   return median<32>;
+    case 64:   return median<64>;
+    case 128:  return median<128>;
+    case 256:  return median<256>;
+    case 512:  return median<512>;
+    case 1024: return median<1024>;
+    default:   return median_generic;
+    }
+}
+
+mod_reduce_kernel_t mod_kernels_get_reduce(const mod_reduce_mode_t mode)
+{
+    switch (mode)
+    {
+    case mod_reduce_last: return reduce_last;
+    case mod_reduce_mean: return reduce<ReduceMean>;
+    case mod_reduce_min:  return reduce<ReduceMin>;
+    case mod_reduce_max:  return reduce<ReduceMax>;
+    case mod_reduce_peak: return reduce<ReducePeak>;
+    case mod_reduce_rms:  return reduce<ReduceRms>;
+    default:              return nullptr;
+    }
+}
+
+mod_reduce_kernel_t mod_kernels_get_reduce_reference(const mod_reduce_mode_t mode)
+{
+    switch (mode)
+    {
+    case mod_reduce_last: return reduce_last;
+    case mod_reduce_mean: return reduce_reference<ReduceMean>;
+    case mod_reduce_min:  return reduce_reference<ReduceMin>;
+    case mod_reduce_max:  return reduce_reference<ReduceMax>;
+    case mod_reduce_peak: return reduce_reference<ReducePeak>;
+    case mod_reduce_rms:  return reduce_reference<ReduceRms>;
+    default:              return nullptr;
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_KERNELS_H_INCLUDED
+#define MOD_KERNELS_H_INCLUDED
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Process kernels, specialized at compile time for power of 2 buffer sizes from 16 to 1024.
+ * Every kernel accepts any nframes, falling back to the generic version if it does not match its size.
+ * Port buffers are assumed to be 16-byte aligned, as given by JACK.
+ */
+
+// log crossfade from prevvalue at the first frame to value at the last, scaled by mult
+typedef void (*mod_ramp_kernel_t)(float* out, uint32_t nframes, float value, float prevvalue, float mult);
+
+// average of the maximum and median values, tmp must hold nframes
+typedef float (*mod_median_kernel_t)(float* tmp, const float* in, uint32_t nframes);
+
+// ways of reducing a block to a single value
+typedef enum {
+    mod_reduce_median, // average of the maximum and median values, see mod_median_kernel_t
+    mod_reduce_last,   // last frame
+    mod_reduce_mean,
+    mod_reduce_min,
+    mod_reduce_max,
+    mod_reduce_peak,   // maximum absolute value
+    mod_reduce_rms,
+    mod_reduce_count
+} mod_reduce_mode_t;
+
+// single pass reduction without temporary storage, returns 0 for empty blocks
+typedef float (*mod_reduce_kernel_t)(const float* in, uint32_t nframes);
+
+mod_ramp_kernel_t mod_kernels_get_ramp(uint32_t nframes);
+mod_median_kernel_t mod_kernels_get_median(uint32_t nframes);
+
+// NEON or SSE kernel if available, NULL for the median. the reference version is plain scalar code
+mod_reduce_kernel_t mod_kernels_get_reduce(mod_reduce_mode_t mode);
+mod_reduce_kernel_t mod_kernels_get_reduce_reference(mod_reduce_mode_t mode);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MOD_KERNELS_H_INCLUDED
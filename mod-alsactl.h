@@ -0,0 +1,198 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_ALSACTL_H_INCLUDED
+#define MOD_ALSACTL_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <poll.h>
+
+#include <alsa/asoundlib.h>
+
+/*
+ * Watching a few boolean switches of a soundcard, without the alsa simple mixer.
+ *
+ * The simple mixer loads every element of the card on attach and parses every control event,
+ * related or not, for keeping its own copy up to date.
+ * Here only the named elements are looked up (once, resolving their numid), the ctl is subscribed to events
+ * and opened non-blocking, so checking for changes is a single read that fails with EAGAIN when idle.
+ * Values are only read from the card when an event for a watched numid arrives.
+ */
+
+#define MOD_ALSACTL_MAX_SWITCHES 4
+
+typedef struct {
+    snd_ctl_t* ctl;
+    unsigned count;
+    unsigned numids[MOD_ALSACTL_MAX_SWITCHES];
+    bool values[MOD_ALSACTL_MAX_SWITCHES];
+} mod_alsactl_t;
+
+// returns false if the card cannot be opened or subscribed to
+static inline
+bool mod_alsactl_open(mod_alsactl_t* const alsactl, const char* const cardid)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "hw:%s", cardid);
+
+    alsactl->ctl = NULL;
+    alsactl->count = 0;
+
+    if (snd_ctl_open(&alsactl->ctl, name, SND_CTL_NONBLOCK) != 0)
+    {
+        alsactl->ctl = NULL;
+        return false;
+    }
+
+    if (snd_ctl_subscribe_events(alsactl->ctl, 1) != 0)
+    {
+        snd_ctl_close(alsactl->ctl);
+        alsactl->ctl = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+static inline
+void mod_alsactl_close(mod_alsactl_t* const alsactl)
+{
+    if (alsactl->ctl == NULL)
+        return;
+
+    snd_ctl_close(alsactl->ctl);
+    alsactl->ctl = NULL;
+    alsactl->count = 0;
+}
+
+static inline
+bool mod_alsactl_read_numid(snd_ctl_t* const ctl, const unsigned numid)
+{
+    snd_ctl_elem_value_t* value;
+    snd_ctl_elem_value_alloca(&value);
+    snd_ctl_elem_value_set_numid(value, numid);
+
+    if (snd_ctl_elem_read(ctl, value) != 0)
+        return false;
+
+    return snd_ctl_elem_value_get_boolean(value, 0) != 0;
+}
+
+// looks up a switch by its simple mixer name, returns its index or -1 if not found
+static inline
+int mod_alsactl_add_switch(mod_alsactl_t* const alsactl, const char* const name)
+{
+    // simple mixer names drop these suffixes from the ctl element names
+    static const char* const suffixes[] = { " Playback Switch", " Switch", "" };
+
+    if (alsactl->ctl == NULL || alsactl->count == MOD_ALSACTL_MAX_SWITCHES)
+        return -1;
+
+    snd_ctl_elem_id_t* id;
+    snd_ctl_elem_info_t* info;
+    snd_ctl_elem_id_alloca(&id);
+    snd_ctl_elem_info_alloca(&info);
+
+    char elemname[64];
+
+    for (size_t i = 0; i < sizeof(suffixes)/sizeof(suffixes[0]); ++i)
+    {
+        snprintf(elemname, sizeof(elemname), "%s%s", name, suffixes[i]);
+
+        snd_ctl_elem_id_set_interface(id, SND_CTL_ELEM_IFACE_MIXER);
+        snd_ctl_elem_id_set_name(id, elemname);
+        snd_ctl_elem_id_set_index(id, 0);
+        snd_ctl_elem_info_set_id(info, id);
+
+        if (snd_ctl_elem_info(alsactl->ctl, info) != 0)
+            continue;
+        if (snd_ctl_elem_info_get_type(info) != SND_CTL_ELEM_TYPE_BOOLEAN)
+            continue;
+
+        const unsigned index = alsactl->count++;
+        alsactl->numids[index] = snd_ctl_elem_info_get_numid(info);
+        alsactl->values[index] = mod_alsactl_read_numid(alsactl->ctl, alsactl->numids[index]);
+        return (int)index;
+    }
+
+    return -1;
+}
+
+// for waiting on changes together with other fds, -1 if not available
+static inline
+int mod_alsactl_poll_fd(const mod_alsactl_t* const alsactl)
+{
+    struct pollfd pfd;
+
+    if (alsactl->ctl == NULL || snd_ctl_poll_descriptors(alsactl->ctl, &pfd, 1) != 1)
+        return -1;
+
+    return pfd.fd;
+}
+
+static inline
+bool mod_alsactl_get_switch(const mod_alsactl_t* const alsactl, const int index)
+{
+    return alsactl->values[index];
+}
+
+// drains pending events without blocking, returns true if any watched switch changed value
+static inline
+bool mod_alsactl_handle_events(mod_alsactl_t* const alsactl)
+{
+    if (alsactl->ctl == NULL)
+        return false;
+
+    snd_ctl_event_t* event;
+    snd_ctl_event_alloca(&event);
+
+    bool changed = false;
+
+    while (snd_ctl_read(alsactl->ctl, event) > 0)
+    {
+        if (snd_ctl_event_get_type(event) != SND_CTL_EVENT_ELEM)
+            continue;
+
+        const unsigned mask = snd_ctl_event_elem_get_mask(event);
+
+        if (mask == SND_CTL_EVENT_MASK_REMOVE || (mask & SND_CTL_EVENT_MASK_VALUE) == 0)
+            continue;
+
+        const unsigned numid = snd_ctl_event_elem_get_numid(event);
+
+        for (unsigned i = 0; i < alsactl->count; ++i)
+        {
+            if (alsactl->numids[i] != numid)
+                continue;
+
+            const bool value = mod_alsactl_read_numid(alsactl->ctl, numid);
+
+            if (alsactl->values[i] != value)
+            {
+                alsactl->values[i] = value;
+                changed = true;
+            }
+            break;
+        }
+    }
+
+    return changed;
+}
+
+#endif // MOD_ALSACTL_H_INCLUDED
@@ -0,0 +1,236 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_CALIBRATION_H_INCLUDED
+#define MOD_CALIBRATION_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Calibration file format, one reference point per line:
+ *
+ *   # comment
+ *   <channel> <raw code> <volts>
+ *
+ * Where channel is one of in1, in2 (ADC) or out1, out2 (DAC).
+ * Points are interpolated linearly, and extrapolated from the outer points.
+ * A channel with less than 2 points uses the ideal 0-10V linear scaling.
+ */
+
+#define MOD_CALIBRATION_CHANNELS   2
+#define MOD_CALIBRATION_MAX_POINTS 64
+#define MOD_CALIBRATION_TABLE_SIZE 4096
+#define MOD_CALIBRATION_MAX_RAW_f  4095.0f
+#define MOD_CALIBRATION_MAX_VOLTS  10.0f
+
+typedef struct {
+    int count;
+    float raw[MOD_CALIBRATION_MAX_POINTS];
+    float volts[MOD_CALIBRATION_MAX_POINTS];
+} mod_calibration_points_t;
+
+static inline
+void mod_calibration_add_point(mod_calibration_points_t* const points, const float raw, const float volts)
+{
+    if (points->count == MOD_CALIBRATION_MAX_POINTS)
+        return;
+
+    // keep points sorted by raw code
+    int i = points->count++;
+    for (; i > 0 && points->raw[i-1] > raw; --i)
+    {
+        points->raw[i]   = points->raw[i-1];
+        points->volts[i] = points->volts[i-1];
+    }
+
+    points->raw[i]   = raw;
+    points->volts[i] = volts;
+}
+
+// returns false if the file cannot be opened, channels without points in the file are left untouched
+static inline
+bool mod_calibration_load(const char* const filename, const char* const prefix,
+                          mod_calibration_points_t points[MOD_CALIBRATION_CHANNELS])
+{
+    FILE* const f = fopen(filename, "r");
+    if (f == NULL)
+        return false;
+
+    const size_t prefixlen = strlen(prefix);
+    char line[256];
+    char channel[16];
+    float raw, volts;
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (line[0] == '#' || strncmp(line, prefix, prefixlen) != 0)
+            continue;
+        if (sscanf(line, "%15s %f %f", channel, &raw, &volts) != 3)
+            continue;
+
+        const int index = atoi(channel + prefixlen) - 1;
+
+        if (index < 0 || index >= MOD_CALIBRATION_CHANNELS)
+            continue;
+
+        mod_calibration_add_point(&points[index], raw, volts);
+    }
+
+    fclose(f);
+    return true;
+}
+
+// replaces all points of the given prefix in the file, keeping everything else
+static inline
+bool mod_calibration_save(const char* const filename, const char* const prefix,
+                          const mod_calibration_points_t points[MOD_CALIBRATION_CHANNELS])
+{
+    const size_t prefixlen = strlen(prefix);
+    char* kept = NULL;
+    size_t keptlen = 0;
+    char line[256];
+
+    FILE* const old = fopen(filename, "r");
+
+    if (old != NULL)
+    {
+        while (fgets(line, sizeof(line), old) != NULL)
+        {
+            if (strncmp(line, prefix, prefixlen) == 0)
+                continue;
+
+            const size_t linelen = strlen(line);
+            char* const nkept = realloc(kept, keptlen + linelen + 1);
+            if (nkept == NULL)
+            {
+                // saving now would drop the points of the other prefix
+                fclose(old);
+                free(kept);
+                return false;
+            }
+
+            kept = nkept;
+            memcpy(kept + keptlen, line, linelen + 1);
+            keptlen += linelen;
+        }
+
+        fclose(old);
+    }
+
+    // written next to the file and renamed over it, so a crash or full disk never leaves it truncated
+    char tmpname[512];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+    FILE* const f = fopen(tmpname, "w");
+    if (f == NULL)
+    {
+        free(kept);
+        return false;
+    }
+
+    if (kept != NULL)
+        fputs(kept, f);
+    else
+        fputs("# <channel> <raw code> <volts>\n", f);
+
+    for (int c = 0; c < MOD_CALIBRATION_CHANNELS; ++c)
+        for (int i = 0; i < points[c].count; ++i)
+            fprintf(f, "%s%d %.2f %.4f\n", prefix, c + 1, points[c].raw[i], points[c].volts[i]);
+
+    free(kept);
+
+    const bool failed = ferror(f) != 0;
+
+    if (fclose(f) != 0 || failed)
+    {
+        remove(tmpname);
+        return false;
+    }
+
+    return rename(tmpname, filename) == 0;
+}
+
+// piecewise linear interpolation of y over sorted x
+static inline
+float mod_calibration_interpolate(const float* const xs, const float* const ys, const int count, const float x)
+{
+    int i = 1;
+    while (i < count - 1 && x > xs[i])
+        ++i;
+
+    const float dx = xs[i] - xs[i-1];
+    if (dx == 0.0f)
+        return ys[i];
+
+    return ys[i-1] + (x - xs[i-1]) * (ys[i] - ys[i-1]) / dx;
+}
+
+// raw code -> volts, indexed by raw code
+static inline
+void mod_calibration_build_adc_table(const mod_calibration_points_t* const points,
+                                     float table[MOD_CALIBRATION_TABLE_SIZE])
+{
+    for (int r = 0; r < MOD_CALIBRATION_TABLE_SIZE; ++r)
+    {
+        if (points->count < 2)
+            table[r] = (float)r / MOD_CALIBRATION_MAX_RAW_f * MOD_CALIBRATION_MAX_VOLTS;
+        else
+            table[r] = mod_calibration_interpolate(points->raw, points->volts, points->count, (float)r);
+
+        if (table[r] < 0.0f)
+            table[r] = 0.0f;
+        else if (table[r] > MOD_CALIBRATION_MAX_VOLTS)
+            table[r] = MOD_CALIBRATION_MAX_VOLTS;
+    }
+}
+
+// volts -> raw code, indexed by volts quantized to the same 12-bit resolution
+static inline
+void mod_calibration_build_dac_table(const mod_calibration_points_t* const points,
+                                     uint16_t table[MOD_CALIBRATION_TABLE_SIZE])
+{
+    // inverse mapping needs points sorted by volts, so swap raw and volts around
+    mod_calibration_points_t inverse;
+    memset(&inverse, 0, sizeof(inverse));
+
+    for (int i = 0; i < points->count; ++i)
+        mod_calibration_add_point(&inverse, points->volts[i], points->raw[i]);
+
+    for (int v = 0; v < MOD_CALIBRATION_TABLE_SIZE; ++v)
+    {
+        float raw;
+
+        if (inverse.count < 2)
+            raw = (float)v;
+        else
+            raw = mod_calibration_interpolate(inverse.raw, inverse.volts, inverse.count,
+                                              (float)v / MOD_CALIBRATION_MAX_RAW_f * MOD_CALIBRATION_MAX_VOLTS);
+
+        if (raw <= 0.0f)
+            table[v] = 0;
+        else if (raw >= MOD_CALIBRATION_MAX_RAW_f)
+            table[v] = (uint16_t)MOD_CALIBRATION_MAX_RAW_f;
+        else
+            table[v] = (uint16_t)(raw + 0.5f);
+    }
+}
+
+#endif // MOD_CALIBRATION_H_INCLUDED
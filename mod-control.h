@@ -0,0 +1,497 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_CONTROL_H_INCLUDED
+#define MOD_CONTROL_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ * Live tuning of a running client through a local control socket.
+ *
+ * Tunables are plain ints in a client defined struct, described by a table of names and limits.
+ * The control thread is the only writer, each change is published under a seqlock.
+ * Readers (process, reading/writing threads) keep their own copy and refresh it with mod_control_load,
+ * which is a single atomic load while nothing changed.
+ *
+ * The socket is a unix stream socket at a filesystem path, only accessible by the owner.
+ * Requests and replies are single text lines:
+ *
+ *   list                -> ok <name>=<value> ...
+ *   get <name>          -> ok <value>
+ *   set <name> <value>  -> ok <value>, as applied after clamping
+ *   anything else goes to the client handler, or gets "error unknown command"
+ */
+
+#define MOD_CONTROL_MAX_CLIENTS  4
+#define MOD_CONTROL_LINE_SIZE    256
+#define MOD_CONTROL_MAX_ARGS     8
+#define MOD_CONTROL_POLL_MS      250 // how often the control thread checks for stopping
+
+// never a stable sequence number, for readers that have not loaded anything yet
+#define MOD_CONTROL_SEQ_NONE ((uint32_t)-1)
+
+typedef struct {
+    const char* name;
+    size_t offset; // of the int in the parameters struct
+    int min, max;
+    const char* const* choices; // symbolic names for values min to max, or NULL
+} mod_control_param_t;
+
+// handles commands other than list, get and set, the reply is a single line without newline
+typedef void (*mod_control_handler_t)(void* arg, int argc, char* argv[], char* reply, size_t size);
+
+typedef struct {
+    // parameters, written by the control thread only
+    const mod_control_param_t* table;
+    unsigned count;
+    void* params;
+    size_t size;
+    volatile uint32_t seq;
+    // socket, -1 if not listening
+    int listenfd;
+    char path[108];
+    int clients[MOD_CONTROL_MAX_CLIENTS];
+    char lines[MOD_CONTROL_MAX_CLIENTS][MOD_CONTROL_LINE_SIZE];
+    size_t lengths[MOD_CONTROL_MAX_CLIENTS];
+    mod_control_handler_t handler;
+    void* arg;
+    pthread_t thread;
+    volatile bool run;
+} mod_control_t;
+
+// --------------------------------------------------------------------------------------------------------------------
+// parameters
+
+static inline
+void mod_control_init(mod_control_t* const control, const mod_control_param_t* const table, const unsigned count,
+                      void* const params, const size_t size)
+{
+    memset(control, 0, sizeof(*control));
+    control->table    = table;
+    control->count    = count;
+    control->params   = params;
+    control->size     = size;
+    control->listenfd = -1;
+
+    for (int i = 0; i < MOD_CONTROL_MAX_CLIENTS; ++i)
+        control->clients[i] = -1;
+}
+
+static inline
+int* mod_control_param_ptr(const mod_control_t* const control, const mod_control_param_t* const param)
+{
+    return (int*)((char*)control->params + param->offset);
+}
+
+// control thread side, changing a single value
+static inline
+void mod_control_publish(mod_control_t* const control, int* const ptr, const int value)
+{
+    __atomic_store_n(&control->seq, control->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    *ptr = value;
+
+    __atomic_store_n(&control->seq, control->seq + 1, __ATOMIC_RELEASE);
+}
+
+// copies the parameters into dst if they changed since seen, returns false if nothing was copied.
+// a copy that keeps racing with the writer is given up, the caller keeps its previous values then.
+static inline
+bool mod_control_load(mod_control_t* const control, uint32_t* const seen, void* const dst)
+{
+    for (int tries = 0; tries < 4; ++tries)
+    {
+        const uint32_t seq = __atomic_load_n(&control->seq, __ATOMIC_ACQUIRE);
+
+        if (seq == *seen)
+            return false;
+        if (seq & 1)
+            continue;
+
+        memcpy(dst, control->params, control->size);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&control->seq, __ATOMIC_RELAXED) == seq)
+        {
+            *seen = seq;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static inline
+const mod_control_param_t* mod_control_find(const mod_control_t* const control, const char* const name)
+{
+    for (unsigned i = 0; i < control->count; ++i)
+        if (strcmp(control->table[i].name, name) == 0)
+            return &control->table[i];
+
+    return NULL;
+}
+
+static inline
+int mod_control_format_value(const mod_control_param_t* const param, const int value, char* const buf, const size_t size)
+{
+    if (param->choices != NULL)
+        return snprintf(buf, size, "%s", param->choices[value - param->min]);
+
+    return snprintf(buf, size, "%d", value);
+}
+
+// returns false if the value is not a number nor one of the choices
+static inline
+bool mod_control_parse_value(const mod_control_param_t* const param, const char* const str, int* const value)
+{
+    if (param->choices != NULL)
+    {
+        for (int i = 0; i <= param->max - param->min; ++i)
+        {
+            if (strcmp(param->choices[i], str) == 0)
+            {
+                *value = param->min + i;
+                return true;
+            }
+        }
+    }
+
+    char* end;
+    const long lvalue = strtol(str, &end, 10);
+
+    if (end == str || *end != '\0')
+        return false;
+
+    *value = lvalue < param->min ? param->min : lvalue > param->max ? param->max : (int)lvalue;
+    return true;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+// socket
+
+static inline
+void mod_control_handle_line(mod_control_t* const control, char* const line, char* const reply, const size_t size)
+{
+    char* argv[MOD_CONTROL_MAX_ARGS];
+    int argc = 0;
+
+    for (char *saveptr, *token = strtok_r(line, " \t\r", &saveptr);
+         token != NULL && argc < MOD_CONTROL_MAX_ARGS; token = strtok_r(NULL, " \t\r", &saveptr))
+        argv[argc++] = token;
+
+    if (argc == 0)
+    {
+        snprintf(reply, size, "error empty command");
+        return;
+    }
+
+    if (strcmp(argv[0], "list") == 0)
+    {
+        size_t len = (size_t)snprintf(reply, size, "ok");
+
+        for (unsigned i = 0; i < control->count && len < size; ++i)
+        {
+            const mod_control_param_t* const param = &control->table[i];
+
+            len += (size_t)snprintf(reply + len, size - len, " %s=", param->name);
+
+            if (len < size)
+                len += (size_t)mod_control_format_value(param, *mod_control_param_ptr(control, param),
+                                                        reply + len, size - len);
+        }
+        return;
+    }
+
+    if (strcmp(argv[0], "get") == 0 || strcmp(argv[0], "set") == 0)
+    {
+        const bool set = argv[0][0] == 's';
+
+        if (argc != (set ? 3 : 2))
+        {
+            snprintf(reply, size, "error usage: %s", set ? "set <name> <value>" : "get <name>");
+            return;
+        }
+
+        const mod_control_param_t* const param = mod_control_find(control, argv[1]);
+
+        if (param == NULL)
+        {
+            snprintf(reply, size, "error unknown parameter '%s'", argv[1]);
+            return;
+        }
+
+        int* const ptr = mod_control_param_ptr(control, param);
+
+        if (set)
+        {
+            int value;
+
+            if (! mod_control_parse_value(param, argv[2], &value))
+            {
+                snprintf(reply, size, "error invalid value '%s'", argv[2]);
+                return;
+            }
+
+            mod_control_publish(control, ptr, value);
+        }
+
+        const size_t len = (size_t)snprintf(reply, size, "ok ");
+        mod_control_format_value(param, *ptr, reply + len, size - len);
+        return;
+    }
+
+    if (control->handler != NULL)
+        control->handler(control->arg, argc, argv, reply, size);
+    else
+        snprintf(reply, size, "error unknown command");
+}
+
+static inline
+void mod_control_close_client(mod_control_t* const control, const int index)
+{
+    close(control->clients[index]);
+    control->clients[index] = -1;
+    control->lengths[index] = 0;
+}
+
+// reads whatever is available from a client, replying to every complete line
+static inline
+void mod_control_read_client(mod_control_t* const control, const int index)
+{
+    char* const line = control->lines[index];
+    size_t* const length = &control->lengths[index];
+
+    const ssize_t r = recv(control->clients[index], line + *length, MOD_CONTROL_LINE_SIZE - 1 - *length, 0);
+
+    if (r <= 0)
+    {
+        mod_control_close_client(control, index);
+        return;
+    }
+
+    *length += (size_t)r;
+
+    char reply[MOD_CONTROL_LINE_SIZE * 2];
+    char* newline;
+
+    while ((newline = memchr(line, '\n', *length)) != NULL)
+    {
+        *newline = '\0';
+        mod_control_handle_line(control, line, reply, sizeof(reply) - 1);
+        strcat(reply, "\n");
+
+        if (send(control->clients[index], reply, strlen(reply), MSG_NOSIGNAL) < 0)
+        {
+            mod_control_close_client(control, index);
+            return;
+        }
+
+        const size_t consumed = (size_t)(newline - line) + 1;
+        memmove(line, newline + 1, *length - consumed);
+        *length -= consumed;
+    }
+
+    // a line that does not fit is not going to make sense
+    if (*length == MOD_CONTROL_LINE_SIZE - 1)
+        mod_control_close_client(control, index);
+}
+
+static inline
+void* mod_control_thread(void* const arg)
+{
+    mod_control_t* const control = (mod_control_t*)arg;
+    struct pollfd pfds[MOD_CONTROL_MAX_CLIENTS + 1];
+
+    while (control->run)
+    {
+        pfds[0].fd = control->listenfd;
+        pfds[0].events = POLLIN;
+
+        for (int i = 0; i < MOD_CONTROL_MAX_CLIENTS; ++i)
+        {
+            pfds[i + 1].fd = control->clients[i];
+            pfds[i + 1].events = POLLIN;
+        }
+
+        if (poll(pfds, MOD_CONTROL_MAX_CLIENTS + 1, MOD_CONTROL_POLL_MS) <= 0)
+            continue;
+
+        for (int i = 0; i < MOD_CONTROL_MAX_CLIENTS; ++i)
+            if (control->clients[i] >= 0 && pfds[i + 1].revents != 0)
+                mod_control_read_client(control, i);
+
+        if (pfds[0].revents & POLLIN)
+        {
+            const int fd = accept(control->listenfd, NULL, NULL);
+
+            if (fd < 0)
+                continue;
+
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+            int i = 0;
+            for (; i < MOD_CONTROL_MAX_CLIENTS && control->clients[i] >= 0; ++i) {}
+
+            if (i == MOD_CONTROL_MAX_CLIENTS)
+            {
+                const char busy[] = "error too many clients\n";
+                send(fd, busy, sizeof(busy) - 1, MSG_NOSIGNAL);
+                close(fd);
+                continue;
+            }
+
+            control->clients[i] = fd;
+        }
+    }
+
+    return NULL;
+}
+
+// starts serving the socket on a new thread, replacing a stale socket file at the same path
+static inline
+bool mod_control_listen(mod_control_t* const control, const char* const path,
+                        const mod_control_handler_t handler, void* const arg)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return false;
+
+    strcpy(addr.sun_path, path);
+
+    control->listenfd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (control->listenfd < 0)
+        return false;
+
+    unlink(path);
+
+    // no other users, the socket changes how the client behaves.
+    // linux creates the socket file with the mode of the socket inode, so the process umask is left alone
+    // (it is shared with every other thread when running inside jackd)
+    if (fchmod(control->listenfd, S_IRUSR|S_IWUSR) != 0 ||
+        bind(control->listenfd, (const struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(control->listenfd, MOD_CONTROL_MAX_CLIENTS) != 0)
+    {
+        close(control->listenfd);
+        control->listenfd = -1;
+        return false;
+    }
+
+    strcpy(control->path, path);
+    control->handler = handler;
+    control->arg = arg;
+    control->run = true;
+
+    if (pthread_create(&control->thread, NULL, mod_control_thread, control) != 0)
+    {
+        close(control->listenfd);
+        control->listenfd = -1;
+        unlink(path);
+        return false;
+    }
+
+    return true;
+}
+
+static inline
+void mod_control_close(mod_control_t* const control)
+{
+    if (control->listenfd < 0)
+        return;
+
+    control->run = false;
+    pthread_join(control->thread, NULL);
+
+    for (int i = 0; i < MOD_CONTROL_MAX_CLIENTS; ++i)
+        if (control->clients[i] >= 0)
+            mod_control_close_client(control, i);
+
+    close(control->listenfd);
+    control->listenfd = -1;
+    unlink(control->path);
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+// client side
+
+// sends a single request line and waits for the reply, returns false on connection errors
+static inline
+bool mod_control_request(const char* const path, const char* const request, char* const reply, const size_t size)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr.sun_path) || size == 0)
+        return false;
+
+    strcpy(addr.sun_path, path);
+
+    const int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return false;
+
+    if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        send(sock, request, strlen(request), MSG_NOSIGNAL) < 0 ||
+        send(sock, "\n", 1, MSG_NOSIGNAL) < 0)
+    {
+        close(sock);
+        return false;
+    }
+
+    size_t len = 0;
+    ssize_t r;
+
+    while (len < size - 1 && (r = recv(sock, reply + len, size - 1 - len, 0)) > 0)
+    {
+        len += (size_t)r;
+
+        if (reply[len - 1] == '\n')
+            break;
+    }
+
+    close(sock);
+    reply[len] = '\0';
+
+    if (len == 0)
+        return false;
+
+    if (reply[len - 1] == '\n')
+        reply[len - 1] = '\0';
+
+    return true;
+}
+
+#endif // MOD_CONTROL_H_INCLUDED
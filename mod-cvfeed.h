@@ -0,0 +1,414 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_CVFEED_H_INCLUDED
+#define MOD_CVFEED_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/*
+ * Shared-memory value feed, for control-rate consumers that do not need to be part of the JACK graph.
+ *
+ * The writer appends an entry to a ring every time the input values or the exp.pedal mode change.
+ * Every slot is a seqlock, readers skip entries that were being written or got overwritten while reading.
+ * Same as telemetry, the layout is versioned and readers must check magic, version and size first.
+ *
+ * Change notifications are sent through eventfds, one per subscriber.
+ * Connecting to the feed socket (abstract namespace) gets a new eventfd as SCM_RIGHTS ancillary data.
+ * The connection must stay open while subscribed, the writer drops the eventfd once it is closed.
+ */
+
+#define MOD_CV_FEED_MAGIC           0x4656434d // "MCVF"
+#define MOD_CV_FEED_VERSION         1
+#define MOD_CV_FEED_SIZE            64 // entries, must be power of 2
+#define MOD_CV_FEED_MAX_SUBSCRIBERS 8
+
+#define MOD_CV_FEED_SPI2JACK        "/mod-spi2jack-feed"
+#define MOD_CV_FEED_SPI2JACK_SOCKET "mod-spi2jack-feed"
+
+typedef struct {
+    uint64_t seq;  // entry number starting at 1, 0 while being written
+    uint64_t time; // jack_get_time() of the reading, in usecs
+    float value[2]; // calibrated, in volts
+    uint16_t raw[2];
+    uint32_t mode; // exp.pedal mode, same as telemetry
+    uint32_t reserved;
+} mod_cv_feed_entry_t;
+
+typedef struct {
+    // header
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t pid;
+    // number of the latest complete entry, 0 if none yet
+    uint64_t head;
+    mod_cv_feed_entry_t entries[MOD_CV_FEED_SIZE];
+} mod_cv_feed_t;
+
+// writer side of the change notifications, subscribers are accepted and reaped by mod_cv_feed_notifier_service
+typedef struct {
+    int listenfd;
+    unsigned count;
+    int sockets[MOD_CV_FEED_MAX_SUBSCRIBERS];
+    int eventfds[MOD_CV_FEED_MAX_SUBSCRIBERS];
+} mod_cv_feed_notifier_t;
+
+// --------------------------------------------------------------------------------------------------------------------
+// writer
+
+static inline
+void mod_cv_feed_publish(mod_cv_feed_t* const feed, const mod_cv_feed_entry_t* const entry)
+{
+    const uint64_t seq = feed->head + 1;
+    mod_cv_feed_entry_t* const slot = &feed->entries[seq & (MOD_CV_FEED_SIZE - 1)];
+
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    slot->time     = entry->time;
+    slot->value[0] = entry->value[0];
+    slot->value[1] = entry->value[1];
+    slot->raw[0]   = entry->raw[0];
+    slot->raw[1]   = entry->raw[1];
+    slot->mode     = entry->mode;
+
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+    __atomic_store_n(&feed->head, seq, __ATOMIC_RELEASE);
+}
+
+// creates and maps the shared segment, returns NULL on failure
+static inline
+mod_cv_feed_t* mod_cv_feed_create(const char* const name)
+{
+    const int fd = shm_open(name, O_CREAT|O_RDWR, 0644);
+    if (fd < 0)
+        return NULL;
+
+    if (ftruncate(fd, sizeof(mod_cv_feed_t)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void* const ptr = mmap(NULL, sizeof(mod_cv_feed_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+    mod_cv_feed_t* const feed = (mod_cv_feed_t*)ptr;
+    memset(feed, 0, sizeof(*feed));
+    feed->version = MOD_CV_FEED_VERSION;
+    feed->size    = sizeof(mod_cv_feed_t);
+    feed->pid     = (uint32_t)getpid();
+    __atomic_store_n(&feed->magic, MOD_CV_FEED_MAGIC, __ATOMIC_RELEASE);
+    return feed;
+}
+
+static inline
+void mod_cv_feed_destroy(mod_cv_feed_t* const feed, const char* const name)
+{
+    munmap(feed, sizeof(mod_cv_feed_t));
+    shm_unlink(name);
+}
+
+static inline
+socklen_t mod_cv_feed_socket_address(struct sockaddr_un* const addr, const char* const socketname)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strncpy(addr->sun_path + 1, socketname, sizeof(addr->sun_path) - 2);
+
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + strlen(addr->sun_path + 1));
+}
+
+// starts listening for subscribers, returns false on failure
+static inline
+bool mod_cv_feed_notifier_init(mod_cv_feed_notifier_t* const notifier, const char* const socketname)
+{
+    memset(notifier, 0, sizeof(*notifier));
+
+    notifier->listenfd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (notifier->listenfd < 0)
+        return false;
+
+    struct sockaddr_un addr;
+    const socklen_t addrlen = mod_cv_feed_socket_address(&addr, socketname);
+
+    if (bind(notifier->listenfd, (const struct sockaddr*)&addr, addrlen) != 0 ||
+        listen(notifier->listenfd, MOD_CV_FEED_MAX_SUBSCRIBERS) != 0)
+    {
+        close(notifier->listenfd);
+        notifier->listenfd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+// accepts new subscribers and drops the ones that went away, non-blocking
+static inline
+void mod_cv_feed_notifier_service(mod_cv_feed_notifier_t* const notifier)
+{
+    if (notifier->listenfd < 0)
+        return;
+
+    // a closed connection reads as end of file
+    for (unsigned i = 0; i < notifier->count;)
+    {
+        char c;
+
+        if (recv(notifier->sockets[i], &c, 1, MSG_DONTWAIT|MSG_PEEK) == 0)
+        {
+            close(notifier->sockets[i]);
+            close(notifier->eventfds[i]);
+
+            --notifier->count;
+            notifier->sockets[i]  = notifier->sockets[notifier->count];
+            notifier->eventfds[i] = notifier->eventfds[notifier->count];
+            continue;
+        }
+
+        ++i;
+    }
+
+    for (int sock; (sock = accept(notifier->listenfd, NULL, NULL)) >= 0;)
+    {
+        const int efd = notifier->count < MOD_CV_FEED_MAX_SUBSCRIBERS ? eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC) : -1;
+
+        if (efd < 0)
+        {
+            close(sock);
+            continue;
+        }
+
+        char data = 'F';
+        struct iovec iov = { &data, 1 };
+
+        union {
+            char buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        memset(&control, 0, sizeof(control));
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        struct cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &efd, sizeof(int));
+
+        if (sendmsg(sock, &msg, MSG_DONTWAIT|MSG_NOSIGNAL) != 1)
+        {
+            close(efd);
+            close(sock);
+            continue;
+        }
+
+        notifier->sockets[notifier->count]  = sock;
+        notifier->eventfds[notifier->count] = efd;
+        ++notifier->count;
+    }
+}
+
+static inline
+void mod_cv_feed_notify(const mod_cv_feed_notifier_t* const notifier)
+{
+    const uint64_t one = 1;
+
+    for (unsigned i = 0; i < notifier->count; ++i)
+    {
+        // full counters mean the subscriber is not reading, nothing to do then
+        if (write(notifier->eventfds[i], &one, sizeof(one)) != sizeof(one))
+            continue;
+    }
+}
+
+static inline
+void mod_cv_feed_notifier_close(mod_cv_feed_notifier_t* const notifier)
+{
+    for (unsigned i = 0; i < notifier->count; ++i)
+    {
+        close(notifier->sockets[i]);
+        close(notifier->eventfds[i]);
+    }
+
+    if (notifier->listenfd >= 0)
+        close(notifier->listenfd);
+
+    notifier->count = 0;
+    notifier->listenfd = -1;
+}
+
+// --------------------------------------------------------------------------------------------------------------------
+// readers
+
+// maps an existing segment read-only, returns NULL if missing or incompatible
+static inline
+const mod_cv_feed_t* mod_cv_feed_open(const char* const name)
+{
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(mod_cv_feed_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void* const ptr = mmap(NULL, sizeof(mod_cv_feed_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+    const mod_cv_feed_t* const feed = (const mod_cv_feed_t*)ptr;
+
+    if (__atomic_load_n(&feed->magic, __ATOMIC_ACQUIRE) != MOD_CV_FEED_MAGIC ||
+        feed->version < MOD_CV_FEED_VERSION || feed->size < sizeof(mod_cv_feed_t))
+    {
+        munmap(ptr, sizeof(mod_cv_feed_t));
+        return NULL;
+    }
+
+    return feed;
+}
+
+static inline
+void mod_cv_feed_close(const mod_cv_feed_t* const feed)
+{
+    // mapped read-only, munmap only needs the address
+    munmap((void*)(uintptr_t)feed, sizeof(mod_cv_feed_t));
+}
+
+static inline
+uint64_t mod_cv_feed_head(const mod_cv_feed_t* const feed)
+{
+    return __atomic_load_n(&feed->head, __ATOMIC_ACQUIRE);
+}
+
+// copies entry number seq, returns false if not written yet or overwritten, entries older than
+// head - MOD_CV_FEED_SIZE are gone
+static inline
+bool mod_cv_feed_read(const mod_cv_feed_t* const feed, const uint64_t seq, mod_cv_feed_entry_t* const entry)
+{
+    const mod_cv_feed_entry_t* const slot = &feed->entries[seq & (MOD_CV_FEED_SIZE - 1)];
+
+    if (seq == 0 || __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+        return false;
+
+    *entry = *slot;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+// copies the latest entry, returns false if there is none or the writer kept overtaking us
+static inline
+bool mod_cv_feed_read_latest(const mod_cv_feed_t* const feed, mod_cv_feed_entry_t* const entry)
+{
+    for (int tries = 0; tries < 4; ++tries)
+    {
+        const uint64_t head = mod_cv_feed_head(feed);
+
+        if (head == 0)
+            return false;
+        if (mod_cv_feed_read(feed, head, entry))
+            return true;
+    }
+
+    return false;
+}
+
+// connects to the feed socket, returns an eventfd signalled on every change or -1 on failure.
+// socketfd must stay open while the eventfd is in use, closing it unsubscribes.
+static inline
+int mod_cv_feed_subscribe(const char* const socketname, int* const socketfd)
+{
+    const int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    struct sockaddr_un addr;
+    const socklen_t addrlen = mod_cv_feed_socket_address(&addr, socketname);
+
+    if (connect(sock, (const struct sockaddr*)&addr, addrlen) != 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    char data;
+    struct iovec iov = { &data, 1 };
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    // the writer only accepts subscribers periodically, this blocks until then
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+    {
+        close(sock);
+        return -1;
+    }
+
+    const struct cmsghdr* const cmsg = CMSG_FIRSTHDR(&msg);
+
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        close(sock);
+        return -1;
+    }
+
+    int efd;
+    memcpy(&efd, CMSG_DATA(cmsg), sizeof(int));
+
+    *socketfd = sock;
+    return efd;
+}
+
+#endif // MOD_CVFEED_H_INCLUDED
@@ -0,0 +1,96 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_CVPORT_H_INCLUDED
+#define MOD_CVPORT_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <jack/jack.h>
+
+/*
+ * Control-rate CV ports, a custom JACK port type carrying one value per period instead of one per frame.
+ *
+ * Each port buffer is a single mod_cv_port_buffer_t, rewritten by the owner of the output port every cycle.
+ * value is the latest one, prevvalue the one of the previous period and offset the frame where the change
+ * from prevvalue to value completes (0 if unchanged). seq is bumped on every change, so consumers can skip
+ * work without comparing floats. seq is 0 until the first value is written.
+ *
+ * Custom port types are supported by JACK1, JACK2 refuses to register them.
+ * Both clients keep their audio-rate CV ports, these are only companions for consumers that know the type.
+ */
+
+#define MOD_CV_PORT_TYPE "32 bit float control rate CV"
+
+typedef struct {
+    float value;
+    float prevvalue;
+    uint32_t offset;
+    uint32_t seq;
+} mod_cv_port_buffer_t;
+
+// writer side, last value written and its sequence number
+typedef struct {
+    float value;
+    uint32_t seq;
+} mod_cv_port_writer_t;
+
+// returns NULL if the server does not support custom port types
+static inline
+jack_port_t* mod_cv_port_register(jack_client_t* const client, const char* const name, const unsigned long flags)
+{
+    return jack_port_register(client, name, MOD_CV_PORT_TYPE, flags, sizeof(mod_cv_port_buffer_t));
+}
+
+static inline
+void mod_cv_port_write(mod_cv_port_buffer_t* const buf, mod_cv_port_writer_t* const writer,
+                       const float value, const uint32_t offset)
+{
+    const bool first = writer->seq == 0;
+    const bool changed = first || value < writer->value || value > writer->value;
+
+    if (changed && ++writer->seq == 0)
+        writer->seq = 1;
+
+    buf->value = value;
+    buf->prevvalue = first ? value : writer->value;
+    buf->offset = changed && ! first ? offset : 0;
+    buf->seq = writer->seq;
+    writer->value = value;
+}
+
+// nothing valid to read, e.g. while the writer is not ready yet
+static inline
+void mod_cv_port_clear(mod_cv_port_buffer_t* const buf)
+{
+    memset(buf, 0, sizeof(*buf));
+}
+
+// returns false if nothing was written to the port yet
+static inline
+bool mod_cv_port_read(const mod_cv_port_buffer_t* const buf, float* const value)
+{
+    if (buf->seq == 0)
+        return false;
+
+    *value = buf->value;
+    return true;
+}
+
+#endif // MOD_CVPORT_H_INCLUDED
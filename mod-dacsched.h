@@ -0,0 +1,258 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_DACSCHED_H_INCLUDED
+#define MOD_DACSCHED_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Write scheduler for DAC channels sharing a bus.
+ *
+ * Every write spends a token from its channel bucket and from the overall one, buckets refill at the configured
+ * rates (writes per second, 0 for unlimited). Channels that cannot write keep their update pending,
+ * newer values replace it (coalescing) so that only the latest target is ever written.
+ * When the overall budget is short, channels furthest from their target go first.
+ *
+ * With a slew rate set, each write moves the output at most that far from the previous one,
+ * so rate capped channels still follow the target as a ramp instead of jumping.
+ *
+ * Times are in microseconds. Single threaded, only used by the DAC writer.
+ */
+
+#define MOD_DACSCHED_MAX_CHANNELS 8
+#define MOD_DACSCHED_TOKEN        1000000 // one write, in token units refilled per second of rate
+
+typedef struct {
+    uint64_t tokens;
+    uint64_t last_refill;
+} mod_dacsched_bucket_t;
+
+typedef struct {
+    float target; // latest requested value
+    float output; // last written value, valid if written
+    bool written;
+    bool pending; // target not acted upon yet
+    bool slewing; // output still moving towards target
+    uint64_t last_write;
+    mod_dacsched_bucket_t bucket;
+} mod_dacsched_channel_t;
+
+typedef struct {
+    unsigned count;
+    unsigned channel_rate, total_rate; // writes per second, 0 for unlimited
+    float slew_rate;                   // units per second, 0 for none
+    mod_dacsched_bucket_t total;
+    mod_dacsched_channel_t channels[MOD_DACSCHED_MAX_CHANNELS];
+} mod_dacsched_t;
+
+// buckets start full, allowing one write per channel right away
+static inline
+void mod_dacsched_configure(mod_dacsched_t* const sched, const unsigned channel_rate, const unsigned total_rate,
+                            const float slew_rate, const uint64_t now)
+{
+    sched->channel_rate = channel_rate;
+    sched->total_rate = total_rate;
+    sched->slew_rate = slew_rate;
+    sched->total.tokens = (uint64_t)sched->count * MOD_DACSCHED_TOKEN;
+    sched->total.last_refill = now;
+
+    for (unsigned c = 0; c < sched->count; ++c)
+    {
+        sched->channels[c].bucket.tokens = MOD_DACSCHED_TOKEN;
+        sched->channels[c].bucket.last_refill = now;
+    }
+}
+
+static inline
+void mod_dacsched_init(mod_dacsched_t* const sched, const unsigned count)
+{
+    memset(sched, 0, sizeof(*sched));
+    sched->count = count < MOD_DACSCHED_MAX_CHANNELS ? count : MOD_DACSCHED_MAX_CHANNELS;
+    mod_dacsched_configure(sched, 0, 0, 0.0f, 0);
+}
+
+// next write of every channel jumps straight to its target, as if nothing was written before
+static inline
+void mod_dacsched_invalidate(mod_dacsched_t* const sched)
+{
+    for (unsigned c = 0; c < sched->count; ++c)
+    {
+        mod_dacsched_channel_t* const channel = &sched->channels[c];
+
+        channel->written = false;
+        channel->pending = true;
+    }
+}
+
+// the channel output is already at value, e.g. restored from a previous run, so slewing starts from there
+static inline
+void mod_dacsched_restore(mod_dacsched_t* const sched, const unsigned c, const float value, const uint64_t now)
+{
+    mod_dacsched_channel_t* const channel = &sched->channels[c];
+
+    channel->target = channel->output = value;
+    channel->written = true;
+    channel->pending = channel->slewing = false;
+    channel->last_write = now;
+}
+
+// returns true if the update replaced a pending one
+static inline
+bool mod_dacsched_post(mod_dacsched_t* const sched, const unsigned c, const float value)
+{
+    mod_dacsched_channel_t* const channel = &sched->channels[c];
+    const bool coalesced = channel->pending;
+
+    channel->target = value;
+    channel->pending = true;
+    return coalesced;
+}
+
+// the output already matches the target, drops whatever is pending
+static inline
+void mod_dacsched_cancel(mod_dacsched_t* const sched, const unsigned c)
+{
+    mod_dacsched_channel_t* const channel = &sched->channels[c];
+
+    channel->pending = channel->slewing = false;
+}
+
+static inline
+void mod_dacsched_refill(mod_dacsched_bucket_t* const bucket, const unsigned rate,
+                         const uint64_t burst, const uint64_t now)
+{
+    if (now > bucket->last_refill)
+    {
+        bucket->tokens += (now - bucket->last_refill) * rate;
+
+        if (bucket->tokens > burst)
+            bucket->tokens = burst;
+    }
+
+    bucket->last_refill = now;
+}
+
+static inline
+float mod_dacsched_distance(const mod_dacsched_channel_t* const channel)
+{
+    if (! channel->written)
+        return 1e30f;
+
+    const float diff = channel->target - channel->output;
+    return diff < 0.0f ? -diff : diff;
+}
+
+// fills order with the channels allowed to write now, highest priority first, spending their tokens.
+// returns how many, deferred is set to the number of pending updates left waiting for budget.
+static inline
+unsigned mod_dacsched_select(mod_dacsched_t* const sched, const uint64_t now,
+                             unsigned order[MOD_DACSCHED_MAX_CHANNELS], unsigned* const deferred)
+{
+    unsigned candidates = 0, waiting = 0;
+
+    if (sched->total_rate != 0)
+        mod_dacsched_refill(&sched->total, sched->total_rate, (uint64_t)sched->count * MOD_DACSCHED_TOKEN, now);
+
+    for (unsigned c = 0; c < sched->count; ++c)
+    {
+        mod_dacsched_channel_t* const channel = &sched->channels[c];
+
+        if (! channel->pending && ! channel->slewing)
+            continue;
+
+        if (sched->channel_rate != 0)
+        {
+            mod_dacsched_refill(&channel->bucket, sched->channel_rate, MOD_DACSCHED_TOKEN, now);
+
+            if (channel->bucket.tokens < MOD_DACSCHED_TOKEN)
+            {
+                if (channel->pending)
+                    ++waiting;
+                continue;
+            }
+        }
+
+        // insertion by distance to target, there are only a few channels
+        const float distance = mod_dacsched_distance(channel);
+        unsigned i = candidates++;
+
+        for (; i > 0 && mod_dacsched_distance(&sched->channels[order[i - 1]]) < distance; --i)
+            order[i] = order[i - 1];
+
+        order[i] = c;
+    }
+
+    unsigned allowed = candidates;
+
+    if (sched->total_rate != 0)
+    {
+        const uint64_t available = sched->total.tokens / MOD_DACSCHED_TOKEN;
+
+        if (allowed > available)
+            allowed = (unsigned)available;
+
+        sched->total.tokens -= (uint64_t)allowed * MOD_DACSCHED_TOKEN;
+    }
+
+    for (unsigned i = 0; i < candidates; ++i)
+    {
+        mod_dacsched_channel_t* const channel = &sched->channels[order[i]];
+
+        if (i >= allowed)
+        {
+            if (channel->pending)
+                ++waiting;
+        }
+        else if (sched->channel_rate != 0)
+        {
+            channel->bucket.tokens -= MOD_DACSCHED_TOKEN;
+        }
+    }
+
+    *deferred = waiting;
+    return allowed;
+}
+
+// value to write now for a selected channel, slew limited
+static inline
+float mod_dacsched_take(mod_dacsched_t* const sched, const unsigned c, const uint64_t now)
+{
+    mod_dacsched_channel_t* const channel = &sched->channels[c];
+    float output = channel->target;
+
+    if (channel->written && sched->slew_rate > 0.0f && now > channel->last_write)
+    {
+        const float step = sched->slew_rate * (float)(now - channel->last_write) * 1e-6f;
+
+        if (output > channel->output + step)
+            output = channel->output + step;
+        else if (output < channel->output - step)
+            output = channel->output - step;
+    }
+
+    channel->slewing = output < channel->target || output > channel->target;
+    channel->pending = false;
+    channel->written = true;
+    channel->output = output;
+    channel->last_write = now;
+    return output;
+}
+
+#endif // MOD_DACSCHED_H_INCLUDED
@@ -0,0 +1,236 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_IIOEVENT_H_INCLUDED
+#define MOD_IIOEVENT_H_INCLUDED
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+#include <linux/iio/events.h>
+
+/*
+ * Threshold events of iio ADC channels, for sleeping until an input moves.
+ *
+ * Each channel gets a window around its last reading, using the rising and falling threshold events
+ * (events/in_voltage<N>_thresh_{rising,falling}_{value,en} in sysfs). Crossings are reported through
+ * the event fd of the character device (/dev/iio:deviceN), which is waited on with poll().
+ *
+ * Not every driver has threshold events, opening fails then and readers keep polling the raw values.
+ */
+
+#define MOD_IIO_EVENTS_CHANNELS 2
+#define MOD_IIO_EVENTS_OTHER    (1 << 30) // returned by wait when the extra fd is readable
+
+typedef struct {
+    int fd; // event fd, -1 if not available
+    int rising[MOD_IIO_EVENTS_CHANNELS], falling[MOD_IIO_EVENTS_CHANNELS];       // threshold value files
+    int rising_en[MOD_IIO_EVENTS_CHANNELS], falling_en[MOD_IIO_EVENTS_CHANNELS]; // enable files
+    bool rising_on[MOD_IIO_EVENTS_CHANNELS], falling_on[MOD_IIO_EVENTS_CHANNELS];
+    int low[MOD_IIO_EVENTS_CHANNELS], high[MOD_IIO_EVENTS_CHANNELS]; // armed window, -1 if not armed
+} mod_iio_events_t;
+
+static inline
+bool mod_iio_events_write(const int fd, const int value)
+{
+    char buf[16];
+    const int len = snprintf(buf, sizeof(buf), "%d\n", value);
+
+    return pwrite(fd, buf, (size_t)len, 0) == (ssize_t)len;
+}
+
+static inline
+int mod_iio_events_open_attr(const char* const device, const int channel, const char* const attr)
+{
+    char filename[512];
+    snprintf(filename, sizeof(filename), "%s/events/in_voltage%d_thresh_%s", device, channel, attr);
+
+    return open(filename, O_WRONLY|O_CLOEXEC);
+}
+
+static inline
+void mod_iio_events_close(mod_iio_events_t* const events)
+{
+    for (int c = 0; c < MOD_IIO_EVENTS_CHANNELS; ++c)
+    {
+        if (events->rising_en[c] >= 0)
+            mod_iio_events_write(events->rising_en[c], 0);
+        if (events->falling_en[c] >= 0)
+            mod_iio_events_write(events->falling_en[c], 0);
+
+        const int fds[4] = { events->rising[c], events->falling[c], events->rising_en[c], events->falling_en[c] };
+
+        for (int i = 0; i < 4; ++i)
+            if (fds[i] >= 0)
+                close(fds[i]);
+
+        events->rising[c] = events->falling[c] = events->rising_en[c] = events->falling_en[c] = -1;
+    }
+
+    if (events->fd >= 0)
+    {
+        close(events->fd);
+        events->fd = -1;
+    }
+}
+
+// device is the sysfs directory of the iio device, returns false if the driver has no usable threshold events
+static inline
+bool mod_iio_events_open(mod_iio_events_t* const events, const char* const device)
+{
+    memset(events, 0, sizeof(*events));
+    events->fd = -1;
+
+    for (int c = 0; c < MOD_IIO_EVENTS_CHANNELS; ++c)
+    {
+        events->rising[c] = events->falling[c] = events->rising_en[c] = events->falling_en[c] = -1;
+        events->low[c] = events->high[c] = -1;
+    }
+
+    // the character device has the same name as the sysfs directory
+    char* const resolved = realpath(device, NULL);
+    if (resolved == NULL)
+        return false;
+
+    const char* const slash = strrchr(resolved, '/');
+    char devname[512];
+    snprintf(devname, sizeof(devname), "/dev/%s", slash != NULL ? slash + 1 : resolved);
+    free(resolved);
+
+    const int devfd = open(devname, O_RDONLY|O_CLOEXEC);
+    if (devfd < 0)
+        return false;
+
+    int fd = -1;
+    const int ret = ioctl(devfd, IIO_GET_EVENT_FD_IOCTL, &fd);
+    close(devfd);
+
+    if (ret < 0 || fd < 0)
+        return false;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    events->fd = fd;
+
+    for (int c = 0; c < MOD_IIO_EVENTS_CHANNELS; ++c)
+    {
+        events->rising[c]     = mod_iio_events_open_attr(device, c, "rising_value");
+        events->falling[c]    = mod_iio_events_open_attr(device, c, "falling_value");
+        events->rising_en[c]  = mod_iio_events_open_attr(device, c, "rising_en");
+        events->falling_en[c] = mod_iio_events_open_attr(device, c, "falling_en");
+
+        if (events->rising[c] < 0 || events->falling[c] < 0 || events->rising_en[c] < 0 || events->falling_en[c] < 0)
+        {
+            mod_iio_events_close(events);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// events fire once the channel leaves raw +/- window. thresholds past the converter range are disabled
+static inline
+bool mod_iio_events_arm(mod_iio_events_t* const events, const int channel, const int raw, const int window,
+                        const int max_raw)
+{
+    const int low = raw - window;
+    const int high = raw + window;
+
+    if (events->low[channel] == low && events->high[channel] == high)
+        return true;
+
+    const bool rising = high < max_raw;
+    const bool falling = low > 0;
+
+    if ((rising && ! mod_iio_events_write(events->rising[channel], high)) ||
+        (falling && ! mod_iio_events_write(events->falling[channel], low)))
+        return false;
+
+    if (events->rising_on[channel] != rising)
+    {
+        if (! mod_iio_events_write(events->rising_en[channel], rising ? 1 : 0))
+            return false;
+        events->rising_on[channel] = rising;
+    }
+
+    if (events->falling_on[channel] != falling)
+    {
+        if (! mod_iio_events_write(events->falling_en[channel], falling ? 1 : 0))
+            return false;
+        events->falling_on[channel] = falling;
+    }
+
+    events->low[channel] = low;
+    events->high[channel] = high;
+    return true;
+}
+
+// drops events queued while not waiting, they refer to windows no longer armed
+static inline
+void mod_iio_events_drain(mod_iio_events_t* const events)
+{
+    struct iio_event_data event;
+
+    while (read(events->fd, &event, sizeof(event)) == (ssize_t)sizeof(event)) {}
+}
+
+// sleeps until a threshold is crossed, extra_fd (if >= 0) is readable or timeout_ms passes.
+// returns a mask of the channels that crossed, plus MOD_IIO_EVENTS_OTHER for the extra fd, 0 on timeout.
+static inline
+int mod_iio_events_wait(mod_iio_events_t* const events, const int extra_fd, const int timeout_ms)
+{
+    struct pollfd pfds[2] = {
+        { events->fd, POLLIN, 0 },
+        { extra_fd, POLLIN, 0 },
+    };
+
+    if (poll(pfds, extra_fd >= 0 ? 2 : 1, timeout_ms) <= 0)
+        return 0;
+
+    int mask = (pfds[1].revents & POLLIN) != 0 ? MOD_IIO_EVENTS_OTHER : 0;
+
+    if ((pfds[0].revents & POLLIN) == 0)
+        return mask;
+
+    struct iio_event_data event;
+
+    while (read(events->fd, &event, sizeof(event)) == (ssize_t)sizeof(event))
+    {
+        const int channel = IIO_EVENT_CODE_EXTRACT_CHAN(event.id);
+
+        if (channel >= 0 && channel < MOD_IIO_EVENTS_CHANNELS)
+        {
+            mask |= 1 << channel;
+            // the window is stale now, re-arm on the next wait
+            events->low[channel] = events->high[channel] = -1;
+        }
+    }
+
+    return mask;
+}
+
+#endif // MOD_IIOEVENT_H_INCLUDED
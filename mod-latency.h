@@ -0,0 +1,179 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_LATENCY_H_INCLUDED
+#define MOD_LATENCY_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Latency histograms with log-linear buckets, like HDR histograms.
+ * Each power of two is split into 2^MOD_LATENCY_SUB_BITS buckets, which keeps relative error below 12.5%.
+ * Values are in nanoseconds, anything above ~68s ends up in the last bucket.
+ *
+ * Each histogram must only be written by a single thread, recording is lock-free and never blocks.
+ * Dumping can happen at any time from another thread, but may show values from a record in progress.
+ */
+
+#define MOD_LATENCY_SUB_BITS 3
+#define MOD_LATENCY_SUB_SIZE (1 << MOD_LATENCY_SUB_BITS)
+#define MOD_LATENCY_MAX_BITS 36
+#define MOD_LATENCY_BUCKETS  ((MOD_LATENCY_MAX_BITS - MOD_LATENCY_SUB_BITS + 1) * MOD_LATENCY_SUB_SIZE)
+
+typedef struct {
+    const char* name;
+    uint64_t count, sum, min, max;
+    uint32_t buckets[MOD_LATENCY_BUCKETS];
+} mod_latency_histogram_t;
+
+static inline
+uint64_t mod_latency_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline
+void mod_latency_init(mod_latency_histogram_t* const hist, const char* const name)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->name = name;
+    hist->min  = UINT64_MAX;
+}
+
+static inline
+unsigned mod_latency_bucket_index(const uint64_t value)
+{
+    if (value < MOD_LATENCY_SUB_SIZE)
+        return (unsigned)value;
+
+    const unsigned msb   = 63u - (unsigned)__builtin_clzll(value);
+    const unsigned group = msb - MOD_LATENCY_SUB_BITS + 1;
+    const unsigned index = (group << MOD_LATENCY_SUB_BITS)
+                         + (unsigned)((value >> (msb - MOD_LATENCY_SUB_BITS)) & (MOD_LATENCY_SUB_SIZE - 1));
+
+    return index < MOD_LATENCY_BUCKETS ? index : MOD_LATENCY_BUCKETS - 1;
+}
+
+static inline
+uint64_t mod_latency_bucket_lower_bound(const unsigned index)
+{
+    const unsigned group = index >> MOD_LATENCY_SUB_BITS;
+    const uint64_t sub   = index & (MOD_LATENCY_SUB_SIZE - 1);
+
+    if (group == 0)
+        return sub;
+
+    return (MOD_LATENCY_SUB_SIZE + sub) << (group - 1);
+}
+
+// single writer, relaxed atomics so that readers never see torn values
+static inline
+void mod_latency_record(mod_latency_histogram_t* const hist, const uint64_t value)
+{
+    const unsigned index = mod_latency_bucket_index(value);
+
+    __atomic_store_n(&hist->buckets[index], hist->buckets[index] + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum, hist->sum + value, __ATOMIC_RELAXED);
+
+    if (value < hist->min)
+        __atomic_store_n(&hist->min, value, __ATOMIC_RELAXED);
+    if (value > hist->max)
+        __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELEASE);
+}
+
+static inline
+uint64_t mod_latency_percentile(const mod_latency_histogram_t* const hist, const uint64_t count, const double percentile)
+{
+    const uint64_t target = (uint64_t)((double)count * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    for (unsigned i = 0; i < MOD_LATENCY_BUCKETS; ++i)
+    {
+        seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+
+        if (seen >= target && seen != 0)
+            return i + 1 < MOD_LATENCY_BUCKETS ? mod_latency_bucket_lower_bound(i + 1) : hist->max;
+    }
+
+    return hist->max;
+}
+
+// prints a summary line followed by the non-empty buckets, all values in microseconds
+static inline
+void mod_latency_dump(FILE* const f, const mod_latency_histogram_t* const hist)
+{
+    const uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_ACQUIRE);
+
+    if (count == 0)
+    {
+        fprintf(f, "%s: no samples\n", hist->name);
+        return;
+    }
+
+    fprintf(f, "%s: count=%llu min=%.1f avg=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f us\n",
+            hist->name,
+            (unsigned long long)count,
+            (double)__atomic_load_n(&hist->min, __ATOMIC_RELAXED) / 1000.0,
+            (double)__atomic_load_n(&hist->sum, __ATOMIC_RELAXED) / (double)count / 1000.0,
+            (double)mod_latency_percentile(hist, count, 50.0) / 1000.0,
+            (double)mod_latency_percentile(hist, count, 90.0) / 1000.0,
+            (double)mod_latency_percentile(hist, count, 99.0) / 1000.0,
+            (double)mod_latency_percentile(hist, count, 99.9) / 1000.0,
+            (double)__atomic_load_n(&hist->max, __ATOMIC_RELAXED) / 1000.0);
+
+    for (unsigned i = 0; i < MOD_LATENCY_BUCKETS; ++i)
+    {
+        const uint32_t bcount = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+
+        if (bcount == 0)
+            continue;
+
+        fprintf(f, "  %.3f %u\n", (double)mod_latency_bucket_lower_bound(i) / 1000.0, bcount);
+    }
+}
+
+// dumps all histograms to a file (appending) or stdout if filename is "-"
+static inline
+void mod_latency_dump_all(const char* const filename, const char* const title,
+                          const mod_latency_histogram_t* const hists, const unsigned count)
+{
+    const bool use_stdout = filename[0] == '-' && filename[1] == '\0';
+    FILE* const f = use_stdout ? stdout : fopen(filename, "a");
+
+    if (f == NULL)
+        return;
+
+    fprintf(f, "# %s latency, %llu ns monotonic\n", title, (unsigned long long)mod_latency_now_ns());
+
+    for (unsigned i = 0; i < count; ++i)
+        mod_latency_dump(f, &hists[i]);
+
+    if (use_stdout)
+        fflush(f);
+    else
+        fclose(f);
+}
+
+#endif // MOD_LATENCY_H_INCLUDED
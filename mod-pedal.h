@@ -0,0 +1,293 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_PEDAL_H_INCLUDED
+#define MOD_PEDAL_H_INCLUDED
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Expression pedal range learning and scaling.
+ *
+ * Pedals usually travel only part of the input range. The range is learned from the readings,
+ * extending it only once several consecutive readings agree (so single spikes are ignored),
+ * and slowly shrinking it otherwise, so that a replaced pedal gets learned again.
+ *
+ * A range and taper curve are turned into a map from input volts to pedal output, built off the RT thread.
+ * Applying a map costs one multiply-add per sample for the linear taper, one table lookup otherwise.
+ *
+ * Range file format, one input per line:
+ *
+ *   # comment
+ *   pedal<input> <min volts> <max volts>
+ */
+
+#define MOD_PEDAL_CHANNELS        2
+#define MOD_PEDAL_INPUT_MAX_VOLTS 10.0f
+#define MOD_PEDAL_MIN_SPAN_VOLTS  1.0f // learned ranges below this are not used, nor shrunk further
+#define MOD_PEDAL_CONFIRM         4    // consecutive readings needed for extending the range
+#define MOD_PEDAL_TABLE_SIZE      1024
+#define MOD_PEDAL_TAPER_BASE      100.0f // log taper is at 1/11 of the output at half travel
+
+typedef enum {
+    mod_pedal_curve_linear,
+    mod_pedal_curve_log,    // slow start, as audio taper potentiometers
+    mod_pedal_curve_antilog // fast start, inverse of log
+} mod_pedal_curve_t;
+
+typedef struct {
+    float min, max;  // learned range in volts, min > max until the first reading
+    float candidate; // closest reading of the pending extension
+    int pending;     // consecutive readings beyond the range, negative for below
+} mod_pedal_range_t;
+
+typedef struct {
+    bool plain;  // value * gain, the caller can fold it into rendering
+    bool curved; // table lookup instead of multiply-add
+    float gain, offset, span;
+    float table_scale; // volts to table index
+    float table[MOD_PEDAL_TABLE_SIZE + 1];
+} mod_pedal_map_t;
+
+static inline
+void mod_pedal_range_reset(mod_pedal_range_t* const range)
+{
+    range->min = MOD_PEDAL_INPUT_MAX_VOLTS;
+    range->max = 0.0f;
+    range->candidate = 0.0f;
+    range->pending = 0;
+}
+
+static inline
+bool mod_pedal_range_usable(const mod_pedal_range_t* const range)
+{
+    return range->max - range->min >= MOD_PEDAL_MIN_SPAN_VOLTS;
+}
+
+// returns true if the range changed
+static inline
+bool mod_pedal_range_update(mod_pedal_range_t* const range, const float volts)
+{
+    if (range->min > range->max)
+    {
+        range->min = range->max = volts;
+        return true;
+    }
+
+    if (volts > range->max)
+    {
+        if (range->pending > 0)
+        {
+            ++range->pending;
+            if (volts < range->candidate)
+                range->candidate = volts;
+        }
+        else
+        {
+            range->pending = 1;
+            range->candidate = volts;
+        }
+
+        if (range->pending < MOD_PEDAL_CONFIRM)
+            return false;
+
+        range->max = range->candidate;
+        range->pending = 0;
+        return true;
+    }
+
+    if (volts < range->min)
+    {
+        if (range->pending < 0)
+        {
+            --range->pending;
+            if (volts > range->candidate)
+                range->candidate = volts;
+        }
+        else
+        {
+            range->pending = -1;
+            range->candidate = volts;
+        }
+
+        if (range->pending > -MOD_PEDAL_CONFIRM)
+            return false;
+
+        range->min = range->candidate;
+        range->pending = 0;
+        return true;
+    }
+
+    range->pending = 0;
+    return false;
+}
+
+// shrinks the range by a fraction of its span, down to the minimum usable span
+static inline
+bool mod_pedal_range_decay(mod_pedal_range_t* const range, const float amount)
+{
+    const float span = range->max - range->min;
+
+    if (span <= MOD_PEDAL_MIN_SPAN_VOLTS)
+        return false;
+
+    float shrink = span * amount * 0.5f;
+
+    if (span - shrink * 2.0f < MOD_PEDAL_MIN_SPAN_VOLTS)
+        shrink = (span - MOD_PEDAL_MIN_SPAN_VOLTS) * 0.5f;
+
+    range->min += shrink;
+    range->max -= shrink;
+    return true;
+}
+
+static inline
+float mod_pedal_taper(const mod_pedal_curve_t curve, const float x)
+{
+    switch (curve)
+    {
+    case mod_pedal_curve_log:
+        return (powf(MOD_PEDAL_TAPER_BASE, x) - 1.0f) / (MOD_PEDAL_TAPER_BASE - 1.0f);
+    case mod_pedal_curve_antilog:
+        return logf(1.0f + (MOD_PEDAL_TAPER_BASE - 1.0f) * x) / logf(MOD_PEDAL_TAPER_BASE);
+    default:
+        return x;
+    }
+}
+
+// maps the learned range (or the full input range if not usable) onto 0..span
+static inline
+void mod_pedal_build_map(mod_pedal_map_t* const map, const mod_pedal_range_t* const range,
+                         const mod_pedal_curve_t curve, const float span)
+{
+    const bool learned = range != NULL && mod_pedal_range_usable(range);
+    const float lo = learned ? range->min : 0.0f;
+    const float hi = learned ? range->max : MOD_PEDAL_INPUT_MAX_VOLTS;
+
+    map->plain  = !learned && curve == mod_pedal_curve_linear;
+    map->curved = curve != mod_pedal_curve_linear;
+    map->span   = span;
+    map->gain   = span / (hi - lo);
+    map->offset = -lo * map->gain;
+    map->table_scale = (float)MOD_PEDAL_TABLE_SIZE / MOD_PEDAL_INPUT_MAX_VOLTS;
+
+    if (! map->curved)
+        return;
+
+    for (int i = 0; i <= MOD_PEDAL_TABLE_SIZE; ++i)
+    {
+        const float volts = (float)i / map->table_scale;
+        float x = (volts - lo) / (hi - lo);
+
+        if (x < 0.0f)
+            x = 0.0f;
+        else if (x > 1.0f)
+            x = 1.0f;
+
+        map->table[i] = mod_pedal_taper(curve, x) * span;
+    }
+}
+
+// in place, buffer holds input volts
+static inline
+void mod_pedal_apply(const mod_pedal_map_t* const map, float* const buf, const uint32_t nframes)
+{
+    if (map->curved)
+    {
+        for (uint32_t i = 0; i < nframes; ++i)
+        {
+            float pos = buf[i] * map->table_scale;
+
+            if (pos < 0.0f)
+                pos = 0.0f;
+            else if (pos > (float)MOD_PEDAL_TABLE_SIZE - 0.001f)
+                pos = (float)MOD_PEDAL_TABLE_SIZE - 0.001f;
+
+            const int index = (int)pos;
+            buf[i] = map->table[index] + (map->table[index + 1] - map->table[index]) * (pos - (float)index);
+        }
+    }
+    else
+    {
+        for (uint32_t i = 0; i < nframes; ++i)
+        {
+            const float value = buf[i] * map->gain + map->offset;
+            buf[i] = value < 0.0f ? 0.0f : value > map->span ? map->span : value;
+        }
+    }
+}
+
+// returns false if the file cannot be opened, inputs missing from the file are left untouched
+static inline
+bool mod_pedal_load(const char* const filename, mod_pedal_range_t ranges[MOD_PEDAL_CHANNELS])
+{
+    FILE* const f = fopen(filename, "r");
+    if (f == NULL)
+        return false;
+
+    char line[256];
+    int index;
+    float min, max;
+
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "pedal%d %f %f", &index, &min, &max) != 3)
+            continue;
+        if (index < 1 || index > MOD_PEDAL_CHANNELS || min < 0.0f || max > MOD_PEDAL_INPUT_MAX_VOLTS || min > max)
+            continue;
+
+        mod_pedal_range_reset(&ranges[index - 1]);
+        ranges[index - 1].min = min;
+        ranges[index - 1].max = max;
+    }
+
+    fclose(f);
+    return true;
+}
+
+// written to a temporary file first, so a crash never leaves a truncated one behind
+static inline
+bool mod_pedal_save(const char* const filename, const mod_pedal_range_t ranges[MOD_PEDAL_CHANNELS])
+{
+    char tmpname[512];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+    FILE* const f = fopen(tmpname, "w");
+    if (f == NULL)
+        return false;
+
+    fputs("# pedal<input> <min volts> <max volts>\n", f);
+
+    for (int c = 0; c < MOD_PEDAL_CHANNELS; ++c)
+        if (ranges[c].min <= ranges[c].max)
+            fprintf(f, "pedal%d %.4f %.4f\n", c + 1, (double)ranges[c].min, (double)ranges[c].max);
+
+    if (fclose(f) != 0)
+    {
+        remove(tmpname);
+        return false;
+    }
+
+    return rename(tmpname, filename) == 0;
+}
+
+#endif // MOD_PEDAL_H_INCLUDED
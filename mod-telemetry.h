@@ -0,0 +1,216 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_TELEMETRY_H_INCLUDED
+#define MOD_TELEMETRY_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Shared-memory telemetry, published by both clients and read by mod-cvstat.
+ *
+ * The layout is fixed and versioned, readers must check magic, version and size before using it.
+ * New fields are only ever appended, bumping the version.
+ *
+ * Every field has a single writer thread, either the JACK process thread or the I/O thread.
+ * Updates are plain atomic stores, so they are wait-free and never block the writer.
+ * Readers may see counters from slightly different moments, but never torn values.
+ */
+
+#define MOD_CV_STATS_MAGIC    0x5356434d // "MCVS"
+#define MOD_CV_STATS_VERSION  3
+#define MOD_CV_STATS_BUFSIZES 10 // 16 to 8192 frames
+
+#define MOD_CV_STATS_SPI2JACK "/mod-spi2jack-stats"
+#define MOD_CV_STATS_JACK2SPI "/mod-jack2spi-stats"
+
+// process_callback duration for a single buffer size
+typedef struct {
+    uint64_t cycles;
+    uint64_t total_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+} mod_cv_stats_dsp_t;
+
+typedef struct {
+    // header
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t pid;
+    // written by the process thread
+    uint32_t bufsize;
+    uint32_t reserved;
+    uint64_t cycles;
+    mod_cv_stats_dsp_t dsp[MOD_CV_STATS_BUFSIZES];
+    // written by the I/O thread
+    uint32_t mode; // spi2jack: exp.pedal mode (0 = unused, 1 = port1, 2 = port2), jack2spi: cv enabled
+    uint32_t wakeups_per_sec;
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t skipped_writes;
+    uint64_t parse_failures;
+    uint64_t sem_timeouts;
+    // version 2, written by the jack notification thread
+    uint64_t xruns;
+    uint64_t freewheels; // times freewheel mode was entered
+    uint32_t freewheeling;
+    uint32_t reserved2;
+    // version 3, written by the I/O thread
+    uint64_t deferred_writes;  // pending DAC updates held back by the write budget, once per write attempt
+    uint64_t coalesced_writes; // pending DAC updates replaced by a newer one before being written
+} mod_cv_stats_t;
+
+// single writer increment
+static inline
+void mod_cv_stats_increment(uint64_t* const counter)
+{
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+static inline
+void mod_cv_stats_add(uint64_t* const counter, const uint64_t value)
+{
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+static inline
+void mod_cv_stats_set(uint32_t* const field, const uint32_t value)
+{
+    __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+static inline
+unsigned mod_cv_stats_bufsize_index(const uint32_t bufsize)
+{
+    unsigned index = 0;
+
+    for (uint32_t size = 16; size < bufsize && index < MOD_CV_STATS_BUFSIZES - 1; size *= 2)
+        ++index;
+
+    return index;
+}
+
+static inline
+void mod_cv_stats_record_dsp(mod_cv_stats_t* const stats, const uint32_t bufsize, const uint64_t duration_ns)
+{
+    mod_cv_stats_dsp_t* const dsp = &stats->dsp[mod_cv_stats_bufsize_index(bufsize)];
+
+    __atomic_store_n(&dsp->total_ns, dsp->total_ns + duration_ns, __ATOMIC_RELAXED);
+
+    if (dsp->cycles == 0 || duration_ns < dsp->min_ns)
+        __atomic_store_n(&dsp->min_ns, duration_ns, __ATOMIC_RELAXED);
+    if (duration_ns > dsp->max_ns)
+        __atomic_store_n(&dsp->max_ns, duration_ns, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&dsp->cycles, dsp->cycles + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->cycles, stats->cycles + 1, __ATOMIC_RELAXED);
+
+    if (stats->bufsize != bufsize)
+        __atomic_store_n(&stats->bufsize, bufsize, __ATOMIC_RELAXED);
+}
+
+static inline
+void mod_cv_stats_init(mod_cv_stats_t* const stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->version = MOD_CV_STATS_VERSION;
+    stats->size    = sizeof(mod_cv_stats_t);
+    stats->pid     = (uint32_t)getpid();
+    __atomic_store_n(&stats->magic, MOD_CV_STATS_MAGIC, __ATOMIC_RELEASE);
+}
+
+// creates and maps the shared segment, returns NULL on failure
+static inline
+mod_cv_stats_t* mod_cv_stats_create(const char* const name)
+{
+    const int fd = shm_open(name, O_CREAT|O_RDWR, 0644);
+    if (fd < 0)
+        return NULL;
+
+    if (ftruncate(fd, sizeof(mod_cv_stats_t)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void* const ptr = mmap(NULL, sizeof(mod_cv_stats_t), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+    mod_cv_stats_t* const stats = (mod_cv_stats_t*)ptr;
+    mod_cv_stats_init(stats);
+    return stats;
+}
+
+static inline
+void mod_cv_stats_destroy(mod_cv_stats_t* const stats, const char* const name)
+{
+    munmap(stats, sizeof(mod_cv_stats_t));
+    shm_unlink(name);
+}
+
+// maps an existing segment read-only, returns NULL if missing or incompatible
+static inline
+const mod_cv_stats_t* mod_cv_stats_open(const char* const name)
+{
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(mod_cv_stats_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    void* const ptr = mmap(NULL, sizeof(mod_cv_stats_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (ptr == MAP_FAILED)
+        return NULL;
+
+    const mod_cv_stats_t* const stats = (const mod_cv_stats_t*)ptr;
+
+    if (__atomic_load_n(&stats->magic, __ATOMIC_ACQUIRE) != MOD_CV_STATS_MAGIC ||
+        stats->version < MOD_CV_STATS_VERSION || stats->size < sizeof(mod_cv_stats_t))
+    {
+        munmap(ptr, sizeof(mod_cv_stats_t));
+        return NULL;
+    }
+
+    return stats;
+}
+
+static inline
+void mod_cv_stats_close(const mod_cv_stats_t* const stats)
+{
+    // mapped read-only, munmap only needs the address
+    munmap((void*)(uintptr_t)stats, sizeof(mod_cv_stats_t));
+}
+
+#endif // MOD_TELEMETRY_H_INCLUDED
@@ -0,0 +1,210 @@
+/*
+ * This file is part of mod-spi2jack.
+ *
+ * mod-spi2jack is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mod-spi2jack is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with mod-spi2jack.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MOD_TRACE_H_INCLUDED
+#define MOD_TRACE_H_INCLUDED
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Binary traces of raw converter I/O, for reproducing field reports on a dev machine.
+ *
+ * A trace is a memory-mapped file, a fixed size header followed by a fixed number of 16 byte entries.
+ * The file is allocated and touched when created, so appending is a plain memory write that never blocks.
+ * Traces should be placed on tmpfs, otherwise page writeback can still stall the writer.
+ *
+ * When full, appending either stops (counting dropped entries) or wraps around, overwriting the oldest entries.
+ * Each trace must only be written by a single thread.
+ */
+
+#define MOD_TRACE_MAGIC   0x5456434d // "MCVT"
+#define MOD_TRACE_VERSION 1
+
+#define MOD_TRACE_FLAG_WRAP 0x1
+
+typedef struct {
+    uint64_t time;  // jack_get_time(), in usecs
+    uint32_t cycle; // process cycle count at the time
+    uint16_t raw;   // converter code
+    uint8_t channel;
+    uint8_t reserved;
+} mod_trace_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t entry_size;
+    uint32_t flags;
+    uint64_t capacity;
+    uint64_t head;    // entries appended so far, including overwritten ones
+    uint64_t dropped; // entries not appended because the trace was full
+    char client[24];  // "spi2jack" or "jack2spi"
+} mod_trace_header_t;
+
+typedef struct {
+    mod_trace_header_t* header;
+    mod_trace_entry_t* entries;
+    size_t size;
+} mod_trace_t;
+
+// creates a new trace file for writing, replacing any existing one
+static inline
+bool mod_trace_create(mod_trace_t* const trace, const char* const path, const char* const client,
+                      const uint64_t capacity, const bool wrap)
+{
+    memset(trace, 0, sizeof(*trace));
+
+    if (capacity == 0)
+        return false;
+
+    const size_t size = sizeof(mod_trace_header_t) + sizeof(mod_trace_entry_t) * capacity;
+
+    const int fd = open(path, O_CREAT|O_TRUNC|O_RDWR|O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+
+    // allocate blocks now, a sparse file would fault on the first write to each page
+    if (posix_fallocate(fd, 0, (off_t)size) != 0 && ftruncate(fd, (off_t)size) != 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    void* const ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (ptr == MAP_FAILED)
+        return false;
+
+    // touch every page and keep them resident, best effort
+    memset(ptr, 0, size);
+    mlock(ptr, size);
+
+    trace->header  = (mod_trace_header_t*)ptr;
+    trace->entries = (mod_trace_entry_t*)(trace->header + 1);
+    trace->size    = size;
+
+    trace->header->version    = MOD_TRACE_VERSION;
+    trace->header->entry_size = sizeof(mod_trace_entry_t);
+    trace->header->flags      = wrap ? MOD_TRACE_FLAG_WRAP : 0;
+    trace->header->capacity   = capacity;
+    snprintf(trace->header->client, sizeof(trace->header->client), "%s", client);
+    __atomic_store_n(&trace->header->magic, MOD_TRACE_MAGIC, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+// returns false if the trace is full and not wrapping
+static inline
+bool mod_trace_append(mod_trace_t* const trace, const uint64_t time, const uint32_t cycle,
+                      const uint8_t channel, const uint16_t raw)
+{
+    mod_trace_header_t* const header = trace->header;
+    const uint64_t head = header->head;
+
+    if (head >= header->capacity && (header->flags & MOD_TRACE_FLAG_WRAP) == 0)
+    {
+        __atomic_store_n(&header->dropped, header->dropped + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    mod_trace_entry_t* const entry = &trace->entries[head % header->capacity];
+    entry->time    = time;
+    entry->cycle   = cycle;
+    entry->raw     = raw;
+    entry->channel = channel;
+
+    __atomic_store_n(&header->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// opens an existing trace read-only, returns false if missing or incompatible
+static inline
+bool mod_trace_open(mod_trace_t* const trace, const char* const path)
+{
+    memset(trace, 0, sizeof(*trace));
+
+    const int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(mod_trace_header_t))
+    {
+        close(fd);
+        return false;
+    }
+
+    const size_t size = (size_t)st.st_size;
+    void* const ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (ptr == MAP_FAILED)
+        return false;
+
+    mod_trace_header_t* const header = (mod_trace_header_t*)ptr;
+
+    if (header->magic != MOD_TRACE_MAGIC || header->version != MOD_TRACE_VERSION ||
+        header->entry_size != sizeof(mod_trace_entry_t) || header->capacity == 0 ||
+        header->capacity > (size - sizeof(mod_trace_header_t)) / sizeof(mod_trace_entry_t))
+    {
+        munmap(ptr, size);
+        return false;
+    }
+
+    trace->header  = header;
+    trace->entries = (mod_trace_entry_t*)(header + 1);
+    trace->size    = size;
+    return true;
+}
+
+static inline
+void mod_trace_close(mod_trace_t* const trace)
+{
+    if (trace->header != NULL)
+        munmap(trace->header, trace->size);
+
+    memset(trace, 0, sizeof(*trace));
+}
+
+// number of entries available for reading
+static inline
+uint64_t mod_trace_count(const mod_trace_t* const trace)
+{
+    const uint64_t head = __atomic_load_n(&trace->header->head, __ATOMIC_ACQUIRE);
+    return head < trace->header->capacity ? head : trace->header->capacity;
+}
+
+// entries in the order they were appended, index 0 being the oldest one still available
+static inline
+const mod_trace_entry_t* mod_trace_at(const mod_trace_t* const trace, const uint64_t index)
+{
+    const uint64_t head = __atomic_load_n(&trace->header->head, __ATOMIC_ACQUIRE);
+    const uint64_t first = head > trace->header->capacity ? head - trace->header->capacity : 0;
+
+    return &trace->entries[(first + index) % trace->header->capacity];
+}
+
+#endif // MOD_TRACE_H_INCLUDED
@@ -25,6 +25,7 @@
 
 #include <jack/jack.h>
 #include <jack/metadata.h>
+#include <jack/midiport.h>
 #include <jack/uuid.h>
 
 #include <pthread.h>
@@ -32,8 +33,24 @@
 #include <errno.h>
 #include <math.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stddef.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+
+#include "kernels.h"
+#include "mod-alsactl.h"
+#include "mod-calibration.h"
+#include "mod-control.h"
+#include "mod-cvfeed.h"
+#include "mod-cvport.h"
+#include "mod-iioevent.h"
+#include "mod-latency.h"
+#include "mod-pedal.h"
+#include "mod-semaphore.h"
+#include "mod-telemetry.h"
+#include "mod-trace.h"
 
 #define ALSA_SOUNDCARD_DEFAULT_ID   "DUOX"
 #define ALSA_CONTROL_CV_EXP_MODE    "CV/Exp.Pedal Mode"
@@ -46,536 +63,1916 @@
 #define MAX_RAW_IIO_VALUE   4095
 #define MAX_RAW_IIO_VALUE_f 4095.0f
 
+// adaptive polling defaults
+// while values move we read this many times per period, then back off exponentially down to the min rate
+#define POLL_DIVISOR_DEFAULT  4
+#define POLL_DIVISOR_MAX      16
+#define POLL_MIN_RATE_DEFAULT 20 // Hz
+#define POLL_DEADBAND_DEFAULT 2  // raw iio units
+#define POLL_STATS_INTERVAL   10 // seconds
+
+// predictor, an alpha-beta tracker per input
+#define PREDICT_ALPHA          0.5f
+#define PREDICT_BETA           0.15f
+#define PREDICT_NOISE_WEIGHT   0.05f
+#define PREDICT_NOISE_DEFAULT  30    // mV rms of tracking residuals, predictor turns off above this
+#define PREDICT_MAX_HORIZON_US 20000
+
+// midi output, quantized values must move this far past the last sent step before sending again
+#define MIDI_HYSTERESIS 0.25f
+
+// resampling, readings are queued and interpolated onto the jack timeline
+#define RESAMPLE_RING_SIZE     256 // must be power of 2
+#define RESAMPLE_DLL_BANDWIDTH 1.0 // Hz
+
+// gate detection, a schmitt trigger per input
+#define GATE_THRESHOLD_DEFAULT  2000 // mV, rising edge above this
+#define GATE_HYSTERESIS_DEFAULT 1000 // mV, falling edge below threshold minus this
+#define GATE_HIGH_VOLTS         10.0f
+#define GATE_RING_SIZE          64   // must be power of 2
+#define GATE_NOTE_VELOCITY      100
+
+// value feed, how often new subscribers are accepted
+#define FEED_SERVICE_INTERVAL_MS 100
+
+// longest sleep waiting for iio threshold events, for servicing everything else in the reading thread
+#define IIO_EVENT_TIMEOUT_MS 1000
+
+// exp.pedal range learning, maps are double buffered so they must not be rebuilt faster than any jack period
+#define PEDAL_UPDATE_INTERVAL_MS 500
+#define PEDAL_DECAY_DEFAULT      3600  // seconds for shrinking the learned range by a factor of e
+#define PEDAL_SAVE_INTERVAL      60    // seconds
+#define PEDAL_SAVE_THRESHOLD     0.05f // volts, smaller range changes are not worth a write
+
+// latency histograms, dump requests are checked this often
+#define LATENCY_CHECK_INTERVAL_MS 250
+
+// raw input traces
+#define TRACE_SIZE_DEFAULT     262144 // entries
+#define REPLAY_MIN_DURATION_US 1000
+
 typedef enum {
   exp_pedal_mode_unused,
   exp_pedal_mode_port1,
   exp_pedal_mode_port2
 } exp_pedal_mode_t;
 
+// how readings are turned into a signal within each period
+typedef enum {
+  timing_mode_ramp,   // log crossfade over the whole period, from the previous reading to the latest
+  timing_mode_placed, // transition placed at the frames where readings were taken, using jack cycle times
+  timing_mode_predict, // ramp towards the value extrapolated to the end of the current period
+  timing_mode_resample // every reading queued and interpolated per frame, with drift tracked by a DLL
+} timing_mode_t;
+
+static const char* const timing_mode_names[] = { "ramp", "placed", "predict", "resample" };
+
+// live tunables, changed through the control socket. process and the reading thread work on their own copies
+typedef struct {
+  int poll_divisor;
+  int poll_min_rate;
+  int poll_deadband;
+  int timing_mode; // timing_mode_t
+  int predict_noise; // mV rms
+} spi2jack_params_t;
+
+static const mod_control_param_t spi2jack_params_table[] = {
+  { "poll_divisor",  offsetof(spi2jack_params_t, poll_divisor),  1, POLL_DIVISOR_MAX,  NULL },
+  { "poll_min_rate", offsetof(spi2jack_params_t, poll_min_rate), 1, 1000,              NULL },
+  { "poll_deadband", offsetof(spi2jack_params_t, poll_deadband), 0, MAX_RAW_IIO_VALUE, NULL },
+  { "timing",        offsetof(spi2jack_params_t, timing_mode),   timing_mode_ramp, timing_mode_resample, timing_mode_names },
+  { "predict_noise", offsetof(spi2jack_params_t, predict_noise), 1, 10000,             NULL },
+};
+
+// a single reading of both inputs, in volts
+typedef struct {
+  float value1, value2;
+  // rate of change in volts per microsecond, only set while the predictor is active
+  float slope1, slope2;
+  jack_time_t time;
+} spi2jack_reading_t;
+
+// single producer, single consumer queue of readings, from the reading thread to process
+typedef struct {
+  volatile uint32_t head, tail;
+  spi2jack_reading_t items[RESAMPLE_RING_SIZE];
+} reading_ring_t;
+
+// a gate edge on one input, time is estimated from the readings around the threshold crossing
+typedef struct {
+  jack_time_t time;
+  uint8_t channel;
+  bool high;
+} gate_edge_t;
+
+// single producer, single consumer queue of gate edges, from the reading thread to process
+typedef struct {
+  volatile uint32_t head, tail;
+  gate_edge_t items[GATE_RING_SIZE];
+} edge_ring_t;
+
+// reading thread side of the gate detection
+typedef struct {
+  jack_time_t time;
+  bool high;
+} gate_detector_t;
+
+// delay-locked loop over reading timestamps, as used by jack drivers against the audio clock.
+// filters scheduling jitter out of the timestamps and estimates the actual reading period.
+typedef struct {
+  double t0, t1; // filtered time of the current and next reading, in usecs
+  double period; // estimated reading period, in usecs
+  double nominal;
+  double b, c;
+  bool running;
+} adc_dll_t;
+
+// reading thread side of the predictor
+typedef struct {
+  float value, slope;
+  float noise; // running mean of squared residuals
+  jack_time_t time;
+  bool active;
+} predictor_t;
+
+// replay backend, feeds a recorded trace instead of reading sysfs
+typedef struct {
+  mod_trace_t trace;
+  uint64_t pos;
+  uint64_t loop_start; // replay time where the current pass started, in usecs
+  bool fast, loop;
+  int raw[2]; // latest replayed codes, -1 before the first one
+  sem_t sem; // posted every cycle in fast mode
+} replay_t;
+
+enum {
+  latency_adc_read,
+  latency_read_to_process,
+  latency_count
+};
+
 typedef struct {
   jack_client_t* client;
   jack_port_t* port1;
   jack_port_t* port2;
   jack_port_t* portPedal;
-  float value1, value2;
+  jack_port_t* portMidi;
+  jack_port_t* portGate1;
+  jack_port_t* portGate2;
+  // optional control-rate companions of capture_1, capture_2 and exp_pedal, NULL if disabled
+  jack_port_t* portControlRate[3];
+  mod_cv_port_writer_t control_rate_writer[3];
   float prevvalue1, prevvalue2;
+  // latest reading is published as a seqlock, odd while being written
+  volatile uint32_t read_seq;
+  spi2jack_reading_t reading;
+  jack_time_t prevtime;
+  // tunables as last published by the control thread, and the copy used by process
+  spi2jack_params_t params;
+  mod_control_t control;
+  spi2jack_params_t process_params;
+  uint32_t process_params_seq;
+  // resampling, last consumed reading is kept for interpolating towards the next one
+  reading_ring_t ring;
+  spi2jack_reading_t resample_last;
+  volatile float adc_period_usecs;
   FILE *in1f, *in2f;
   bool port_values_are_prescaled;
   volatile bool run, ready;
+  // set on xruns, process then jumps to the latest reading instead of ramping from a stale one
+  volatile bool resync;
+  volatile bool freewheeling;
   volatile exp_pedal_mode_t exp_pedal_mode;
   pthread_t thread;
   jack_nframes_t bufsize_us;
-  float bufsize_log;
-  // for knowing whichever exp.pedal mode we are on
-  snd_mixer_t* mixer;
-  snd_mixer_elem_t *mixerCvExpMode, *mixerExpPedalMode;
+  // optional midi output, cc number per input or -1 if unused
+  int midi_cc[2];
+  uint8_t midi_channel;
+  bool midi_14bit;
+  float midi_last[2]; // last sent quantized value, -1 if nothing was sent yet
+  // gate detection, edges are queued by the reading thread and rendered at their frame in process
+  bool gate_enabled;
+  int gate_note[2]; // midi note per input or -1 if unused
+  float gate_high_volts, gate_low_volts;
+  edge_ring_t edges;
+  bool gate_state[2];
+  // log crossfade kernel for the current buffer size, swapped atomically on buffer size changes
+  mod_ramp_kernel_t ramp_kernel;
+  // adaptive polling
+  bool poll_stats;
+  volatile float poll_wakeups_per_sec;
+  // raw -> volts, per input
+  float adc_table[2][MOD_CALIBRATION_TABLE_SIZE];
+  // exp.pedal scaling per input, rebuilt by the reading thread into the map not in use and swapped atomically
+  mod_pedal_curve_t pedal_curve;
+  float pedal_span;
+  bool pedal_learn;
+  // iio threshold events, waited on instead of polling while inputs are static. fd is -1 if not available
+  mod_iio_events_t iio_events;
+  unsigned pedal_decay;
+  const char* pedal_range_file;
+  mod_pedal_range_t pedal_range[2];
+  mod_pedal_map_t pedal_maps[2][2];
+  mod_pedal_map_t* pedal_map[2];
+  // latency instrumentation, enabled if latency_file is set
+  const char* latency_file;
+  unsigned latency_interval;
+  mod_latency_histogram_t latency[latency_count];
+  pthread_t latency_thread;
+  bool latency_thread_running;
+  // telemetry, points to local_stats if shared memory is not available
+  mod_cv_stats_t* stats;
+  mod_cv_stats_t local_stats;
+  // control-rate value feed, NULL if disabled
+  mod_cv_feed_t* feed;
+  mod_cv_feed_notifier_t feed_notifier;
+  // raw input recording and replay, enabled if the trace header is set
+  mod_trace_t trace;
+  replay_t replay;
+  // for knowing whichever exp.pedal mode we are on, ctl is NULL if the switches are not available
+  mod_alsactl_t alsactl;
+  int switchCvExpMode, switchExpPedalMode;
 } spi2jack_t;
 
-static bool _get_alsa_switch_value(snd_mixer_elem_t* const elem)
+static exp_pedal_mode_t get_exp_pedal_mode(const spi2jack_t* const spi2jack)
+{
+    if (! mod_alsactl_get_switch(&spi2jack->alsactl, spi2jack->switchCvExpMode))
+        return exp_pedal_mode_unused;
+
+    return mod_alsactl_get_switch(&spi2jack->alsactl, spi2jack->switchExpPedalMode)
+         ? exp_pedal_mode_port2
+         : exp_pedal_mode_port1;
+}
+
+// set from SIGUSR1, only installed when running standalone
+static volatile sig_atomic_t latency_dump_requested = 0;
+
+static void latency_signal_handler(int sig)
+{
+    latency_dump_requested = 1;
+    return; (void)sig;
+}
+
+static int _get_env_int(const char* const name, const int fallback, const int min, const int max)
 {
-    int val = 0;
-    snd_mixer_selem_get_playback_switch(elem, SND_MIXER_SCHN_MONO, &val);
-    return (val != 0);
+    const char* const value = getenv(name);
+
+    if (value == NULL || value[0] == '\0')
+        return fallback;
+
+    const int ivalue = atoi(value);
+
+    if (ivalue < min)
+        return min;
+    if (ivalue > max)
+        return max;
+
+    return ivalue;
 }
 
-static inline float read_first_raw_spi_value(FILE* const f)
+static inline bool read_raw_spi_value(FILE* const f, int* const raw)
 {
     char buf[64];
+
+    rewind(f);
     memset(buf, 0, sizeof(buf));
 
-    if (fread(buf, sizeof(buf), 1, f) > 0 || feof(f))
+    if ((fread(buf, sizeof(buf), 1, f) > 0 || feof(f)) && buf[0] >= '0' && buf[0] <= '9')
     {
         buf[sizeof(buf)-1] = '\0';
-        return (float)atoi(buf) / MAX_RAW_IIO_VALUE_f;
+        *raw = atoi(buf);
+        return true;
     }
 
-    return 0.0f;
+    return false;
 }
 
-static void* read_spi_thread(void* ptr)
+static inline int clamp_raw_value(const int raw)
 {
-    spi2jack_t* const spi2jack = (spi2jack_t*)ptr;
+    if (raw <= 0)
+        return 0;
+    if (raw >= MAX_RAW_IIO_VALUE)
+        return MAX_RAW_IIO_VALUE;
+    return raw;
+}
 
-    FILE* const in1f = spi2jack->in1f;
-    FILE* const in2f = spi2jack->in2f;
+// initial reading, taken before activating so the first cycles output real values instead of silence.
+// scaled through the calibration tables, same as the reading thread, so its first ramp does not jump
+static void read_first_values(spi2jack_t* const spi2jack)
+{
+    int raw;
 
-    char buf[64];
+    if (spi2jack->in1f != NULL)
+    {
+        if (read_raw_spi_value(spi2jack->in1f, &raw))
+            spi2jack->prevvalue1 = spi2jack->reading.value1 = spi2jack->adc_table[0][clamp_raw_value(raw)];
+        if (read_raw_spi_value(spi2jack->in2f, &raw))
+            spi2jack->prevvalue2 = spi2jack->reading.value2 = spi2jack->adc_table[1][clamp_raw_value(raw)];
+    }
 
-    // first read
-    spi2jack->prevvalue1 = spi2jack->value1 = read_first_raw_spi_value(in1f);
-    spi2jack->prevvalue2 = spi2jack->value2 = read_first_raw_spi_value(in2f);
+    spi2jack->reading.time = jack_get_time();
     spi2jack->ready = true;
+}
 
-    while (spi2jack->run)
+static inline bool any_port_connected(spi2jack_t* const spi2jack)
+{
+    return jack_port_connected(spi2jack->port1) > 0 ||
+           jack_port_connected(spi2jack->port2) > 0 ||
+           jack_port_connected(spi2jack->portPedal) > 0;
+}
+
+static inline void publish_reading(spi2jack_t* const spi2jack, const spi2jack_reading_t* const reading)
+{
+    __atomic_store_n(&spi2jack->read_seq, spi2jack->read_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    spi2jack->reading = *reading;
+
+    __atomic_store_n(&spi2jack->read_seq, spi2jack->read_seq + 1, __ATOMIC_RELEASE);
+}
+
+// returns false if the reader kept writing while we tried, the caller should keep its previous values
+static inline bool load_reading(spi2jack_t* const spi2jack, spi2jack_reading_t* const reading)
+{
+    for (int tries = 0; tries < 4; ++tries)
     {
-        usleep(spi2jack->bufsize_us / 2);
+        const uint32_t seq = __atomic_load_n(&spi2jack->read_seq, __ATOMIC_ACQUIRE);
 
-        rewind(in1f);
-        memset(buf, 0, sizeof(buf));
+        if (seq & 1)
+            continue;
 
-        if (fread(buf, sizeof(buf), 1, in1f) > 0 || feof(in1f))
-        {
-            buf[sizeof(buf)-1] = '\0';
-            spi2jack->value1 = (float)atoi(buf) / MAX_RAW_IIO_VALUE_f * 10.0f;
-        }
+        *reading = spi2jack->reading;
 
-        rewind(in2f);
-        memset(buf, 0, sizeof(buf));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
 
-        if (fread(buf, sizeof(buf), 1, in2f) > 0 || feof(in2f))
-        {
-            buf[sizeof(buf)-1] = '\0';
-            spi2jack->value2 = (float)atoi(buf) / MAX_RAW_IIO_VALUE_f * 10.0f;
-        }
+        if (__atomic_load_n(&spi2jack->read_seq, __ATOMIC_RELAXED) == seq)
+            return true;
+    }
 
-        // handle mixer changes
-        if (spi2jack->mixer != NULL)
-        {
-            snd_mixer_handle_events(spi2jack->mixer);
+    return false;
+}
 
-            if (_get_alsa_switch_value(spi2jack->mixerCvExpMode))
-            {
-                if (_get_alsa_switch_value(spi2jack->mixerExpPedalMode))
-                    spi2jack->exp_pedal_mode = exp_pedal_mode_port2;
-                else
-                    spi2jack->exp_pedal_mode = exp_pedal_mode_port1;
-            }
-            else
-            {
-                spi2jack->exp_pedal_mode = exp_pedal_mode_unused;
-            }
+// returns false if full, the reading is dropped then
+static inline bool ring_push(reading_ring_t* const ring, const spi2jack_reading_t* const reading)
+{
+    const uint32_t head = ring->head;
 
-            usleep(spi2jack->bufsize_us / 4);
-        }
-        else
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RESAMPLE_RING_SIZE)
+        return false;
+
+    ring->items[head & (RESAMPLE_RING_SIZE - 1)] = *reading;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static inline const spi2jack_reading_t* ring_at(const reading_ring_t* const ring, const uint32_t pos)
+{
+    return &ring->items[pos & (RESAMPLE_RING_SIZE - 1)];
+}
+
+// returns false if full, the edge is dropped then
+static inline bool edge_push(edge_ring_t* const ring, const gate_edge_t* const edge)
+{
+    const uint32_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= GATE_RING_SIZE)
+        return false;
+
+    ring->items[head & (GATE_RING_SIZE - 1)] = *edge;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static inline const gate_edge_t* edge_at(const edge_ring_t* const ring, const uint32_t pos)
+{
+    return &ring->items[pos & (GATE_RING_SIZE - 1)];
+}
+
+static inline bool gate_output_connected(spi2jack_t* const spi2jack)
+{
+    if (! spi2jack->gate_enabled)
+        return false;
+
+    // gate and midi ports are optional, NULL if not registered
+    jack_port_t* const gate1 = spi2jack->portGate1;
+    jack_port_t* const gate2 = spi2jack->portGate2;
+    jack_port_t* const midi  = spi2jack->portMidi;
+
+    if ((gate1 != NULL && jack_port_connected(gate1) > 0) || (gate2 != NULL && jack_port_connected(gate2) > 0))
+        return true;
+
+    return midi != NULL && (spi2jack->gate_note[0] >= 0 || spi2jack->gate_note[1] >= 0) &&
+           jack_port_connected(midi) > 0;
+}
+
+// queues an edge when the value crosses the threshold for the opposite state
+static void gate_update(spi2jack_t* const spi2jack, gate_detector_t* const gate, const uint8_t channel,
+                        const float value, const jack_time_t time)
+{
+    const float threshold = gate->high ? spi2jack->gate_low_volts : spi2jack->gate_high_volts;
+
+    if (gate->high ? value < threshold : value > threshold)
+    {
+        gate_edge_t edge = { time, channel, !gate->high };
+
+        // gates are mostly steps, which could have happened anywhere since the previous reading
+        if (gate->time != 0 && time > gate->time)
+            edge.time = gate->time + (time - gate->time) / 2;
+
+        gate->high = !gate->high;
+        edge_push(&spi2jack->edges, &edge);
+    }
+
+    gate->time = time;
+}
+
+// returns the filtered time for a reading taken at time, restarting if the nominal period changed or after a stall
+static double adc_dll_update(adc_dll_t* const dll, const double time, const double nominal)
+{
+    if (! dll->running || dll->nominal != nominal || fabs(time - dll->t1) > nominal * 10.0)
+    {
+        const double omega = 2.0 * M_PI * RESAMPLE_DLL_BANDWIDTH * nominal / 1000000.0;
+
+        dll->b = sqrt(2.0) * omega;
+        dll->c = omega * omega;
+        dll->nominal = nominal;
+        dll->period = nominal;
+        dll->t0 = time;
+        dll->t1 = time + nominal;
+        dll->running = true;
+        return time;
+    }
+
+    const double error = time - dll->t1;
+
+    dll->t0 = dll->t1;
+    dll->t1 += dll->b * error + dll->period;
+    dll->period += dll->c * error;
+    return dll->t0;
+}
+
+// feeds a new reading into the tracker, returns the smoothed value.
+// turns itself off while residuals are above the noise threshold, back on below half of it.
+static float predictor_update(predictor_t* const predictor, const float value, const jack_time_t time,
+                              const float noise_threshold)
+{
+    if (predictor->time == 0 || time <= predictor->time)
+    {
+        predictor->value = value;
+        predictor->slope = 0.0f;
+        predictor->time  = time;
+        return value;
+    }
+
+    const float dt = (float)(time - predictor->time);
+    const float predicted = predictor->value + predictor->slope * dt;
+    const float residual = value - predicted;
+
+    predictor->value = predicted + PREDICT_ALPHA * residual;
+    predictor->slope += PREDICT_BETA * residual / dt;
+    predictor->noise += PREDICT_NOISE_WEIGHT * (residual * residual - predictor->noise);
+    predictor->time = time;
+
+    if (predictor->active && predictor->noise > noise_threshold)
+        predictor->active = false;
+    else if (!predictor->active && predictor->noise < noise_threshold * 0.25f)
+        predictor->active = true;
+
+    return predictor->active ? predictor->value : value;
+}
+
+// applies trace entries up to the replay time, starting over at the end if looping
+static void replay_advance(replay_t* const replay, const uint64_t elapsed)
+{
+    const uint64_t count = mod_trace_count(&replay->trace);
+
+    if (count == 0)
+        return;
+
+    const uint64_t first = mod_trace_at(&replay->trace, 0)->time;
+
+    while (elapsed >= replay->loop_start)
+    {
+        const uint64_t target = first + (elapsed - replay->loop_start);
+
+        for (; replay->pos < count; ++replay->pos)
         {
-            usleep(spi2jack->bufsize_us / 2);
+            const mod_trace_entry_t* const entry = mod_trace_at(&replay->trace, replay->pos);
+
+            if (entry->time > target)
+                return;
+            if (entry->channel < 2)
+                replay->raw[entry->channel] = entry->raw;
         }
-    }
 
-    return NULL;
+        if (! replay->loop)
+            return;
+
+        const uint64_t duration = mod_trace_at(&replay->trace, count - 1)->time - first;
+
+        replay->loop_start += duration > REPLAY_MIN_DURATION_US ? duration : REPLAY_MIN_DURATION_US;
+        replay->pos = 0;
+    }
 }
 
-static int buffer_size_callback(jack_nframes_t bufsize, void* arg)
+static inline bool read_input(spi2jack_t* const spi2jack, FILE* const f, const int channel, int* const raw)
 {
-    spi2jack_t* const spi2jack = (spi2jack_t*)arg;
+    if (spi2jack->replay.trace.header == NULL)
+        return read_raw_spi_value(f, raw);
 
-    spi2jack->bufsize_us = (double)bufsize / (double)jack_get_sample_rate(spi2jack->client) * 1000000.0;
-    spi2jack->bufsize_log = logf((float)bufsize);
-    return 0;
+    if (spi2jack->replay.raw[channel] < 0)
+        return false;
+
+    *raw = spi2jack->replay.raw[channel];
+    return true;
 }
 
-/* python3
- import math
- for i in range(128):
-     print("    %ff," % math.log(i+1))
-*/
-static float logfs[128] = {
-    0.000000f,
-    0.693147f,
-    1.098612f,
-    1.386294f,
-    1.609438f,
-    1.791759f,
-    1.945910f,
-    2.079442f,
-    2.197225f,
-    2.302585f,
-    2.397895f,
-    2.484907f,
-    2.564949f,
-    2.639057f,
-    2.708050f,
-    2.772589f,
-    2.833213f,
-    2.890372f,
-    2.944439f,
-    2.995732f,
-    3.044522f,
-    3.091042f,
-    3.135494f,
-    3.178054f,
-    3.218876f,
-    3.258097f,
-    3.295837f,
-    3.332205f,
-    3.367296f,
-    3.401197f,
-    3.433987f,
-    3.465736f,
-    3.496508f,
-    3.526361f,
-    3.555348f,
-    3.583519f,
-    3.610918f,
-    3.637586f,
-    3.663562f,
-    3.688879f,
-    3.713572f,
-    3.737670f,
-    3.761200f,
-    3.784190f,
-    3.806662f,
-    3.828641f,
-    3.850148f,
-    3.871201f,
-    3.891820f,
-    3.912023f,
-    3.931826f,
-    3.951244f,
-    3.970292f,
-    3.988984f,
-    4.007333f,
-    4.025352f,
-    4.043051f,
-    4.060443f,
-    4.077537f,
-    4.094345f,
-    4.110874f,
-    4.127134f,
-    4.143135f,
-    4.158883f,
-    4.174387f,
-    4.189655f,
-    4.204693f,
-    4.219508f,
-    4.234107f,
-    4.248495f,
-    4.262680f,
-    4.276666f,
-    4.290459f,
-    4.304065f,
-    4.317488f,
-    4.330733f,
-    4.343805f,
-    4.356709f,
-    4.369448f,
-    4.382027f,
-    4.394449f,
-    4.406719f,
-    4.418841f,
-    4.430817f,
-    4.442651f,
-    4.454347f,
-    4.465908f,
-    4.477337f,
-    4.488636f,
-    4.499810f,
-    4.510860f,
-    4.521789f,
-    4.532599f,
-    4.543295f,
-    4.553877f,
-    4.564348f,
-    4.574711f,
-    4.584967f,
-    4.595120f,
-    4.605170f,
-    4.615121f,
-    4.624973f,
-    4.634729f,
-    4.644391f,
-    4.653960f,
-    4.663439f,
-    4.672829f,
-    4.682131f,
-    4.691348f,
-    4.700480f,
-    4.709530f,
-    4.718499f,
-    4.727388f,
-    4.736198f,
-    4.744932f,
-    4.753590f,
-    4.762174f,
-    4.770685f,
-    4.779123f,
-    4.787492f,
-    4.795791f,
-    4.804021f,
-    4.812184f,
-    4.820282f,
-    4.828314f,
-    4.836282f,
-    4.844187f,
-    4.852030f
-};
+// rebuilds the exp.pedal map of an input into the buffer not in use, then swaps it in
+static void pedal_rebuild_map(spi2jack_t* const spi2jack, const int channel)
+{
+    mod_pedal_map_t* const current = __atomic_load_n(&spi2jack->pedal_map[channel], __ATOMIC_ACQUIRE);
+    mod_pedal_map_t* const next = current == &spi2jack->pedal_maps[channel][0] ? &spi2jack->pedal_maps[channel][1]
+                                                                               : &spi2jack->pedal_maps[channel][0];
 
-static inline
-float calculate_jack_value_for_128_bufsize(float value, float prevvalue, jack_nframes_t i)
+    mod_pedal_build_map(next, &spi2jack->pedal_range[channel], spi2jack->pedal_curve, spi2jack->pedal_span);
+    __atomic_store_n(&spi2jack->pedal_map[channel], next, __ATOMIC_RELEASE);
+}
+
+static bool pedal_range_moved(const mod_pedal_range_t* const range, const mod_pedal_range_t* const saved)
 {
-    const float multiplier = logfs[i] / 4.852030f;
-    return value * multiplier + prevvalue * (1.0f - multiplier);
+    return fabsf(range->min - saved->min) > PEDAL_SAVE_THRESHOLD || fabsf(range->max - saved->max) > PEDAL_SAVE_THRESHOLD;
 }
 
-static inline
-float calculate_jack_value(float value, float prevvalue, jack_nframes_t i, float bufsizelog)
+// sleeps until an input moves out of the deadband around its last change, or the timeout passes.
+// returns false if events cannot be armed, polling should be used then.
+static bool wait_iio_events(spi2jack_t* const spi2jack, const int lastraw1, const int lastraw2,
+                            const int deadband, const int timeout_ms)
 {
-    const float multiplier = logf((float)(i+1)) / bufsizelog;
-    return value * multiplier + prevvalue * (1.0f - multiplier);
+    mod_iio_events_t* const events = &spi2jack->iio_events;
+    const int window = deadband > 0 ? deadband : 1;
+
+    if (! mod_iio_events_arm(events, 0, lastraw1, window, MAX_RAW_IIO_VALUE) ||
+        ! mod_iio_events_arm(events, 1, lastraw2, window, MAX_RAW_IIO_VALUE))
+        return false;
+
+    mod_iio_events_drain(events);
+
+    // a change between the last reading and arming would not fire, check once more
+    int raw;
+
+    if (read_raw_spi_value(spi2jack->in1f, &raw) && abs(clamp_raw_value(raw) - lastraw1) > deadband)
+        return true;
+    if (read_raw_spi_value(spi2jack->in2f, &raw) && abs(clamp_raw_value(raw) - lastraw2) > deadband)
+        return true;
+
+    mod_iio_events_wait(events, mod_alsactl_poll_fd(&spi2jack->alsactl), timeout_ms);
+    return true;
 }
 
-static int process_callback(jack_nframes_t nframes, void* arg)
+static void* read_spi_thread(void* ptr)
 {
-    spi2jack_t* const spi2jack = (spi2jack_t*)arg;
+    spi2jack_t* const spi2jack = (spi2jack_t*)ptr;
 
-    float* const port1buf = jack_port_get_buffer(spi2jack->port1, nframes);
-    float* const port2buf = jack_port_get_buffer(spi2jack->port2, nframes);
-    float* const portPbuf = jack_port_get_buffer(spi2jack->portPedal, nframes);
+    FILE* const in1f = spi2jack->in1f;
+    FILE* const in2f = spi2jack->in2f;
 
-    if (spi2jack->ready)
-    {
-        const float value1     = spi2jack->value1;
-        const float value2     = spi2jack->value2;
-        const float prevvalue1 = spi2jack->prevvalue1;
-        const float prevvalue2 = spi2jack->prevvalue2;
-        spi2jack->prevvalue1   = value1;
-        spi2jack->prevvalue2   = value2;
+    mod_cv_stats_t* const stats = spi2jack->stats;
+
+    // tunables, refreshed every loop. the control socket is not up yet, so the initial copy is safe
+    spi2jack_params_t params = spi2jack->params;
+    uint32_t params_seq = MOD_CONTROL_SEQ_NONE;
+    int deadband = 0;
+    unsigned slow_us = 0;
+    float predict_noise = 0.0f;
+    bool predict = false, resample = false;
+
+    adc_dll_t dll;
+    memset(&dll, 0, sizeof(dll));
+    predictor_t predictor1, predictor2;
+    memset(&predictor1, 0, sizeof(predictor1));
+    memset(&predictor2, 0, sizeof(predictor2));
+    gate_detector_t gate1, gate2;
+    memset(&gate1, 0, sizeof(gate1));
+    memset(&gate2, 0, sizeof(gate2));
+
+    float value1 = spi2jack->reading.value1, value2 = spi2jack->reading.value2;
+    int raw, raw1 = 0, raw2 = 0, lastraw1 = -1, lastraw2 = -1;
+    exp_pedal_mode_t lastmode = spi2jack->exp_pedal_mode;
+    unsigned interval_us = 0;
+    bool changed;
+
+    unsigned wakeups = 0;
+    struct timespec stats_start, now;
+    clock_gettime(CLOCK_MONOTONIC, &stats_start);
+
+    mod_latency_histogram_t* const latency_read = &spi2jack->latency[latency_adc_read];
+    uint64_t read_start = 0;
+    uint64_t feed_last_service = 0;
+
+    // exp.pedal range learning, ranges are saved once they moved far enough from the saved ones
+    bool pedal_dirty[2] = { false, false };
+    mod_pedal_range_t pedal_saved[2];
+    memcpy(pedal_saved, spi2jack->pedal_range, sizeof(pedal_saved));
+    uint64_t pedal_last_update = 0, pedal_last_save = 0;
+
+    replay_t* const replay = spi2jack->replay.trace.header != NULL ? &spi2jack->replay : NULL;
+    mod_trace_t* const trace = spi2jack->trace.header != NULL ? &spi2jack->trace : NULL;
+    // replay time advances with the clock, or one period per cycle in fast mode and while freewheeling
+    uint64_t replay_elapsed = 0;
+    jack_time_t replay_last_time = jack_get_time();
+    uint64_t replay_last_cycle = stats->cycles;
+
+    // other periodic work limits how long threshold events can be waited on
+    const int event_timeout_ms = spi2jack->feed != NULL ? FEED_SERVICE_INTERVAL_MS
+                               : spi2jack->pedal_learn ? PEDAL_UPDATE_INTERVAL_MS
+                               : IIO_EVENT_TIMEOUT_MS;
 
-        switch (spi2jack->exp_pedal_mode)
+    while (spi2jack->run)
+    {
+        if (mod_control_load(&spi2jack->control, &params_seq, &params))
         {
-        case exp_pedal_mode_port1:
-        case exp_pedal_mode_port2:
-            // cv1
-            memset(port1buf, 0, sizeof(float)*nframes);
+            const bool wasresample = resample;
 
-            // cv2
-            memset(port2buf, 0, sizeof(float)*nframes);
+            deadband = params.poll_deadband;
+            slow_us = 1000000u / (unsigned)params.poll_min_rate;
+            predict_noise = (float)params.predict_noise / 1000.0f;
+            predict_noise *= predict_noise;
+            predict = params.timing_mode == timing_mode_predict;
+            resample = params.timing_mode == timing_mode_resample;
 
-            // exp.pedal
-            if (jack_port_connected(spi2jack->portPedal) > 0)
+            // trackers start over when switching modes
+            if (! predict)
             {
-                const float epedalmult = spi2jack->port_values_are_prescaled ? 1.0f : 0.5f;
+                memset(&predictor1, 0, sizeof(predictor1));
+                memset(&predictor2, 0, sizeof(predictor2));
+            }
 
-                float valueexp, prevvalueexp;
+            if (resample && ! wasresample)
+                memset(&dll, 0, sizeof(dll));
+        }
 
-                if (spi2jack->exp_pedal_mode == exp_pedal_mode_port1)
-                {
-                    valueexp = value1;
-                    prevvalueexp = prevvalue1;
-                }
-                else
-                {
-                    valueexp = value2;
-                    prevvalueexp = prevvalue2;
-                }
+        const unsigned fast_us = spi2jack->bufsize_us / (unsigned)params.poll_divisor;
 
-                if (nframes == 128)
-                {
-                    for (jack_nframes_t i=0; i<nframes; ++i)
-                        portPbuf[i] = calculate_jack_value_for_128_bufsize(valueexp, prevvalueexp, i) * epedalmult;
-                }
-                else
-                {
-                    const float bufsizelog = spi2jack->bufsize_log;
+        if (interval_us < fast_us)
+            interval_us = fast_us;
 
-                    for (jack_nframes_t i=0; i<nframes; ++i)
-                        portPbuf[i] = calculate_jack_value(valueexp, prevvalueexp, i, bufsizelog) * epedalmult;
-                }
-            }
-            else
+        const bool follow_cycles = replay != NULL && (replay->fast || spi2jack->freewheeling);
+
+        // once inputs are static and polling is at its floor, sleep until the driver reports a change
+        const bool use_events = spi2jack->iio_events.fd >= 0 && interval_us >= slow_us && lastraw1 >= 0 &&
+                                lastraw2 >= 0 && ! resample && ! gate_output_connected(spi2jack);
+
+        if (follow_cycles)
+            sem_timedwait_secs(&replay->sem, 1);
+        else if (! use_events || ! wait_iio_events(spi2jack, lastraw1, lastraw2, deadband, event_timeout_ms))
+            usleep(interval_us);
+
+        if (replay != NULL)
+        {
+            const jack_time_t time = jack_get_time();
+            const uint64_t cycles = __atomic_load_n(&stats->cycles, __ATOMIC_RELAXED);
+
+            replay_elapsed += follow_cycles ? (cycles - replay_last_cycle) * spi2jack->bufsize_us
+                                            : time - replay_last_time;
+            replay_last_time = time;
+            replay_last_cycle = cycles;
+
+            replay_advance(replay, replay_elapsed);
+        }
+
+        ++wakeups;
+        changed = false;
+
+        if (spi2jack->latency_file != NULL)
+            read_start = mod_latency_now_ns();
+
+        if (read_input(spi2jack, in1f, 0, &raw))
+        {
+            mod_cv_stats_increment(&stats->reads);
+            raw1 = raw = clamp_raw_value(raw);
+
+            if (trace != NULL)
+                mod_trace_append(trace, jack_get_time(), (uint32_t)__atomic_load_n(&stats->cycles, __ATOMIC_RELAXED),
+                                 0, (uint16_t)raw);
+            value1 = spi2jack->adc_table[0][raw];
+
+            if (abs(raw - lastraw1) > deadband)
             {
-                memset(portPbuf, 0, sizeof(float)*nframes);
+                lastraw1 = raw;
+                changed = true;
             }
-            break;
+        }
+        else
+        {
+            mod_cv_stats_increment(&stats->parse_failures);
+        }
 
-        default:
-            // cv1
-            if (jack_port_connected(spi2jack->port1) > 0)
-            {
-                if (nframes == 128)
-                {
-                    for (jack_nframes_t i=0; i<nframes; ++i)
-                        port1buf[i] = calculate_jack_value_for_128_bufsize(value1, prevvalue1, i);
-                }
-                else
-                {
-                    const float bufsizelog = spi2jack->bufsize_log;
+        if (read_input(spi2jack, in2f, 1, &raw))
+        {
+            mod_cv_stats_increment(&stats->reads);
+            raw2 = raw = clamp_raw_value(raw);
 
-                    for (jack_nframes_t i=0; i<nframes; ++i)
-                        port1buf[i] = calculate_jack_value(value1, prevvalue1, i, bufsizelog);
-                }
+            if (trace != NULL)
+                mod_trace_append(trace, jack_get_time(), (uint32_t)__atomic_load_n(&stats->cycles, __ATOMIC_RELAXED),
+                                 1, (uint16_t)raw);
+            value2 = spi2jack->adc_table[1][raw];
+
+            if (abs(raw - lastraw2) > deadband)
+            {
+                lastraw2 = raw;
+                changed = true;
             }
-            else
+        }
+        else
+        {
+            mod_cv_stats_increment(&stats->parse_failures);
+        }
+
+        const jack_time_t read_time = jack_get_time();
+        spi2jack_reading_t reading = { value1, value2, 0.0f, 0.0f, read_time };
+
+        if (spi2jack->gate_enabled)
+        {
+            gate_update(spi2jack, &gate1, 0, value1, read_time);
+            gate_update(spi2jack, &gate2, 1, value2, read_time);
+        }
+
+        if (predict)
+        {
+            reading.value1 = predictor_update(&predictor1, value1, reading.time, predict_noise);
+            reading.value2 = predictor_update(&predictor2, value2, reading.time, predict_noise);
+            reading.slope1 = predictor1.active ? predictor1.slope : 0.0f;
+            reading.slope2 = predictor2.active ? predictor2.slope : 0.0f;
+        }
+
+        if (resample)
+        {
+            reading.time = (jack_time_t)adc_dll_update(&dll, (double)reading.time, (double)fast_us);
+            spi2jack->adc_period_usecs = (float)dll.period;
+            ring_push(&spi2jack->ring, &reading);
+        }
+
+        publish_reading(spi2jack, &reading);
+
+        if (spi2jack->latency_file != NULL)
+            mod_latency_record(latency_read, mod_latency_now_ns() - read_start);
+
+        // handle mixer changes, only watched switches trigger a value read
+        if (mod_alsactl_handle_events(&spi2jack->alsactl))
+        {
+            spi2jack->exp_pedal_mode = get_exp_pedal_mode(spi2jack);
+
+            if (spi2jack->exp_pedal_mode != lastmode)
             {
-                memset(port1buf, 0, sizeof(float)*nframes);
+                lastmode = spi2jack->exp_pedal_mode;
+                mod_cv_stats_set(&stats->mode, (uint32_t)lastmode);
+                changed = true;
             }
+        }
 
-            // cv2
-            if (jack_port_connected(spi2jack->port2) > 0)
+        // only the input in exp.pedal mode has a pedal connected
+        const exp_pedal_mode_t pedal_mode = spi2jack->exp_pedal_mode;
+        const int pedal_channel = pedal_mode == exp_pedal_mode_port1 ? 0 : pedal_mode == exp_pedal_mode_port2 ? 1 : -1;
+
+        if (spi2jack->pedal_learn && pedal_channel >= 0 &&
+            mod_pedal_range_update(&spi2jack->pedal_range[pedal_channel], pedal_channel == 0 ? value1 : value2))
+            pedal_dirty[pedal_channel] = true;
+
+        // control-rate feed, only on changes
+        if (spi2jack->feed != NULL && (changed || spi2jack->feed->head == 0))
+        {
+            const mod_cv_feed_entry_t entry = {
+                0, read_time, { value1, value2 }, { (uint16_t)raw1, (uint16_t)raw2 }, (uint32_t)lastmode, 0
+            };
+            mod_cv_feed_publish(spi2jack->feed, &entry);
+            mod_cv_feed_notify(&spi2jack->feed_notifier);
+        }
+
+        // go back to full rate on the first change, otherwise back off until reaching the floor.
+        // resampling needs a steady rate for tracking the reading period, gates for catching edges in time.
+        if (resample || (changed && any_port_connected(spi2jack)) || gate_output_connected(spi2jack))
+            interval_us = fast_us;
+        else if (interval_us < slow_us)
+            interval_us = interval_us * 2 + 1 < slow_us ? interval_us * 2 + 1 : slow_us;
+
+        // instrumentation
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        const uint64_t now_ms = (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+
+        if (spi2jack->feed != NULL && now_ms - feed_last_service >= FEED_SERVICE_INTERVAL_MS)
+        {
+            feed_last_service = now_ms;
+            mod_cv_feed_notifier_service(&spi2jack->feed_notifier);
+        }
+
+        if (spi2jack->pedal_learn && now_ms - pedal_last_update >= PEDAL_UPDATE_INTERVAL_MS)
+        {
+            pedal_last_update = now_ms;
+
+            if (pedal_channel >= 0 && spi2jack->pedal_decay != 0 &&
+                mod_pedal_range_decay(&spi2jack->pedal_range[pedal_channel],
+                                      (float)PEDAL_UPDATE_INTERVAL_MS / (1000.0f * (float)spi2jack->pedal_decay)))
+                pedal_dirty[pedal_channel] = true;
+
+            for (int c = 0; c < 2; ++c)
             {
-                if (nframes == 128)
+                if (pedal_dirty[c])
                 {
-                    for (jack_nframes_t i=0; i<nframes; ++i)
-                        port2buf[i] = calculate_jack_value_for_128_bufsize(value2, prevvalue2, i);
+                    pedal_dirty[c] = false;
+                    pedal_rebuild_map(spi2jack, c);
                 }
+            }
+
+            if (spi2jack->pedal_range_file != NULL && now_ms - pedal_last_save >= PEDAL_SAVE_INTERVAL * 1000 &&
+                (pedal_range_moved(&spi2jack->pedal_range[0], &pedal_saved[0]) ||
+                 pedal_range_moved(&spi2jack->pedal_range[1], &pedal_saved[1])))
+            {
+                pedal_last_save = now_ms;
+
+                if (mod_pedal_save(spi2jack->pedal_range_file, spi2jack->pedal_range))
+                    memcpy(pedal_saved, spi2jack->pedal_range, sizeof(pedal_saved));
                 else
-                {
-                    const float bufsizelog = spi2jack->bufsize_log;
+                    fprintf(stderr, "Cannot write pedal range file '%s'\n", spi2jack->pedal_range_file);
+            }
+        }
+
+        if (now.tv_sec - stats_start.tv_sec >= POLL_STATS_INTERVAL)
+        {
+            const double elapsed = (double)(now.tv_sec - stats_start.tv_sec)
+                                 + (double)(now.tv_nsec - stats_start.tv_nsec) / 1000000000.0;
+            spi2jack->poll_wakeups_per_sec = (float)((double)wakeups / elapsed);
+            mod_cv_stats_set(&stats->wakeups_per_sec, (uint32_t)(spi2jack->poll_wakeups_per_sec + 0.5f));
+
+            if (spi2jack->poll_stats)
+            {
+                fprintf(stdout, "spi2jack: %.1f wakeups per second\n", spi2jack->poll_wakeups_per_sec);
+
+                if (resample)
+                    fprintf(stdout, "spi2jack: reading period %.3f frames\n",
+                            spi2jack->adc_period_usecs * (float)jack_get_sample_rate(spi2jack->client) / 1000000.0f);
+            }
+
+            wakeups = 0;
+            stats_start = now;
+        }
+    }
+
+    return NULL;
+}
+
+// latency histograms are dumped from here, file writes never happen on the realtime reading thread
+static void* latency_thread(void* ptr)
+{
+    spi2jack_t* const spi2jack = (spi2jack_t*)ptr;
+
+    time_t last_dump = time(NULL);
+
+    while (spi2jack->run)
+    {
+        usleep(LATENCY_CHECK_INTERVAL_MS * 1000);
+
+        const time_t now = time(NULL);
+
+        if (latency_dump_requested ||
+            (spi2jack->latency_interval != 0 && now - last_dump >= spi2jack->latency_interval))
+        {
+            latency_dump_requested = 0;
+            last_dump = now;
+            mod_latency_dump_all(spi2jack->latency_file, "spi2jack", spi2jack->latency, latency_count);
+        }
+    }
+
+    return NULL;
+}
+
+static int buffer_size_callback(jack_nframes_t bufsize, void* arg)
+{
+    spi2jack_t* const spi2jack = (spi2jack_t*)arg;
+
+    spi2jack->bufsize_us = (double)bufsize / (double)jack_get_sample_rate(spi2jack->client) * 1000000.0;
+    __atomic_store_n(&spi2jack->ramp_kernel, mod_kernels_get_ramp(bufsize), __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int xrun_callback(void* arg)
+{
+    spi2jack_t* const spi2jack = (spi2jack_t*)arg;
+
+    __atomic_store_n(&spi2jack->resync, true, __ATOMIC_RELEASE);
+    mod_cv_stats_increment(&spi2jack->stats->xruns);
+    return 0;
+}
+
+static void freewheel_callback(int starting, void* arg)
+{
+    spi2jack_t* const spi2jack = (spi2jack_t*)arg;
+
+    spi2jack->freewheeling = starting != 0;
+    mod_cv_stats_set(&spi2jack->stats->freewheeling, starting ? 1 : 0);
+
+    if (starting)
+        mod_cv_stats_increment(&spi2jack->stats->freewheels);
+    else
+        __atomic_store_n(&spi2jack->resync, true, __ATOMIC_RELEASE);
+}
+
+// frame range of the current period where the signal moves from the previous to the latest reading
+typedef struct {
+  bool enabled;
+  float start, end;
+  // resampling, time of the first frame, frame duration and queued readings to use
+  bool resample;
+  jack_time_t window_start;
+  float frame_usecs;
+  uint32_t tail, head;
+} placement_t;
+
+// captured buffers cover the period before the current cycle, same as audio capture.
+// the transition ends at the frame matching the reading time, and lasts at most one period.
+static void calculate_placement(spi2jack_t* const spi2jack, const jack_nframes_t nframes,
+                                const jack_time_t time, const jack_time_t prevtime, placement_t* const placement)
+{
+    jack_nframes_t current_frames;
+    jack_time_t current_usecs, next_usecs;
+    float period_usecs;
+
+    placement->enabled = false;
+
+    if (time == 0 || prevtime == 0)
+        return;
+    if (jack_get_cycle_times(spi2jack->client, &current_frames, &current_usecs, &next_usecs, &period_usecs) != 0)
+        return;
+    if (period_usecs <= 0.0f)
+        return;
+
+    const jack_time_t window_start = current_usecs - (jack_time_t)period_usecs;
+    const jack_time_t span_start = time - prevtime > (jack_time_t)period_usecs ? time - (jack_time_t)period_usecs
+                                                                               : prevtime;
+    const float frames_per_usec = (float)nframes / period_usecs;
+
+    float start = (float)((int64_t)span_start - (int64_t)window_start) * frames_per_usec;
+    float end   = (float)((int64_t)time - (int64_t)window_start) * frames_per_usec;
+
+    if (start < 0.0f)
+        start = 0.0f;
+    if (end < start)
+        end = start;
+    if (end > (float)nframes)
+        end = (float)nframes;
+    if (start > end)
+        start = end;
+
+    placement->enabled = true;
+    placement->start = start;
+    placement->end = end;
+}
+
+// extrapolates a reading to the end of the current period, clamped to the input range
+static float predict_value(spi2jack_t* const spi2jack, const float value, const float slope, const jack_time_t time)
+{
+    jack_nframes_t current_frames;
+    jack_time_t current_usecs, next_usecs;
+    float period_usecs, predicted = value;
+
+    if (slope != 0.0f && time != 0 &&
+        jack_get_cycle_times(spi2jack->client, &current_frames, &current_usecs, &next_usecs, &period_usecs) == 0 &&
+        next_usecs > time)
+    {
+        const jack_time_t horizon = next_usecs - time;
+        predicted += slope * (float)(horizon < PREDICT_MAX_HORIZON_US ? horizon : PREDICT_MAX_HORIZON_US);
+    }
+
+    if (predicted < 0.0f)
+        return 0.0f;
+    if (predicted > MOD_CALIBRATION_MAX_VOLTS)
+        return MOD_CALIBRATION_MAX_VOLTS;
+    return predicted;
+}
+
+static inline
+void render_placed(float* const buf, const jack_nframes_t nframes, const float value, const float prevvalue,
+                   const placement_t* const placement, const float mult)
+{
+    const jack_nframes_t istart = (jack_nframes_t)ceilf(placement->start);
+    const jack_nframes_t iend   = (jack_nframes_t)ceilf(placement->end);
+    const float step = iend > istart ? (value - prevvalue) / (placement->end - placement->start) : 0.0f;
+
+    jack_nframes_t i = 0;
+
+    for (; i < istart && i < nframes; ++i)
+        buf[i] = prevvalue * mult;
+
+    for (; i < iend && i < nframes; ++i)
+        buf[i] = (prevvalue + step * ((float)i - placement->start)) * mult;
+
+    for (; i < nframes; ++i)
+        buf[i] = value * mult;
+}
+
+// captured buffers cover the period before the current cycle, delayed by one reading period
+// so that every frame falls between two queued readings.
+static void calculate_resample_window(spi2jack_t* const spi2jack, const jack_nframes_t nframes,
+                                      placement_t* const placement)
+{
+    jack_nframes_t current_frames;
+    jack_time_t current_usecs, next_usecs;
+    float period_usecs;
+
+    placement->resample = false;
+
+    if (jack_get_cycle_times(spi2jack->client, &current_frames, &current_usecs, &next_usecs, &period_usecs) != 0)
+        return;
+    if (period_usecs <= 0.0f)
+        return;
+
+    const jack_time_t delay = (jack_time_t)period_usecs + (jack_time_t)spi2jack->adc_period_usecs;
+
+    if (current_usecs <= delay)
+        return;
+
+    placement->resample     = true;
+    placement->window_start = current_usecs - delay;
+    placement->frame_usecs  = period_usecs / (float)nframes;
+    placement->tail         = spi2jack->ring.tail;
+    placement->head         = __atomic_load_n(&spi2jack->ring.head, __ATOMIC_ACQUIRE);
+}
+
+static inline float reading_value(const spi2jack_reading_t* const reading, const int channel)
+{
+    return channel == 0 ? reading->value1 : reading->value2;
+}
+
+// interpolates queued readings at the time of each frame, without consuming them
+static void render_resampled(spi2jack_t* const spi2jack, float* const buf, const jack_nframes_t nframes,
+                             const int channel, const placement_t* const placement, const float mult)
+{
+    const reading_ring_t* const ring = &spi2jack->ring;
+    const spi2jack_reading_t* prev = &spi2jack->resample_last;
+    uint32_t pos = placement->tail;
+
+    // current segment, as value at prev->time plus slope per usec, zero slope holds the value
+    double segment_start = (double)prev->time;
+    float segment_value = reading_value(prev, channel);
+    float segment_slope = 0.0f;
+    bool segment_dirty = true;
+
+    for (jack_nframes_t i=0; i<nframes; ++i)
+    {
+        const double time = (double)placement->window_start + (double)placement->frame_usecs * (double)i;
+
+        while (pos != placement->head && (double)ring_at(ring, pos)->time <= time)
+        {
+            prev = ring_at(ring, pos++);
+            segment_dirty = true;
+        }
+
+        if (segment_dirty)
+        {
+            segment_dirty = false;
+            segment_start = (double)prev->time;
+            segment_value = reading_value(prev, channel);
+            segment_slope = 0.0f;
+
+            if (pos != placement->head && prev->time != 0)
+            {
+                const spi2jack_reading_t* const next = ring_at(ring, pos);
+                segment_slope = (reading_value(next, channel) - segment_value) / (float)(next->time - prev->time);
+            }
+        }
+
+        buf[i] = (segment_value + segment_slope * (float)(time - segment_start)) * mult;
+    }
+}
+
+// drops every queued reading, keeping the latest one for holding
+static void drop_resampled(spi2jack_t* const spi2jack)
+{
+    reading_ring_t* const ring = &spi2jack->ring;
+    const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head == ring->tail)
+        return;
+
+    spi2jack->resample_last = *ring_at(ring, head - 1);
+    __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+}
+
+// consumes readings up to the last frame of the window, keeping the latest one for the next cycle
+static void consume_resampled(spi2jack_t* const spi2jack, const jack_nframes_t nframes,
+                              const placement_t* const placement)
+{
+    reading_ring_t* const ring = &spi2jack->ring;
+    const double last = (double)placement->window_start + (double)placement->frame_usecs * (double)(nframes - 1);
+    uint32_t pos = placement->tail;
+
+    while (pos != placement->head && (double)ring_at(ring, pos)->time <= last)
+        spi2jack->resample_last = *ring_at(ring, pos++);
+
+    __atomic_store_n(&ring->tail, pos, __ATOMIC_RELEASE);
+}
+
+static inline
+void render_cv(spi2jack_t* const spi2jack, float* const buf, const jack_nframes_t nframes, const int channel,
+               const float value, const float prevvalue, const placement_t* const placement, const float mult)
+{
+    if (placement->resample)
+    {
+        render_resampled(spi2jack, buf, nframes, channel, placement, mult);
+    }
+    else if (placement->enabled)
+    {
+        render_placed(buf, nframes, value, prevvalue, placement, mult);
+    }
+    else
+    {
+        const mod_ramp_kernel_t ramp_kernel = __atomic_load_n(&spi2jack->ramp_kernel, __ATOMIC_ACQUIRE);
+        ramp_kernel(buf, nframes, value, prevvalue, mult);
+    }
+}
+
+// one value per period on the control-rate ports, same values as the audio-rate ones at the end of the period.
+// the change completes at the frame matching the reading time, or the last frame when ramping over the period.
+static void write_control_rate_ports(spi2jack_t* const spi2jack, const jack_nframes_t nframes,
+                                     const exp_pedal_mode_t pedal_mode, const float value1, const float value2,
+                                     const placement_t* const placement)
+{
+    float values[3] = { 0.0f, 0.0f, 0.0f };
+    jack_nframes_t offset = nframes - 1;
+
+    if (placement->enabled && ! placement->resample && placement->end >= 0.0f && placement->end < (float)nframes)
+        offset = (jack_nframes_t)placement->end;
+
+    switch (pedal_mode)
+    {
+    case exp_pedal_mode_port1:
+    case exp_pedal_mode_port2:
+    {
+        const int channel = pedal_mode == exp_pedal_mode_port1 ? 0 : 1;
+        const mod_pedal_map_t* const map = __atomic_load_n(&spi2jack->pedal_map[channel], __ATOMIC_ACQUIRE);
+
+        values[2] = channel == 0 ? value1 : value2;
+
+        if (map->plain)
+            values[2] *= map->gain;
+        else
+            mod_pedal_apply(map, &values[2], 1);
+        break;
+    }
+
+    default:
+        values[0] = value1;
+        values[1] = value2;
+        break;
+    }
+
+    // written even if not connected, so that prevvalue and seq stay meaningful once connected
+    for (int p = 0; p < 3; ++p)
+    {
+        mod_cv_port_buffer_t* const buf = jack_port_get_buffer(spi2jack->portControlRate[p], nframes);
+        mod_cv_port_write(buf, &spi2jack->control_rate_writer[p], values[p], offset);
+    }
+}
+
+// sends control changes for inputs whose quantized value changed, at the given frame.
+// 14-bit mode sends the MSB on the configured cc and the LSB on cc + 32.
+static void write_midi_events(spi2jack_t* const spi2jack, void* const midibuf,
+                              const float value1, const float value2, const jack_nframes_t frame)
+{
+    const float values[2] = { value1, value2 };
+    const float scale = spi2jack->midi_14bit ? 16383.0f : 127.0f;
+
+    for (int c = 0; c < 2; ++c)
+    {
+        if (spi2jack->midi_cc[c] < 0)
+            continue;
+
+        float normalized = values[c] / MOD_CALIBRATION_MAX_VOLTS;
+
+        if (normalized < 0.0f)
+            normalized = 0.0f;
+        else if (normalized > 1.0f)
+            normalized = 1.0f;
+
+        const float scaled = normalized * scale;
+
+        if (spi2jack->midi_last[c] >= 0.0f && fabsf(scaled - spi2jack->midi_last[c]) < 0.5f + MIDI_HYSTERESIS)
+            continue;
+
+        const unsigned quantized = (unsigned)(scaled + 0.5f);
+        const uint8_t status = (uint8_t)(0xB0 | spi2jack->midi_channel);
+
+        if (spi2jack->midi_14bit)
+        {
+            const jack_midi_data_t msb[3] = { status, (uint8_t)spi2jack->midi_cc[c], (uint8_t)(quantized >> 7) };
+            const jack_midi_data_t lsb[3] = { status, (uint8_t)(spi2jack->midi_cc[c] + 32), (uint8_t)(quantized & 0x7f) };
+
+            if (jack_midi_event_write(midibuf, frame, msb, 3) != 0 || jack_midi_event_write(midibuf, frame, lsb, 3) != 0)
+                continue;
+        }
+        else
+        {
+            const jack_midi_data_t msg[3] = { status, (uint8_t)spi2jack->midi_cc[c], (uint8_t)quantized };
+
+            if (jack_midi_event_write(midibuf, frame, msg, 3) != 0)
+                continue;
+        }
+
+        spi2jack->midi_last[c] = (float)quantized;
+    }
+}
+
+// renders queued gate edges at the frame matching their time, within the captured period.
+// buffers are NULL for unconnected ports, returns the frame of the last midi event written.
+static jack_nframes_t process_gate_edges(spi2jack_t* const spi2jack, const jack_nframes_t nframes,
+                                         float* const gate1buf, float* const gate2buf, void* const midibuf)
+{
+    float* const bufs[2] = { gate1buf, gate2buf };
+    jack_nframes_t filled[2] = { 0, 0 };
+    int64_t lastframe[2] = { -1, -1 };
+    jack_nframes_t midiframe = 0;
+
+    jack_nframes_t current_frames;
+    jack_time_t current_usecs, next_usecs;
+    float period_usecs;
+    jack_time_t window_start = 0;
+    float frames_per_usec = 0.0f;
+
+    if (jack_get_cycle_times(spi2jack->client, &current_frames, &current_usecs, &next_usecs, &period_usecs) == 0 &&
+        period_usecs > 0.0f)
+    {
+        window_start = current_usecs - (jack_time_t)period_usecs;
+        frames_per_usec = (float)nframes / period_usecs;
+    }
+
+    edge_ring_t* const ring = &spi2jack->edges;
+    const uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t pos = ring->tail;
+
+    for (; pos != head; ++pos)
+    {
+        const gate_edge_t* const edge = edge_at(ring, pos);
+        const int c = edge->channel;
+
+        int64_t frame = 0;
+
+        if (frames_per_usec != 0.0f && edge->time > window_start)
+            frame = (int64_t)((float)(edge->time - window_start) * frames_per_usec);
+
+        // keep pulses at least one frame long
+        if (frame <= lastframe[c])
+            frame = lastframe[c] + 1;
+        if (frame >= (int64_t)nframes)
+            frame = nframes - 1;
+
+        if (bufs[c] != NULL)
+        {
+            const float value = spi2jack->gate_state[c] ? GATE_HIGH_VOLTS : 0.0f;
+
+            for (jack_nframes_t i = filled[c]; i < (jack_nframes_t)frame; ++i)
+                bufs[c][i] = value;
+        }
+
+        filled[c] = (jack_nframes_t)frame;
+        lastframe[c] = frame;
+        spi2jack->gate_state[c] = edge->high;
+
+        if (midibuf != NULL && spi2jack->gate_note[c] >= 0)
+        {
+            const jack_midi_data_t msg[3] = {
+                (uint8_t)((edge->high ? 0x90 : 0x80) | spi2jack->midi_channel),
+                (uint8_t)spi2jack->gate_note[c],
+                edge->high ? GATE_NOTE_VELOCITY : 0
+            };
+
+            // edges of both inputs can be slightly out of order, midi events must not
+            if ((jack_nframes_t)frame > midiframe)
+                midiframe = (jack_nframes_t)frame;
+
+            jack_midi_event_write(midibuf, midiframe, msg, 3);
+        }
+    }
+
+    __atomic_store_n(&ring->tail, pos, __ATOMIC_RELEASE);
+
+    for (int c = 0; c < 2; ++c)
+    {
+        if (bufs[c] == NULL)
+            continue;
+
+        const float value = spi2jack->gate_state[c] ? GATE_HIGH_VOLTS : 0.0f;
+
+        for (jack_nframes_t i = filled[c]; i < nframes; ++i)
+            bufs[c][i] = value;
+    }
+
+    return midiframe;
+}
+
+static int process_callback(jack_nframes_t nframes, void* arg)
+{
+    spi2jack_t* const spi2jack = (spi2jack_t*)arg;
+
+    const uint64_t start_ns = mod_latency_now_ns();
+
+    float* const port1buf = jack_port_get_buffer(spi2jack->port1, nframes);
+    float* const port2buf = jack_port_get_buffer(spi2jack->port2, nframes);
+    float* const portPbuf = jack_port_get_buffer(spi2jack->portPedal, nframes);
+    void* const midibuf = spi2jack->portMidi != NULL ? jack_port_get_buffer(spi2jack->portMidi, nframes) : NULL;
+    float* const gate1buf = spi2jack->portGate1 != NULL ? jack_port_get_buffer(spi2jack->portGate1, nframes) : NULL;
+    float* const gate2buf = spi2jack->portGate2 != NULL ? jack_port_get_buffer(spi2jack->portGate2, nframes) : NULL;
+
+    if (midibuf != NULL)
+        jack_midi_clear_buffer(midibuf);
+
+    if (spi2jack->ready)
+    {
+        float prevvalue1 = spi2jack->prevvalue1;
+        float prevvalue2 = spi2jack->prevvalue2;
+        const jack_time_t prevtime = spi2jack->prevtime;
+
+        // a new timing mode starts from the latest reading, same as after an xrun
+        const int prevtiming = spi2jack->process_params.timing_mode;
+        const bool retimed = mod_control_load(&spi2jack->control, &spi2jack->process_params_seq,
+                                              &spi2jack->process_params) &&
+                             spi2jack->process_params.timing_mode != prevtiming;
+        const timing_mode_t timing_mode = (timing_mode_t)spi2jack->process_params.timing_mode;
+
+        // the reading thread follows the clock, not freewheeling cycles. hold values then, unless replaying
+        const bool hold = spi2jack->freewheeling && spi2jack->replay.trace.header == NULL;
+        const bool resync = __atomic_exchange_n(&spi2jack->resync, false, __ATOMIC_ACQ_REL) || retimed;
+
+        spi2jack_reading_t reading;
+
+        if (hold || ! load_reading(spi2jack, &reading))
+        {
+            reading.value1 = prevvalue1;
+            reading.value2 = prevvalue2;
+            reading.slope1 = reading.slope2 = 0.0f;
+            reading.time = prevtime;
+        }
+
+        const jack_time_t time = reading.time;
+        float value1 = reading.value1;
+        float value2 = reading.value2;
+
+        placement_t placement;
+        memset(&placement, 0, sizeof(placement));
+
+        if (resync && timing_mode == timing_mode_resample)
+        {
+            drop_resampled(spi2jack);
+
+            // the reading thread may not have queued anything yet
+            if (retimed)
+                spi2jack->resample_last = reading;
+        }
+
+        if (! hold)
+        {
+            switch (timing_mode)
+            {
+            case timing_mode_ramp:
+                break;
+            case timing_mode_placed:
+                calculate_placement(spi2jack, nframes, time, prevtime, &placement);
+                break;
+            case timing_mode_predict:
+                value1 = predict_value(spi2jack, reading.value1, reading.slope1, time);
+                value2 = predict_value(spi2jack, reading.value2, reading.slope2, time);
+                placement.enabled = true;
+                placement.end = (float)nframes;
+                break;
+            case timing_mode_resample:
+                calculate_resample_window(spi2jack, nframes, &placement);
+                break;
+            }
+        }
+
+        // ramping from a value older than one period would be wrong, jump to the latest one instead
+        if (resync)
+        {
+            prevvalue1 = value1;
+            prevvalue2 = value2;
+            placement.enabled = false;
+        }
+
+        spi2jack->prevvalue1 = value1;
+        spi2jack->prevvalue2 = value2;
+        spi2jack->prevtime   = time;
+
+        if (spi2jack->latency_file != NULL)
+        {
+            const jack_time_t now = jack_get_time();
+
+            if (time != 0 && now > time)
+                mod_latency_record(&spi2jack->latency[latency_read_to_process], (now - time) * 1000);
+        }
+
+        const exp_pedal_mode_t pedal_mode = spi2jack->exp_pedal_mode;
+
+        // audio-rate ports are only rendered (or cleared) while connected, nothing reads them otherwise
+        switch (pedal_mode)
+        {
+        case exp_pedal_mode_port1:
+        case exp_pedal_mode_port2:
+            // cv1
+            if (jack_port_connected(spi2jack->port1) > 0)
+                memset(port1buf, 0, sizeof(float)*nframes);
+
+            // cv2
+            if (jack_port_connected(spi2jack->port2) > 0)
+                memset(port2buf, 0, sizeof(float)*nframes);
+
+            // exp.pedal
+            if (jack_port_connected(spi2jack->portPedal) > 0)
+            {
+                const int channel = pedal_mode == exp_pedal_mode_port1 ? 0 : 1;
+                const mod_pedal_map_t* const map = __atomic_load_n(&spi2jack->pedal_map[channel], __ATOMIC_ACQUIRE);
+                const float value = channel == 0 ? value1 : value2;
+                const float prevvalue = channel == 0 ? prevvalue1 : prevvalue2;
+
+                // plain scaling folds into rendering, learned ranges and curves need a pass over the volts
+                if (map->plain)
+                {
+                    render_cv(spi2jack, portPbuf, nframes, channel, value, prevvalue, &placement, map->gain);
+                }
+                else
+                {
+                    render_cv(spi2jack, portPbuf, nframes, channel, value, prevvalue, &placement, 1.0f);
+                    mod_pedal_apply(map, portPbuf, nframes);
+                }
+            }
+            break;
+
+        default:
+            // cv1
+            if (jack_port_connected(spi2jack->port1) > 0)
+                render_cv(spi2jack, port1buf, nframes, 0, value1, prevvalue1, &placement, 1.0f);
+
+            // cv2
+            if (jack_port_connected(spi2jack->port2) > 0)
+                render_cv(spi2jack, port2buf, nframes, 1, value2, prevvalue2, &placement, 1.0f);
+
+            // exp.pedal
+            if (jack_port_connected(spi2jack->portPedal) > 0)
+                memset(portPbuf, 0, sizeof(float)*nframes);
+            break;
+        }
+
+        if (spi2jack->portControlRate[0] != NULL)
+            write_control_rate_ports(spi2jack, nframes, pedal_mode, value1, value2, &placement);
+
+        if (placement.resample)
+            consume_resampled(spi2jack, nframes, &placement);
+
+        const bool midi_connected = midibuf != NULL && jack_port_connected(spi2jack->portMidi) > 0;
+        jack_nframes_t midiframe = 0;
+
+        // gates always use the time of each edge, regardless of timing mode
+        if (spi2jack->gate_enabled)
+        {
+            float* gate1out = gate1buf;
+            float* gate2out = gate2buf;
+
+            if (gate1out != NULL && jack_port_connected(spi2jack->portGate1) <= 0)
+            {
+                memset(gate1out, 0, sizeof(float)*nframes);
+                gate1out = NULL;
+            }
+
+            if (gate2out != NULL && jack_port_connected(spi2jack->portGate2) <= 0)
+            {
+                memset(gate2out, 0, sizeof(float)*nframes);
+                gate2out = NULL;
+            }
+
+            midiframe = process_gate_edges(spi2jack, nframes, gate1out, gate2out, midi_connected ? midibuf : NULL);
+        }
+
+        // midi events go at the frame matching the reading time, or the end of the period when predicting
+        if (midi_connected)
+        {
+            jack_nframes_t frame = nframes - 1;
+
+            if (timing_mode != timing_mode_predict)
+            {
+                placement_t midiplacement;
+                calculate_placement(spi2jack, nframes, time, prevtime, &midiplacement);
+
+                if (midiplacement.enabled && midiplacement.end < (float)nframes)
+                    frame = (jack_nframes_t)midiplacement.end;
+            }
+
+            write_midi_events(spi2jack, midibuf, value1, value2, frame > midiframe ? frame : midiframe);
+        }
+    }
+    else
+    {
+        memset(port1buf, 0, sizeof(float)*nframes);
+        memset(port2buf, 0, sizeof(float)*nframes);
+        memset(portPbuf, 0, sizeof(float)*nframes);
+
+        if (gate1buf != NULL)
+            memset(gate1buf, 0, sizeof(float)*nframes);
+        if (gate2buf != NULL)
+            memset(gate2buf, 0, sizeof(float)*nframes);
+
+        if (spi2jack->portControlRate[0] != NULL)
+        {
+            for (int p = 0; p < 3; ++p)
+                mod_cv_port_clear(jack_port_get_buffer(spi2jack->portControlRate[p], nframes));
+        }
+    }
+
+    if (spi2jack->replay.trace.header != NULL && (spi2jack->replay.fast || spi2jack->freewheeling))
+        sem_post(&spi2jack->replay.sem);
+
+    mod_cv_stats_record_dsp(spi2jack->stats, nframes, mod_latency_now_ns() - start_ns);
+    return 0;
+}
+
+// commands besides the tunables
+static void control_handler(void* arg, int argc, char* argv[], char* reply, size_t size)
+{
+    spi2jack_t* const spi2jack = (spi2jack_t*)arg;
+    const mod_cv_stats_t* const stats = spi2jack->stats;
+
+    if (strcmp(argv[0], "stats") == 0)
+    {
+        // latency histograms are dumped by the latency thread, same as on SIGUSR1
+        if (spi2jack->latency_file != NULL)
+            latency_dump_requested = 1;
+
+        snprintf(reply, size, "ok cycles=%llu reads=%llu parse_failures=%llu wakeups_per_sec=%u xruns=%llu",
+                 (unsigned long long)__atomic_load_n(&stats->cycles, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&stats->reads, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&stats->parse_failures, __ATOMIC_RELAXED),
+                 __atomic_load_n(&stats->wakeups_per_sec, __ATOMIC_RELAXED),
+                 (unsigned long long)__atomic_load_n(&stats->xruns, __ATOMIC_RELAXED));
+        return;
+    }
+
+    snprintf(reply, size, "error unknown command, use list, get, set or stats");
+    return; (void)argc;
+}
+
+static bool open_iio_inputs(const char* const device, FILE** const in1fp, FILE** const in2fp)
+{
+    char filename[512];
+    memset(filename, 0, sizeof(filename));
+
+    snprintf(filename, 511, "%s/name", device);
+    FILE* const fname = fopen(filename, "rb");
+    if (!fname)
+    {
+      fprintf(stderr, "Cannot get iio device\n");
+      return false;
+    }
+
+    char namebuf[32];
+    memset(namebuf, 0, sizeof(namebuf));
+    if (fread(namebuf, sizeof(namebuf), 1, fname) == 0 && feof(fname) == 0)
+    {
+        fprintf(stderr, "Cannot read iio device name\n");
+        fclose(fname);
+        return false;
+    }
+
+    namebuf[sizeof(namebuf)-1] = '\0';
+    namebuf[strlen(namebuf)-1] = '\0';
+    fprintf(stdout, "Opening iio device '%s'...\n", namebuf);
+
+    fclose(fname);
+
+    snprintf(filename, 511, "%s/in_voltage0_raw", device);
+    FILE* const in1f = fopen(filename, "rb");
+    if (!in1f)
+    {
+        fprintf(stderr, "Cannot get iio raw input 1 file\n");
+        return false;
+    }
+
+    snprintf(filename, 511, "%s/in_voltage1_raw", device);
+    FILE* const in2f = fopen(filename, "rb");
+    if (!in2f)
+    {
+        fprintf(stderr, "Cannot get iio raw input 2 file\n");
+        fclose(in1f);
+        return false;
+    }
+
+    *in1fp = in1f;
+    *in2fp = in2f;
+    return true;
+}
+
+JACK_LIB_EXPORT
+int jack_initialize(jack_client_t* client, const char* load_init);
+
+JACK_LIB_EXPORT
+void jack_finish(void* arg);
+
+// everything besides ports and threads, shared by jack_finish and failed startups
+static void close_resources(spi2jack_t* const spi2jack)
+{
+    if (spi2jack->iio_events.fd >= 0)
+        mod_iio_events_close(&spi2jack->iio_events);
+
+    if (spi2jack->in1f != NULL)
+    {
+        fclose(spi2jack->in1f);
+        fclose(spi2jack->in2f);
+    }
+
+    if (spi2jack->replay.trace.header != NULL)
+    {
+        mod_trace_close(&spi2jack->replay.trace);
+        sem_destroy(&spi2jack->replay.sem);
+    }
+
+    mod_trace_close(&spi2jack->trace);
+    mod_alsactl_close(&spi2jack->alsactl);
+
+    if (spi2jack->stats != &spi2jack->local_stats)
+        mod_cv_stats_destroy(spi2jack->stats, MOD_CV_STATS_SPI2JACK);
+
+    if (spi2jack->feed != NULL)
+    {
+        mod_cv_feed_notifier_close(&spi2jack->feed_notifier);
+        mod_cv_feed_destroy(spi2jack->feed, MOD_CV_FEED_SPI2JACK);
+    }
+}
+
+JACK_LIB_EXPORT
+int jack_initialize(jack_client_t* client, const char* load_init)
+{
+    // replaying a trace does not need the device
+    const char* const replay_file = getenv("MOD_SPI2JACK_REPLAY");
+    const bool replay = replay_file != NULL && replay_file[0] != '\0';
+
+    FILE* in1f = NULL;
+    FILE* in2f = NULL;
+
+    if (! replay)
+    {
+        if (load_init == NULL || load_init[0] == '\0')
+        {
+            load_init = getenv("MOD_SPI2JACK_DEVICE");
+
+            if (load_init == NULL || load_init[0] == '\0')
+            {
+              fprintf(stderr, "No spi device selected\n");
+              return EXIT_FAILURE;
+            }
+        }
+
+        if (! open_iio_inputs(load_init, &in1f, &in2f))
+            return EXIT_FAILURE;
+    }
+
+    spi2jack_t* const spi2jack = calloc(sizeof(spi2jack_t), 1);
+    if (!spi2jack)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    // FIXME better way to set this. for now, it works..
+    spi2jack->port_values_are_prescaled = getenv("MOD_SPI2JACK_PRESCALED") != NULL;
+
+    spi2jack->params.poll_divisor  = _get_env_int("MOD_SPI2JACK_POLL_DIVISOR", POLL_DIVISOR_DEFAULT, 1, POLL_DIVISOR_MAX);
+    spi2jack->params.poll_min_rate = _get_env_int("MOD_SPI2JACK_POLL_MIN_RATE", POLL_MIN_RATE_DEFAULT, 1, 1000);
+    spi2jack->params.poll_deadband = _get_env_int("MOD_SPI2JACK_POLL_DEADBAND", POLL_DEADBAND_DEFAULT, 0, MAX_RAW_IIO_VALUE);
+    spi2jack->params.predict_noise = _get_env_int("MOD_SPI2JACK_PREDICT_NOISE", PREDICT_NOISE_DEFAULT, 1, 10000);
+    spi2jack->poll_stats = getenv("MOD_SPI2JACK_POLL_STATS") != NULL;
+
+    // setup timing mode
+    {
+        const char* const timing = getenv("MOD_SPI2JACK_TIMING");
+
+        spi2jack->params.timing_mode = timing_mode_ramp;
 
-                    for (jack_nframes_t i=0; i<nframes; ++i)
-                        port2buf[i] = calculate_jack_value(value2, prevvalue2, i, bufsizelog);
-                }
-            }
-            else
-            {
-                memset(port2buf, 0, sizeof(float)*nframes);
-            }
+        if (timing != NULL && timing[0] != '\0')
+        {
+            int mode = timing_mode_ramp;
+            for (; mode <= timing_mode_resample && strcmp(timing, timing_mode_names[mode]) != 0; ++mode) {}
 
-            // exp.pedal
-            memset(portPbuf, 0, sizeof(float)*nframes);
-            break;
+            if (mode <= timing_mode_resample)
+                spi2jack->params.timing_mode = mode;
+            else
+                fprintf(stderr, "Unknown timing mode '%s', using ramp\n", timing);
         }
     }
-    else
+
+    mod_control_init(&spi2jack->control, spi2jack_params_table,
+                     sizeof(spi2jack_params_table) / sizeof(spi2jack_params_table[0]),
+                     &spi2jack->params, sizeof(spi2jack->params));
+    spi2jack->process_params_seq = MOD_CONTROL_SEQ_NONE;
+    mod_control_load(&spi2jack->control, &spi2jack->process_params_seq, &spi2jack->process_params);
+
+    // setup midi output
+    spi2jack->midi_cc[0]   = _get_env_int("MOD_SPI2JACK_MIDI_CC1", -1, -1, 119);
+    spi2jack->midi_cc[1]   = _get_env_int("MOD_SPI2JACK_MIDI_CC2", -1, -1, 119);
+    spi2jack->midi_channel = (uint8_t)(_get_env_int("MOD_SPI2JACK_MIDI_CHANNEL", 1, 1, 16) - 1);
+    spi2jack->midi_14bit   = _get_env_int("MOD_SPI2JACK_MIDI_14BIT", 0, 0, 1) != 0;
+    spi2jack->midi_last[0] = spi2jack->midi_last[1] = -1.0f;
+
+    if (spi2jack->midi_14bit && (spi2jack->midi_cc[0] >= 32 || spi2jack->midi_cc[1] >= 32))
     {
-        memset(port1buf, 0, sizeof(float)*nframes);
-        memset(port2buf, 0, sizeof(float)*nframes);
-        memset(portPbuf, 0, sizeof(float)*nframes);
+        fprintf(stderr, "14-bit midi needs cc numbers below 32, using 7-bit\n");
+        spi2jack->midi_14bit = false;
     }
 
-    return 0;
-}
+    // setup gate detection, as gate ports and/or midi notes
+    const bool gate_ports = _get_env_int("MOD_SPI2JACK_GATE", 0, 0, 1) != 0;
+    const bool control_rate_ports = _get_env_int("MOD_SPI2JACK_CONTROL_RATE_PORTS", 0, 0, 1) != 0;
+    spi2jack->gate_note[0] = _get_env_int("MOD_SPI2JACK_GATE_NOTE1", -1, -1, 127);
+    spi2jack->gate_note[1] = _get_env_int("MOD_SPI2JACK_GATE_NOTE2", -1, -1, 127);
+    spi2jack->gate_enabled = gate_ports || spi2jack->gate_note[0] >= 0 || spi2jack->gate_note[1] >= 0;
 
-JACK_LIB_EXPORT
-int jack_initialize(jack_client_t* client, const char* load_init);
+    if (spi2jack->gate_enabled)
+    {
+        const int threshold  = _get_env_int("MOD_SPI2JACK_GATE_THRESHOLD", GATE_THRESHOLD_DEFAULT, 1, 10000);
+        const int hysteresis = _get_env_int("MOD_SPI2JACK_GATE_HYSTERESIS", GATE_HYSTERESIS_DEFAULT, 0, threshold - 1);
 
-JACK_LIB_EXPORT
-void jack_finish(void* arg);
+        spi2jack->gate_high_volts = (float)threshold / 1000.0f;
+        spi2jack->gate_low_volts  = (float)(threshold - hysteresis) / 1000.0f;
+    }
 
-JACK_LIB_EXPORT
-int jack_initialize(jack_client_t* client, const char* load_init)
-{
-    if (load_init == NULL || load_init[0] == '\0')
+    // setup raw input recording and replay
     {
-        load_init = getenv("MOD_SPI2JACK_DEVICE");
+        const char* const trace_file = getenv("MOD_SPI2JACK_TRACE");
 
-        if (load_init == NULL || load_init[0] == '\0')
+        if (replay && ! mod_trace_open(&spi2jack->replay.trace, replay_file))
+        {
+            fprintf(stderr, "Cannot open replay trace '%s'\n", replay_file);
+            free(spi2jack);
+            return EXIT_FAILURE;
+        }
+
+        if (replay)
         {
-          fprintf(stderr, "No spi device selected\n");
-          return EXIT_FAILURE;
+            fprintf(stdout, "Replaying trace '%s'...\n", replay_file);
+            spi2jack->replay.fast   = _get_env_int("MOD_SPI2JACK_REPLAY_FAST", 0, 0, 1) != 0;
+            spi2jack->replay.loop   = _get_env_int("MOD_SPI2JACK_REPLAY_LOOP", 0, 0, 1) != 0;
+            spi2jack->replay.raw[0] = spi2jack->replay.raw[1] = -1;
+            sem_init(&spi2jack->replay.sem, 0, 0);
+        }
+
+        if (trace_file != NULL && trace_file[0] != '\0')
+        {
+            const int size = _get_env_int("MOD_SPI2JACK_TRACE_SIZE", TRACE_SIZE_DEFAULT, 1024, 1 << 26);
+            const bool wrap = _get_env_int("MOD_SPI2JACK_TRACE_WRAP", 0, 0, 1) != 0;
+
+            if (mod_trace_create(&spi2jack->trace, trace_file, "spi2jack", (uint64_t)size, wrap))
+                fprintf(stdout, "Recording raw inputs to '%s'\n", trace_file);
+            else
+                fprintf(stderr, "Cannot create trace file '%s', recording disabled\n", trace_file);
         }
     }
 
-    char filename[512];
-    memset(filename, 0, sizeof(filename));
+    // setup telemetry
+    spi2jack->stats = mod_cv_stats_create(MOD_CV_STATS_SPI2JACK);
 
-    snprintf(filename, 511, "%s/name", load_init);
-    FILE* const fname = fopen(filename, "rb");
-    if (!fname)
+    if (spi2jack->stats == NULL)
     {
-      fprintf(stderr, "Cannot get iio device\n");
-      return EXIT_FAILURE;
+        fprintf(stderr, "Cannot create telemetry shared memory, stats will not be published\n");
+        spi2jack->stats = &spi2jack->local_stats;
+        mod_cv_stats_init(spi2jack->stats);
     }
 
-    char namebuf[32];
-    memset(namebuf, 0, sizeof(namebuf));
-    if (fread(namebuf, sizeof(namebuf), 1, fname) == 0 && feof(fname) == 0)
+    // setup value feed, change notifications are optional
+    if (_get_env_int("MOD_SPI2JACK_FEED", 0, 0, 1) != 0)
     {
-        fprintf(stderr, "Cannot read iio device name\n");
-        return EXIT_FAILURE;
-    }
+        spi2jack->feed = mod_cv_feed_create(MOD_CV_FEED_SPI2JACK);
 
-    namebuf[sizeof(namebuf)-1] = '\0';
-    namebuf[strlen(namebuf)-1] = '\0';
-    fprintf(stdout, "Opening iio device '%s'...\n", namebuf);
+        if (spi2jack->feed == NULL)
+            fprintf(stderr, "Cannot create value feed shared memory, feed disabled\n");
+        else if (! mod_cv_feed_notifier_init(&spi2jack->feed_notifier, MOD_CV_FEED_SPI2JACK_SOCKET))
+            fprintf(stderr, "Cannot create value feed socket, change notifications disabled\n");
+    }
 
-    fclose(fname);
+    // setup latency instrumentation
+    spi2jack->latency_file = getenv("MOD_SPI2JACK_LATENCY_FILE");
 
-    snprintf(filename, 511, "%s/in_voltage0_raw", load_init);
-    FILE* const in1f = fopen(filename, "rb");
-    if (!in1f)
+    if (spi2jack->latency_file != NULL && spi2jack->latency_file[0] != '\0')
     {
-        fprintf(stderr, "Cannot get iio raw input 1 file\n");
-        return EXIT_FAILURE;
+        spi2jack->latency_interval = (unsigned)_get_env_int("MOD_SPI2JACK_LATENCY_INTERVAL", 0, 0, 86400);
+        mod_latency_init(&spi2jack->latency[latency_adc_read], "adc read");
+        mod_latency_init(&spi2jack->latency[latency_read_to_process], "adc read to process");
     }
-
-    snprintf(filename, 511, "%s/in_voltage1_raw", load_init);
-    FILE* const in2f = fopen(filename, "rb");
-    if (!in2f)
+    else
     {
-        fprintf(stderr, "Cannot get iio raw input 2 file\n");
-        fclose(in2f);
-        return EXIT_FAILURE;
+        spi2jack->latency_file = NULL;
     }
 
-    spi2jack_t* const spi2jack = calloc(sizeof(spi2jack_t), 1);
-    if (!spi2jack)
+    // setup calibration, ideal linear scaling if missing
     {
-        fprintf(stderr, "Out of memory\n");
-        return EXIT_FAILURE;
-    }
+        mod_calibration_points_t points[MOD_CALIBRATION_CHANNELS];
+        memset(points, 0, sizeof(points));
 
-    // FIXME better way to set this. for now, it works..
-    spi2jack->port_values_are_prescaled = getenv("MOD_SPI2JACK_PRESCALED") != NULL;
+        const char* const calibration = getenv("MOD_SPI2JACK_CALIBRATION");
+        if (calibration != NULL && calibration[0] != '\0')
+        {
+            if (mod_calibration_load(calibration, "in", points))
+                fprintf(stdout, "Using calibration file '%s'\n", calibration);
+            else
+                fprintf(stderr, "Cannot open calibration file '%s', using default scaling\n", calibration);
+        }
 
-    spi2jack->exp_pedal_mode = exp_pedal_mode_unused;
-    spi2jack->in1f = in1f;
-    spi2jack->in2f = in2f;
-    spi2jack->run = true;
+        mod_calibration_build_adc_table(&points[0], spi2jack->adc_table[0]);
+        mod_calibration_build_adc_table(&points[1], spi2jack->adc_table[1]);
+    }
 
-    // setup alsa-mixer listener
-    if (snd_mixer_open(&spi2jack->mixer, SND_MIXER_ELEM_SIMPLE) == 0)
+    // setup exp.pedal scaling, learned ranges are kept in a file if given
     {
-        snd_mixer_selem_id_t* sid;
+        const char* const curve = getenv("MOD_SPI2JACK_PEDAL_CURVE");
 
-        char soundcard[32] = "hw:";
-
-        const char* const cardname = getenv("MOD_SOUNDCARD");
-        if (cardname != NULL)
-            strncat(soundcard, cardname, 28);
+        if (curve == NULL || curve[0] == '\0' || strcmp(curve, "linear") == 0)
+        {
+            spi2jack->pedal_curve = mod_pedal_curve_linear;
+        }
+        else if (strcmp(curve, "log") == 0)
+        {
+            spi2jack->pedal_curve = mod_pedal_curve_log;
+        }
+        else if (strcmp(curve, "antilog") == 0)
+        {
+            spi2jack->pedal_curve = mod_pedal_curve_antilog;
+        }
         else
-            strncat(soundcard, ALSA_SOUNDCARD_DEFAULT_ID, 28);
-
-        soundcard[31] = '\0';
-
-        if (snd_mixer_attach(spi2jack->mixer, soundcard) == 0 &&
-            snd_mixer_selem_register(spi2jack->mixer, NULL, NULL) == 0 &&
-            snd_mixer_load(spi2jack->mixer) == 0 &&
-            snd_mixer_selem_id_malloc(&sid) == 0)
         {
-            // CV/Exp Mode
-            snd_mixer_selem_id_set_index(sid, 0);
-            snd_mixer_selem_id_set_name(sid, ALSA_CONTROL_CV_EXP_MODE);
-            spi2jack->mixerCvExpMode = snd_mixer_find_selem(spi2jack->mixer, sid);
+            fprintf(stderr, "Unknown pedal curve '%s', using linear\n", curve);
+            spi2jack->pedal_curve = mod_pedal_curve_linear;
+        }
+
+        spi2jack->pedal_span  = spi2jack->port_values_are_prescaled ? 10.0f : 5.0f;
+        spi2jack->pedal_learn = _get_env_int("MOD_SPI2JACK_PEDAL_LEARN", 0, 0, 1) != 0;
+        spi2jack->pedal_decay = (unsigned)_get_env_int("MOD_SPI2JACK_PEDAL_DECAY", PEDAL_DECAY_DEFAULT, 0, 604800);
+        spi2jack->pedal_range_file = getenv("MOD_SPI2JACK_PEDAL_RANGE_FILE");
 
-            // Exp.Pedal Mode
-            snd_mixer_selem_id_set_index(sid, 0);
-            snd_mixer_selem_id_set_name(sid, ALSA_CONTROL_EXP_PEDAL_MODE);
-            spi2jack->mixerExpPedalMode = snd_mixer_find_selem(spi2jack->mixer, sid);
+        mod_pedal_range_reset(&spi2jack->pedal_range[0]);
+        mod_pedal_range_reset(&spi2jack->pedal_range[1]);
 
-            snd_mixer_selem_id_free(sid);
+        if (spi2jack->pedal_range_file != NULL && spi2jack->pedal_range_file[0] != '\0')
+        {
+            if (mod_pedal_load(spi2jack->pedal_range_file, spi2jack->pedal_range))
+                fprintf(stdout, "Using pedal ranges from '%s'\n", spi2jack->pedal_range_file);
+            else if (! spi2jack->pedal_learn)
+                fprintf(stderr, "Cannot open pedal range file '%s', using full range\n", spi2jack->pedal_range_file);
+        }
+        else
+        {
+            spi2jack->pedal_range_file = NULL;
         }
 
-        if (spi2jack->mixerCvExpMode == NULL || spi2jack->mixerExpPedalMode == NULL)
+        for (int c = 0; c < 2; ++c)
         {
-            snd_mixer_close(spi2jack->mixer);
-            spi2jack->mixer = NULL;
+            mod_pedal_build_map(&spi2jack->pedal_maps[c][0], &spi2jack->pedal_range[c],
+                                spi2jack->pedal_curve, spi2jack->pedal_span);
+            spi2jack->pedal_map[c] = &spi2jack->pedal_maps[c][0];
         }
     }
 
-    // setup reading thread
-    pthread_attr_t attributes;
-    pthread_attr_init(&attributes);
-    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_JOINABLE);
-    pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
-    pthread_attr_setscope(&attributes, (client != NULL) ? PTHREAD_SCOPE_PROCESS : PTHREAD_SCOPE_SYSTEM);
-    pthread_attr_setschedpolicy(&attributes, SCHED_FIFO);
+    spi2jack->exp_pedal_mode = exp_pedal_mode_unused;
+    spi2jack->in1f = in1f;
+    spi2jack->in2f = in2f;
+    spi2jack->iio_events.fd = -1;
 
-    struct sched_param rt_param;
-    memset(&rt_param, 0, sizeof(rt_param));
-    rt_param.sched_priority = 78;
+    if (in1f != NULL && _get_env_int("MOD_SPI2JACK_IIO_EVENTS", 0, 0, 1) != 0)
+    {
+        if (mod_iio_events_open(&spi2jack->iio_events, load_init))
+            printf("Using iio threshold events while inputs are static\n");
+        else
+            fprintf(stderr, "No iio threshold events on '%s', polling instead\n", load_init);
+    }
+    spi2jack->run = true;
 
-    pthread_attr_setschedparam(&attributes, &rt_param);
+    read_first_values(spi2jack);
 
-    pthread_create(&spi2jack->thread, &attributes, read_spi_thread, (void*)spi2jack);
-    pthread_attr_destroy(&attributes);
+    // setup alsa control listener
+    {
+        const char* const cardname = getenv("MOD_SOUNDCARD");
+
+        if (mod_alsactl_open(&spi2jack->alsactl, cardname != NULL ? cardname : ALSA_SOUNDCARD_DEFAULT_ID))
+        {
+            spi2jack->switchCvExpMode = mod_alsactl_add_switch(&spi2jack->alsactl, ALSA_CONTROL_CV_EXP_MODE);
+            spi2jack->switchExpPedalMode = mod_alsactl_add_switch(&spi2jack->alsactl, ALSA_CONTROL_EXP_PEDAL_MODE);
+
+            if (spi2jack->switchCvExpMode < 0 || spi2jack->switchExpPedalMode < 0)
+                mod_alsactl_close(&spi2jack->alsactl);
+            else
+                spi2jack->exp_pedal_mode = get_exp_pedal_mode(spi2jack);
+        }
+
+        mod_cv_stats_set(&spi2jack->stats->mode, (uint32_t)spi2jack->exp_pedal_mode);
+    }
 
     spi2jack->client = client;
 
     const jack_nframes_t bufsize = jack_get_buffer_size(client);
     spi2jack->bufsize_us = (double)bufsize / (double)jack_get_sample_rate(spi2jack->client) * 1000000.0;
-    spi2jack->bufsize_log = logf((float)bufsize);
+    spi2jack->ramp_kernel = mod_kernels_get_ramp(bufsize);
 
     // Register ports.
     const long unsigned port_flags = JackPortIsTerminal|JackPortIsPhysical|JackPortIsOutput|JackPortIsControlVoltage;
@@ -586,12 +1983,94 @@ int jack_initialize(jack_client_t* client, const char* load_init)
     if (!spi2jack->port1 || !spi2jack->port2 || !spi2jack->portPedal)
     {
         fprintf(stderr, "Can't register jack ports\n");
-        fclose(in1f);
-        fclose(in2f);
+
+        if (spi2jack->port1 != NULL)
+            jack_port_unregister(client, spi2jack->port1);
+        if (spi2jack->port2 != NULL)
+            jack_port_unregister(client, spi2jack->port2);
+        if (spi2jack->portPedal != NULL)
+            jack_port_unregister(client, spi2jack->portPedal);
+
+        close_resources(spi2jack);
         free(spi2jack);
         return EXIT_FAILURE;
     }
 
+    // optional midi output, the client keeps working without it
+    if (spi2jack->midi_cc[0] >= 0 || spi2jack->midi_cc[1] >= 0 ||
+        spi2jack->gate_note[0] >= 0 || spi2jack->gate_note[1] >= 0)
+    {
+        spi2jack->portMidi = jack_port_register(client, "midi_out", JACK_DEFAULT_MIDI_TYPE,
+                                                JackPortIsTerminal|JackPortIsPhysical|JackPortIsOutput, 0);
+
+        if (spi2jack->portMidi != NULL)
+            jack_port_set_alias(spi2jack->portMidi, "CV MIDI");
+        else
+            fprintf(stderr, "Can't register jack midi port, midi output disabled\n");
+    }
+
+    // optional gate outputs, same as above
+    if (gate_ports)
+    {
+        spi2jack->portGate1 = jack_port_register(client, "gate_1", JACK_DEFAULT_AUDIO_TYPE, port_flags, 0);
+        spi2jack->portGate2 = jack_port_register(client, "gate_2", JACK_DEFAULT_AUDIO_TYPE, port_flags, 0);
+
+        if (spi2jack->portGate1 == NULL || spi2jack->portGate2 == NULL)
+        {
+            fprintf(stderr, "Can't register jack gate ports, gate output disabled\n");
+
+            if (spi2jack->portGate1 != NULL)
+                jack_port_unregister(client, spi2jack->portGate1);
+            if (spi2jack->portGate2 != NULL)
+                jack_port_unregister(client, spi2jack->portGate2);
+
+            spi2jack->portGate1 = spi2jack->portGate2 = NULL;
+        }
+    }
+
+    // optional control-rate ports, same as above. JACK2 does not support custom port types
+    if (control_rate_ports)
+    {
+        static const char* const names[3] = { "capture_1_control", "capture_2_control", "exp_pedal_control" };
+        static const char* const aliases[3] = { "CV Capture 1 (control rate)", "CV Capture 2 (control rate)",
+                                                "Expression Pedal (control rate)" };
+        const long unsigned control_rate_flags = JackPortIsTerminal|JackPortIsPhysical|JackPortIsOutput;
+        bool ok = true;
+
+        for (int p = 0; p < 3 && ok; ++p)
+        {
+            spi2jack->portControlRate[p] = mod_cv_port_register(client, names[p], control_rate_flags);
+            ok = spi2jack->portControlRate[p] != NULL;
+        }
+
+        if (ok)
+        {
+            for (int p = 0; p < 3; ++p)
+            {
+                jack_port_set_alias(spi2jack->portControlRate[p], aliases[p]);
+
+                const jack_uuid_t uuid = jack_port_uuid(spi2jack->portControlRate[p]);
+
+                if (!jack_uuid_empty(uuid))
+                {
+                    jack_set_property(client, uuid, JACK_METADATA_PRETTY_NAME, aliases[p], "text/plain");
+                    jack_set_property(client, uuid, JACK_METADATA_SIGNAL_TYPE, "CV", "text/plain");
+                }
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Can't register jack control rate ports, control rate output disabled\n");
+
+            for (int p = 0; p < 3; ++p)
+            {
+                if (spi2jack->portControlRate[p] != NULL)
+                    jack_port_unregister(client, spi2jack->portControlRate[p]);
+                spi2jack->portControlRate[p] = NULL;
+            }
+        }
+    }
+
     // Set port aliases and metadata
     jack_port_set_alias(spi2jack->port1,     "CV Capture 1");
     jack_port_set_alias(spi2jack->port2,     "CV Capture 2");
@@ -625,12 +2104,82 @@ int jack_initialize(jack_client_t* client, const char* load_init)
         jack_set_property(client, uuidPedal, JACK_METADATA_SIGNAL_TYPE, "CV", "text/plain");
         jack_set_property(client, uuidPedal, JACK_METADATA_ORDER, "3", NULL);
         jack_set_property(client, uuidPedal, "http://lv2plug.in/ns/lv2core#minimum", "0", NULL);
-        jack_set_property(client, uuidPedal, "http://lv2plug.in/ns/lv2core#maximum", "5", NULL);
+        jack_set_property(client, uuidPedal, "http://lv2plug.in/ns/lv2core#maximum",
+                          spi2jack->port_values_are_prescaled ? "10" : "5", NULL);
+    }
+
+    if (spi2jack->portGate1 != NULL)
+    {
+        jack_port_set_alias(spi2jack->portGate1, "Gate 1");
+        jack_port_set_alias(spi2jack->portGate2, "Gate 2");
+
+        const jack_uuid_t uuidGate1 = jack_port_uuid(spi2jack->portGate1);
+        const jack_uuid_t uuidGate2 = jack_port_uuid(spi2jack->portGate2);
+
+        if (!jack_uuid_empty(uuidGate1))
+        {
+            jack_set_property(client, uuidGate1, JACK_METADATA_PRETTY_NAME, "Gate 1", "text/plain");
+            jack_set_property(client, uuidGate1, JACK_METADATA_SIGNAL_TYPE, "CV", "text/plain");
+            jack_set_property(client, uuidGate1, JACK_METADATA_ORDER, "4", NULL);
+            jack_set_property(client, uuidGate1, "http://lv2plug.in/ns/lv2core#minimum", "0", NULL);
+            jack_set_property(client, uuidGate1, "http://lv2plug.in/ns/lv2core#maximum", "10", NULL);
+        }
+
+        if (!jack_uuid_empty(uuidGate2))
+        {
+            jack_set_property(client, uuidGate2, JACK_METADATA_PRETTY_NAME, "Gate 2", "text/plain");
+            jack_set_property(client, uuidGate2, JACK_METADATA_SIGNAL_TYPE, "CV", "text/plain");
+            jack_set_property(client, uuidGate2, JACK_METADATA_ORDER, "5", NULL);
+            jack_set_property(client, uuidGate2, "http://lv2plug.in/ns/lv2core#minimum", "0", NULL);
+            jack_set_property(client, uuidGate2, "http://lv2plug.in/ns/lv2core#maximum", "10", NULL);
+        }
+    }
+
+    // setup reading thread, only once nothing else can fail
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_JOINABLE);
+    pthread_attr_setinheritsched(&attributes, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setscope(&attributes, (client != NULL) ? PTHREAD_SCOPE_PROCESS : PTHREAD_SCOPE_SYSTEM);
+    pthread_attr_setschedpolicy(&attributes, SCHED_FIFO);
+
+    struct sched_param rt_param;
+    memset(&rt_param, 0, sizeof(rt_param));
+    rt_param.sched_priority = 78;
+
+    pthread_attr_setschedparam(&attributes, &rt_param);
+
+    if (pthread_create(&spi2jack->thread, &attributes, read_spi_thread, (void*)spi2jack) != 0)
+    {
+        // no permission for realtime scheduling, run as regular thread instead
+        fprintf(stderr, "Cannot create realtime reading thread, using normal priority\n");
+        pthread_create(&spi2jack->thread, NULL, read_spi_thread, (void*)spi2jack);
     }
 
+    pthread_attr_destroy(&attributes);
+
+    if (spi2jack->latency_file != NULL)
+        spi2jack->latency_thread_running =
+            pthread_create(&spi2jack->latency_thread, NULL, latency_thread, spi2jack) == 0;
+
     // Set callbacks
     jack_set_buffer_size_callback(client, buffer_size_callback, spi2jack);
     jack_set_process_callback(client, process_callback, spi2jack);
+    jack_set_xrun_callback(client, xrun_callback, spi2jack);
+    jack_set_freewheel_callback(client, freewheel_callback, spi2jack);
+
+    // setup control socket, last so that every tunable is in place
+    {
+        const char* const control = getenv("MOD_SPI2JACK_CONTROL");
+
+        if (control != NULL && control[0] != '\0')
+        {
+            if (mod_control_listen(&spi2jack->control, control, control_handler, spi2jack))
+                fprintf(stdout, "Listening for control commands on '%s'\n", control);
+            else
+                fprintf(stderr, "Cannot create control socket '%s', live tuning disabled\n", control);
+        }
+    }
 
     // done
     jack_activate(client);
@@ -644,28 +2193,159 @@ void jack_finish(void* arg)
 {
     spi2jack_t* const spi2jack = (spi2jack_t*)arg;
 
+    mod_control_close(&spi2jack->control);
+
     spi2jack->run = false;
     jack_deactivate(spi2jack->client);
 
     pthread_join(spi2jack->thread, NULL);
-    fclose(spi2jack->in1f);
-    fclose(spi2jack->in2f);
+
+    if (spi2jack->latency_thread_running)
+        pthread_join(spi2jack->latency_thread, NULL);
+
+    if (spi2jack->pedal_learn && spi2jack->pedal_range_file != NULL &&
+        ! mod_pedal_save(spi2jack->pedal_range_file, spi2jack->pedal_range))
+        fprintf(stderr, "Cannot write pedal range file '%s'\n", spi2jack->pedal_range_file);
 
     jack_port_unregister(spi2jack->client, spi2jack->port1);
     jack_port_unregister(spi2jack->client, spi2jack->port2);
     jack_port_unregister(spi2jack->client, spi2jack->portPedal);
+
+    if (spi2jack->portMidi != NULL)
+        jack_port_unregister(spi2jack->client, spi2jack->portMidi);
+
+    if (spi2jack->portGate1 != NULL)
+    {
+        jack_port_unregister(spi2jack->client, spi2jack->portGate1);
+        jack_port_unregister(spi2jack->client, spi2jack->portGate2);
+    }
+
+    if (spi2jack->portControlRate[0] != NULL)
+    {
+        for (int p = 0; p < 3; ++p)
+            jack_port_unregister(spi2jack->client, spi2jack->portControlRate[p]);
+    }
+
+    close_resources(spi2jack);
     free(spi2jack);
 }
 
+static float capture_raw_spi_average(FILE* const f)
+{
+    float sum = 0.0f;
+    int raw, count = 0;
+
+    for (int i = 0; i < 64; ++i)
+    {
+        if (read_raw_spi_value(f, &raw))
+        {
+            sum += (float)clamp_raw_value(raw);
+            ++count;
+        }
+
+        usleep(1000);
+    }
+
+    return count != 0 ? sum / (float)count : 0.0f;
+}
+
+static int run_calibration(const char* const device, const char* const filename)
+{
+    char path[512];
+    FILE* inf[MOD_CALIBRATION_CHANNELS];
+
+    for (int c = 0; c < MOD_CALIBRATION_CHANNELS; ++c)
+    {
+        snprintf(path, sizeof(path), "%s/in_voltage%d_raw", device, c);
+        inf[c] = fopen(path, "rb");
+
+        if (inf[c] == NULL)
+        {
+            fprintf(stderr, "Cannot get iio raw input %d file\n", c + 1);
+            return EXIT_FAILURE;
+        }
+    }
+
+    mod_calibration_points_t points[MOD_CALIBRATION_CHANNELS];
+    memset(points, 0, sizeof(points));
+
+    fprintf(stdout, "Apply a reference voltage to the inputs and type its value in volts.\n");
+    fprintf(stdout, "Use 'inN <volts>' to capture a single input, an empty line finishes.\n");
+
+    char line[64];
+    float volts, raw;
+    int channel;
+
+    for (;;)
+    {
+        fputs("> ", stdout);
+        fflush(stdout);
+
+        if (fgets(line, sizeof(line), stdin) == NULL)
+            break;
+
+        if (sscanf(line, "in%d %f", &channel, &volts) == 2)
+        {
+            if (channel < 1 || channel > MOD_CALIBRATION_CHANNELS)
+            {
+                fprintf(stderr, "Invalid input %d\n", channel);
+                continue;
+            }
+        }
+        else if (sscanf(line, "%f", &volts) == 1)
+        {
+            channel = 0;
+        }
+        else
+        {
+            break;
+        }
+
+        for (int c = 0; c < MOD_CALIBRATION_CHANNELS; ++c)
+        {
+            if (channel != 0 && channel != c + 1)
+                continue;
+
+            raw = capture_raw_spi_average(inf[c]);
+            mod_calibration_add_point(&points[c], raw, volts);
+            fprintf(stdout, "in%d: %.4fV at raw %.2f\n", c + 1, volts, raw);
+        }
+    }
+
+    for (int c = 0; c < MOD_CALIBRATION_CHANNELS; ++c)
+        fclose(inf[c]);
+
+    if (! mod_calibration_save(filename, "in", points))
+    {
+        fprintf(stderr, "Cannot write calibration file '%s'\n", filename);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stdout, "Calibration saved to '%s'\n", filename);
+    return EXIT_SUCCESS;
+}
+
 int main(int argc, char* argv[])
 {
+    if (argc > 3 && strcmp(argv[1], "--calibrate") == 0)
+        return run_calibration(argv[2], argv[3]);
+
     if (argc <= 1)
     {
         fprintf(stdout, "Usage: %s <bus-device>\n", argv[0]);
+        fprintf(stdout, "       %s --calibrate <bus-device> <calibration-file>\n", argv[0]);
         fprintf(stdout, "\tWhere bus-device is something like '/sys/bus/iio/devices/iio:device0'\n");
         return EXIT_FAILURE;
     }
 
+    // allow to request a latency dump at any time
+    struct sigaction sig;
+    memset(&sig, 0, sizeof(sig));
+    sig.sa_handler = latency_signal_handler;
+    sig.sa_flags = SA_RESTART;
+    sigemptyset(&sig.sa_mask);
+    sigaction(SIGUSR1, &sig, NULL);
+
     jack_client_t* const client = jack_client_open("mod-spi2jack", JackNoStartServer, NULL);
 
     if (!client)